@@ -27,7 +27,8 @@ class AddressIndexTest(MeritTestFramework):
         self.nodes.append(start_node(1, self.options.tmpdir, ["-debug", "-addressindex"]))
         # Nodes 2/3 are used for testing
         self.nodes.append(start_node(2, self.options.tmpdir, ["-debug", "-addressindex", "-relaypriority=0"]))
-        self.nodes.append(start_node(3, self.options.tmpdir, ["-debug", "-addressindex"]))
+        # Node 3 reads balances from the balance index, node 1 scans for them
+        self.nodes.append(start_node(3, self.options.tmpdir, ["-debug", "-addressindex", "-balanceindex"]))
         connect_nodes(self.nodes[0], 1)
         connect_nodes(self.nodes[0], 2)
         connect_nodes(self.nodes[0], 3)
@@ -95,6 +96,13 @@ class AddressIndexTest(MeritTestFramework):
         assert_equal(height_txids[0], txidb0)
         assert_equal(height_txids[1], txidb1)
 
+        # Check that an end height without a start height is honoured
+        end_txids = self.nodes[1].getaddresstxids({
+            "addresses": ["2N2JD6wb56AfK4tfmM6PwdVmoYk2dCKf4Br"],
+            "end": 110
+        })
+        assert_equal(end_txids, height_txids)
+
         # Check that multiple addresses works
         multitxids = self.nodes[1].getaddresstxids({"addresses": ["2N2JD6wb56AfK4tfmM6PwdVmoYk2dCKf4Br", "mo9ncXisMeAoXwqcV5EWuyncbmCcQN4rVs"]})
         assert_equal(len(multitxids), 6)
@@ -187,6 +195,11 @@ class AddressIndexTest(MeritTestFramework):
         deltas = self.nodes[1].getaddressdeltas({"addresses": [address2], "start": 113, "end": 113})
         assert_equal(len(deltas), 1)
 
+        # Check that deltas are only limited when both start and end are given
+        deltasEnd = self.nodes[1].getaddressdeltas({"addresses": [address2], "end": 112})
+        assert_equal(deltasEnd, deltasAll)
+        assert(any(delta["height"] > 112 for delta in deltasEnd))
+
         # Check that unspent outputs can be queried
         print("Testing utxos...")
         utxos = self.nodes[1].getaddressutxos({"addresses": [address2]})
@@ -206,6 +219,30 @@ class AddressIndexTest(MeritTestFramework):
         balance4 = self.nodes[1].getaddressbalance(address2)
         assert_equal(balance4, balance1)
 
+        # The balance index is reverted with the disconnected block
+        assert_equal(self.nodes[3].getaddressbalance(address2), balance4)
+
+        # Reconnect the block on another branch, then restart so the index
+        # is reopened from disk
+        self.nodes[0].reconsiderblock(best_hash)
+        self.nodes[1].reconsiderblock(best_hash)
+        self.nodes[2].reconsiderblock(best_hash)
+        self.nodes[3].reconsiderblock(best_hash)
+        self.sync_all()
+        assert_equal(self.nodes[3].getaddressbalance(address2), self.nodes[1].getaddressbalance(address2))
+
+        stop_node(self.nodes[3], 3)
+        self.nodes[3] = start_node(3, self.options.tmpdir, ["-debug", "-addressindex", "-balanceindex"])
+        connect_nodes(self.nodes[0], 3)
+        assert_equal(self.nodes[3].getaddressbalance(address2), self.nodes[1].getaddressbalance(address2))
+
+        self.nodes[0].invalidateblock(best_hash)
+        self.nodes[1].invalidateblock(best_hash)
+        self.nodes[2].invalidateblock(best_hash)
+        self.nodes[3].invalidateblock(best_hash)
+        self.sync_all()
+        assert_equal(self.nodes[3].getaddressbalance(address2), balance1)
+
         utxos2 = self.nodes[1].getaddressutxos({"addresses": [address2]})
         assert_equal(len(utxos2), 1)
         assert_equal(utxos2[0]["satoshis"], amount)
@@ -337,6 +374,11 @@ class AddressIndexTest(MeritTestFramework):
         assert_equal(deltas_with_info["end"]["height"], 200)
         assert_equal(deltas_with_info["end"]["hash"], end_block_hash)
 
+        # Indexed balances still match the scanned ones after the reorg and
+        # the restart
+        for address in [address1, address2, address3, "2N2JD6wb56AfK4tfmM6PwdVmoYk2dCKf4Br"]:
+            assert_equal(self.nodes[3].getaddressbalance(address), self.nodes[1].getaddressbalance(address))
+
         utxos_with_info = self.nodes[1].getaddressutxos({"addresses": [address2], "chainInfo": True})
         expected_tip_block_hash = self.nodes[1].getblockhash(267);
         assert_equal(utxos_with_info["height"], 267)
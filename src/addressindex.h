@@ -223,6 +223,93 @@ struct CAddressIndexKey {
 
 };
 
+/** Key of the running totals of an address in the balance index */
+struct CAddressBalanceKey {
+    unsigned int type;
+    uint160 hashBytes;
+    bool invite;
+
+    size_t GetSerializeSize() const {
+        return 21;
+    }
+    template<typename Stream>
+    void Serialize(Stream& s) const {
+        unsigned int encoded_type = invite ? type + 10 : type;
+        ser_writedata8(s, encoded_type);
+        hashBytes.Serialize(s);
+    }
+    template<typename Stream>
+    void Unserialize(Stream& s) {
+        unsigned int encoded_type = ser_readdata8(s);
+        invite = encoded_type >= 10;
+        type = invite ? encoded_type - 10 : encoded_type;
+        hashBytes.Unserialize(s);
+    }
+
+    CAddressBalanceKey(unsigned int addressType, uint160 addressHash, bool is_invite) {
+        type = addressType;
+        hashBytes = addressHash;
+        invite = is_invite;
+    }
+
+    CAddressBalanceKey() {
+        SetNull();
+    }
+
+    void SetNull() {
+        type = 0;
+        hashBytes.SetNull();
+        invite = false;
+    }
+
+    bool operator<(const CAddressBalanceKey& o) const {
+        if (invite != o.invite) {
+            return invite < o.invite;
+        }
+        if (type != o.type) {
+            return type < o.type;
+        }
+        return hashBytes < o.hashBytes;
+    }
+};
+
+/**
+ * Running totals of the address index rows of an address. balance is the
+ * sum of all rows, received of the positive and sent of the negative ones.
+ * txCount is the number of transactions with at least one row.
+ */
+struct CAddressBalanceValue {
+    CAmount balance;
+    CAmount received;
+    CAmount sent;
+    int64_t txCount;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(balance);
+        READWRITE(received);
+        READWRITE(sent);
+        READWRITE(txCount);
+    }
+
+    CAddressBalanceValue() {
+        SetNull();
+    }
+
+    void SetNull() {
+        balance = 0;
+        received = 0;
+        sent = 0;
+        txCount = 0;
+    }
+
+    bool IsNull() const {
+        return balance == 0 && received == 0 && sent == 0 && txCount == 0;
+    }
+};
+
 struct CAddressIndexIteratorKey {
     unsigned int type;
     uint160 hashBytes;
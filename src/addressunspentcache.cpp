@@ -0,0 +1,288 @@
+// Copyright (c) 2018 The Merit Foundation developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "addressunspentcache.h"
+
+#include "chainparams.h"
+#include "clientversion.h"
+#include "hash.h"
+#include "memusage.h"
+#include "random.h"
+#include "streams.h"
+#include "util.h"
+
+#include <assert.h>
+#include <limits>
+
+namespace
+{
+const uint32_t UNSPENT_SNAPSHOT_VERSION = 1;
+}
+
+CAddressUnspentCache::KeyHasher::KeyHasher() :
+    k0(GetRand(std::numeric_limits<uint64_t>::max())),
+    k1(GetRand(std::numeric_limits<uint64_t>::max())) {}
+
+size_t CAddressUnspentCache::KeyHasher::operator()(const CAddressUnspentKey& key) const
+{
+    // An output pays a single address so the outpoint is enough
+    return SipHashUint256Extra(k0, k1, key.txhash, key.index);
+}
+
+CAddressUnspentCache::CAddressUnspentCache()
+{
+    Clear();
+}
+
+size_t CAddressUnspentCache::ShardOf(const CAddressUnspentKey& key)
+{
+    return key.hashBytes.GetUint64(0) % SHARDS;
+}
+
+CAddressUnspentCache::Entries& CAddressUnspentCache::MutableShard(size_t shard)
+{
+    AssertLockHeld(cs);
+    auto& entries = shards[shard];
+    if (!entries.unique()) {
+        entries = std::make_shared<Entries>(*entries);
+    }
+    return *entries;
+}
+
+void CAddressUnspentCache::Add(const CAddressUnspentKey& key, const CAddressUnspentValue& value)
+{
+    LOCK(cs);
+    auto& entries = MutableShard(ShardOf(key));
+
+    const auto inserted = positions.emplace(key, entries.size());
+    if (!inserted.second) {
+        entries[inserted.first->second].second = value;
+        return;
+    }
+
+    entries.emplace_back(key, value);
+}
+
+void CAddressUnspentCache::Erase(const CAddressUnspentKey& key)
+{
+    LOCK(cs);
+    const auto pos = positions.find(key);
+    if (pos == positions.end()) {
+        return;
+    }
+
+    auto& entries = MutableShard(ShardOf(key));
+    const auto i = pos->second;
+    positions.erase(pos);
+
+    assert(i < entries.size());
+    if (i + 1 != entries.size()) {
+        entries[i] = std::move(entries.back());
+        positions[entries[i].first] = i;
+    }
+    entries.pop_back();
+}
+
+void CAddressUnspentCache::Clear()
+{
+    LOCK(cs);
+    shards.clear();
+    for (size_t s = 0; s < SHARDS; s++) {
+        shards.push_back(std::make_shared<Entries>());
+    }
+    positions.clear();
+}
+
+bool CAddressUnspentCache::Load(std::vector<Entries> entries)
+{
+    LOCK(cs);
+    Clear();
+    if (entries.size() != SHARDS) {
+        return false;
+    }
+
+    size_t total = 0;
+    for (const auto& shard : entries) {
+        total += shard.size();
+    }
+    positions.reserve(total);
+
+    for (size_t s = 0; s < SHARDS; s++) {
+        for (size_t i = 0; i < entries[s].size(); i++) {
+            const auto& key = entries[s][i].first;
+            if (ShardOf(key) != s || !positions.emplace(key, i).second) {
+                Clear();
+                return false;
+            }
+        }
+        shards[s] = std::make_shared<Entries>(std::move(entries[s]));
+    }
+    return true;
+}
+
+CAddressUnspentCache::Snapshot CAddressUnspentCache::GetSnapshot() const
+{
+    LOCK(cs);
+    return Snapshot{shards.begin(), shards.end()};
+}
+
+size_t CAddressUnspentCache::Size() const
+{
+    LOCK(cs);
+    return positions.size();
+}
+
+size_t CAddressUnspentCache::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    size_t usage = memusage::DynamicUsage(positions) + memusage::DynamicUsage(shards);
+    for (const auto& entries : shards) {
+        usage += memusage::DynamicUsage(entries) + memusage::DynamicUsage(*entries);
+    }
+    return usage;
+}
+
+bool WriteUnspentSnapshot(
+        const fs::path& path,
+        const uint256& best_block,
+        const CAddressUnspentCache::Snapshot& snapshot)
+{
+    unsigned short randv = 0;
+    GetRandBytes((unsigned char*)&randv, sizeof(randv));
+    const fs::path tmp = path.string() + strprintf(".%04x", randv);
+
+    try {
+        CAutoFile file(fsbridge::fopen(tmp, "wb"), SER_DISK, CLIENT_VERSION);
+        if (file.IsNull()) {
+            return error("%s: Failed to open file %s", __func__, tmp.string());
+        }
+
+        CHashWriter hasher(SER_DISK, CLIENT_VERSION);
+        const uint32_t version = UNSPENT_SNAPSHOT_VERSION;
+        const uint32_t shards = snapshot.size();
+        file << FLATDATA(Params().MessageStart()) << version << best_block << shards;
+        hasher << FLATDATA(Params().MessageStart()) << version << best_block << shards;
+
+        // Each shard is written as one blob so it can be read in one go
+        CDataStream blob(SER_DISK, CLIENT_VERSION);
+        for (const auto& entries : snapshot) {
+            blob.clear();
+            for (const auto& e : *entries) {
+                blob << e.first << e.second;
+            }
+
+            const uint64_t count = entries->size();
+            const uint64_t size = blob.size();
+            file << count << size << blob;
+            hasher << count << size << blob;
+        }
+
+        file << hasher.GetHash();
+        FileCommit(file.Get());
+        file.fclose();
+    } catch (const std::exception& e) {
+        return error("%s: Serialize or I/O error - %s", __func__, e.what());
+    }
+
+    if (!RenameOver(tmp, path)) {
+        return error("%s: Rename-into-place failed", __func__);
+    }
+    return true;
+}
+
+bool ReadUnspentSnapshot(
+        const fs::path& path,
+        const uint256& best_block,
+        CAddressUnspentCache& cache)
+{
+    cache.Clear();
+
+    CAutoFile file(fsbridge::fopen(path, "rb"), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        return false;
+    }
+
+    // Sizes read from the file are checked against what is left of it
+    // before anything is allocated, since the checksum is only known once
+    // everything is read.
+    uint64_t remaining;
+    try {
+        remaining = fs::file_size(path);
+    } catch (const fs::filesystem_error& e) {
+        return error("%s: Failed to get the size of %s - %s", __func__, path.string(), e.what());
+    }
+    const uint64_t header_size = 4 + 4 + 32 + 4;
+    const uint64_t shard_header_size = 8 + 8;
+    const uint64_t checksum_size = 32;
+    const uint64_t min_entry_size = ::GetSerializeSize(UnspentPair{}, SER_DISK, CLIENT_VERSION);
+    if (remaining < header_size + checksum_size) {
+        return error("%s: Snapshot is truncated", __func__);
+    }
+    remaining -= header_size + checksum_size;
+
+    std::vector<CAddressUnspentCache::Entries> entries;
+    try {
+        CHashVerifier<CAutoFile> verifier(&file);
+
+        unsigned char magic[4];
+        uint32_t version;
+        uint256 block;
+        uint32_t shards;
+        verifier >> FLATDATA(magic) >> version >> block >> shards;
+
+        if (memcmp(magic, Params().MessageStart(), sizeof(magic))) {
+            return error("%s: Invalid network magic number", __func__);
+        }
+        if (version != UNSPENT_SNAPSHOT_VERSION || shards != CAddressUnspentCache::SHARDS) {
+            LogPrintf("%s: Unsupported snapshot version %d with %d shards\n", __func__, version, shards);
+            return false;
+        }
+        if (block != best_block) {
+            LogPrintf("%s: Snapshot is at block %s instead of %s\n", __func__, block.GetHex(), best_block.GetHex());
+            return false;
+        }
+
+        entries.resize(shards);
+        for (auto& shard : entries) {
+            uint64_t count;
+            uint64_t size;
+            verifier >> count >> size;
+
+            if (remaining < shard_header_size || size > remaining - shard_header_size) {
+                return error("%s: Shard is larger than the snapshot", __func__);
+            }
+            if (count > size / min_entry_size) {
+                return error("%s: Shard has more outputs than fit in it", __func__);
+            }
+            remaining -= shard_header_size + size;
+
+            CDataStream blob(SER_DISK, CLIENT_VERSION);
+            blob.resize(size);
+            if (size > 0) {
+                verifier.read(&blob[0], size);
+            }
+
+            shard.resize(count);
+            for (auto& e : shard) {
+                blob >> e.first >> e.second;
+            }
+            if (!blob.empty()) {
+                return error("%s: Unexpected data after shard", __func__);
+            }
+        }
+
+        uint256 hash;
+        file >> hash;
+        if (hash != verifier.GetHash()) {
+            return error("%s: Checksum mismatch, data corrupted", __func__);
+        }
+    } catch (const std::exception& e) {
+        return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+    }
+
+    if (!cache.Load(std::move(entries))) {
+        return error("%s: Snapshot has misplaced or duplicate outputs", __func__);
+    }
+    return true;
+}
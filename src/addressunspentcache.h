@@ -0,0 +1,105 @@
+// Copyright (c) 2018 The Merit Foundation developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef MERIT_ADDRESSUNSPENTCACHE_H
+#define MERIT_ADDRESSUNSPENTCACHE_H
+
+#include "addressindex.h"
+#include "fs.h"
+#include "sync.h"
+#include "uint256.h"
+
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using UnspentPair = std::pair<CAddressUnspentKey, CAddressUnspentValue>;
+
+/**
+ * In memory copy of the address unspent index which the CGS scans read.
+ *
+ * The outputs are split into shards by the hash of their address so all
+ * outputs of an address are in the same shard. A shard keeps its outputs
+ * packed in a vector for fast scans and the cache indexes every output by
+ * key, so adding or removing an output is O(1) no matter how many there
+ * are. A removed output is replaced by the last one of its shard.
+ *
+ * Readers take a snapshot which shares the shards with the cache. A shard
+ * changed while a snapshot still holds it is copied first, so snapshots
+ * never change and scanning one does not hold up connecting blocks.
+ */
+class CAddressUnspentCache
+{
+public:
+    using Entries = std::vector<UnspentPair>;
+    using Snapshot = std::vector<std::shared_ptr<const Entries>>;
+
+    static const size_t SHARDS = 128;
+
+    CAddressUnspentCache();
+
+    /** Adds the output or replaces its value if it is already cached */
+    void Add(const CAddressUnspentKey& key, const CAddressUnspentValue& value);
+
+    /** Removes the output if it is cached */
+    void Erase(const CAddressUnspentKey& key);
+
+    void Clear();
+
+    /**
+     * Replaces the content of the cache with the given shards which must
+     * have SHARDS entries. Returns false, leaving the cache empty, if an
+     * output is in the wrong shard or more than once.
+     */
+    bool Load(std::vector<Entries> entries);
+
+    /** Shards in a fixed order. Scanning them in order is a full scan. */
+    Snapshot GetSnapshot() const;
+
+    size_t Size() const;
+    size_t DynamicMemoryUsage() const;
+
+private:
+    class KeyHasher
+    {
+    public:
+        KeyHasher();
+        size_t operator()(const CAddressUnspentKey& key) const;
+
+    private:
+        const uint64_t k0, k1;
+    };
+
+    using Positions = std::unordered_map<CAddressUnspentKey, size_t, KeyHasher>;
+
+    static size_t ShardOf(const CAddressUnspentKey& key);
+
+    /** The shard, copied first if a snapshot still holds it */
+    Entries& MutableShard(size_t shard);
+
+    mutable CCriticalSection cs;
+    std::vector<std::shared_ptr<Entries>> shards;
+    Positions positions;
+};
+
+/**
+ * Writes a snapshot of the cache taken at best_block to path. The file is
+ * checksummed and replaces the previous one atomically.
+ */
+bool WriteUnspentSnapshot(
+        const fs::path& path,
+        const uint256& best_block,
+        const CAddressUnspentCache::Snapshot& snapshot);
+
+/**
+ * Loads the cache from a snapshot file. Fails, leaving the cache empty, if
+ * the file is missing or corrupt or was not written at best_block.
+ */
+bool ReadUnspentSnapshot(
+        const fs::path& path,
+        const uint256& best_block,
+        CAddressUnspentCache& cache);
+
+#endif // MERIT_ADDRESSUNSPENTCACHE_H
@@ -6,6 +6,7 @@
 #include "bench.h"
 
 #include "crypto/sha256.h"
+#include "cuckoo/sipnodes.h"
 #include "key.h"
 #include "validation.h"
 #include "util.h"
@@ -14,7 +15,9 @@
 int
 main(int argc, char** argv)
 {
+    gArgs.ParseParameters(argc, argv);
     SHA256AutoDetect();
+    cuckoo::SipNodesAutoDetect();
     RandomInit();
     ECC_Start();
     SetupEnvironment();
@@ -0,0 +1,86 @@
+// Copyright (c) 2018 The Merit Foundation developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "pog3/cgs.h"
+
+#include <deque>
+#include <string.h>
+
+namespace
+{
+    const size_t TREE_SIZE = 200000;
+
+    /**
+     * Builds a referral tree where a few ambassadors have most of the
+     * network under them, similar to the main network.
+     */
+    void BuildTree(pog3::CGSContext& context)
+    {
+        std::vector<std::vector<size_t>> children(TREE_SIZE);
+        uint64_t rand = 42;
+        for (size_t i = 1; i < TREE_SIZE; i++) {
+            rand = rand * 6364136223846793005ULL + 1442695040888963407ULL;
+            const auto r = rand >> 33;
+
+            //Half of the new entrants join one of the first ambassadors.
+            const auto parent = r % 2 == 0 ? (r >> 1) % std::min<size_t>(i, 16) : (r >> 1) % i;
+            children[parent].push_back(i);
+        }
+
+        pog3::EntrantId next_id = 1;
+        std::deque<size_t> q{0};
+        while (!q.empty()) {
+            const auto n = q.front();
+            q.pop_front();
+
+            referral::Address address;
+            const uint64_t key = n;
+            memcpy(address.begin(), &key, sizeof(key));
+            context.AddEntrant(2, address, 0);
+
+            for (const auto c : children[n]) {
+                context.AddChild(next_id++);
+                q.push_back(c);
+            }
+        }
+
+        context.contributions.assign(TREE_SIZE, pog3::Contribution{});
+        for (size_t i = 0; i < TREE_SIZE; i++) {
+            context.contributions[i].value = (i % 1000) * 100000;
+        }
+    }
+
+    void CgsSubtreeContributions(benchmark::State& state, int threads)
+    {
+        ctpl::thread_pool pool{threads};
+
+        pog3::CGSContext context;
+        context.cgs_pool = &pool;
+        BuildTree(context);
+
+        while (state.KeepRunning()) {
+            pog3::ComputeAllSubtreeContributions(context);
+        }
+    }
+}
+
+static void CgsSubtreeContributions1(benchmark::State& state)
+{
+    CgsSubtreeContributions(state, 1);
+}
+
+static void CgsSubtreeContributions4(benchmark::State& state)
+{
+    CgsSubtreeContributions(state, 4);
+}
+
+static void CgsSubtreeContributions32(benchmark::State& state)
+{
+    CgsSubtreeContributions(state, 32);
+}
+
+BENCHMARK(CgsSubtreeContributions1);
+BENCHMARK(CgsSubtreeContributions4);
+BENCHMARK(CgsSubtreeContributions32);
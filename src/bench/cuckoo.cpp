@@ -0,0 +1,234 @@
+// Copyright (c) 2018 The Merit Foundation developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "chainparams.h"
+#include "cuckoo/mean_cuckoo.h"
+#include "cuckoo/miner.h"
+#include "cuckoo/sipnodes.h"
+#include "util.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+#include <string.h>
+
+/**
+ * Cuckoo cycle benchmarks. The graph benchmarks follow the miner options:
+ *
+ *   -cuckoothreads=<n>  threads solving one graph, like -minepowthreads
+ *   -cuckoobuckets=<n>  graphs solved at the same time, like -minebucketthreads
+ *   -cuckooedgebits=<n> largest edge bits benchmarked (16 to 29, default 20)
+ *
+ * Besides the usual row per benchmark each graph benchmark writes a row per
+ * solver phase, named after the benchmark and the phase, with the time of
+ * the phase in each graph.
+ */
+namespace
+{
+    const int MIN_BENCH_EDGE_BITS = 16;
+    const int MAX_BENCH_EDGE_BITS = 29;
+    const int DEFAULT_BENCH_EDGE_BITS = 20;
+    const uint8_t PROOF_SIZE = 42;
+    const size_t SIPNODES_EDGES = 4096;
+    const size_t VERIFY_HEADERS = 1024;
+
+    using Samples = std::vector<int64_t>;
+
+    uint256 GraphHash(uint64_t n)
+    {
+        uint256 hash;
+        memcpy(hash.begin(), &n, sizeof(n));
+        return hash;
+    }
+
+    void PrintPhase(const std::string& name, Samples samples)
+    {
+        if (samples.empty()) {
+            return;
+        }
+
+        const auto minmax = std::minmax_element(samples.begin(), samples.end());
+        const double average =
+            std::accumulate(samples.begin(), samples.end(), 0.0) / samples.size();
+
+        std::cout << std::fixed << std::setprecision(15) << name << "," << samples.size() << ","
+                  << *minmax.first * 1e-6 << "," << *minmax.second * 1e-6 << "," << average * 1e-6 << ","
+                  << 0 << "," << 0 << "," << 0 << "\n";
+        std::cout.copyfmt(std::ios(nullptr));
+    }
+
+    /** Sum of the rounds [begin, end) of a graph, or nothing if cut short */
+    void AddRounds(const CuckooSolveTimes& times, size_t begin, size_t end, Samples& samples)
+    {
+        // rounds[0] is trimming round 1
+        if (begin >= end || end - 1 > times.rounds.size()) {
+            return;
+        }
+        samples.push_back(std::accumulate(
+                    times.rounds.begin() + begin - 1,
+                    times.rounds.begin() + end - 1,
+                    int64_t{0}));
+    }
+
+    struct PhaseSamples
+    {
+        Samples generate;
+        Samples generate_v;
+        Samples trim;
+        Samples rename;
+        Samples trim_renamed;
+        Samples rename_final;
+        Samples search;
+        Samples recover;
+
+        void Add(const CuckooSolveTimes& times)
+        {
+            const size_t trims = times.rounds.size() + 1;
+            const size_t compress = times.compress_round;
+
+            generate.push_back(times.generate);
+            AddRounds(times, 1, 2, generate_v);
+            AddRounds(times, 2, compress, trim);
+            AddRounds(times, compress, compress + 2, rename);
+            AddRounds(times, compress + 2, trims - 2, trim_renamed);
+            AddRounds(times, trims - 2, trims, rename_final);
+            search.push_back(times.search);
+            if (times.recover > 0) {
+                recover.push_back(times.recover);
+            }
+        }
+
+        void Print(const std::string& name) const
+        {
+            PrintPhase(name + ".generate", generate);
+            PrintPhase(name + ".generate_v", generate_v);
+            PrintPhase(name + ".trim", trim);
+            PrintPhase(name + ".rename", rename);
+            PrintPhase(name + ".trim_renamed", trim_renamed);
+            PrintPhase(name + ".rename_final", rename_final);
+            PrintPhase(name + ".search", search);
+            PrintPhase(name + ".recover", recover);
+        }
+    };
+
+    /**
+     * Each iteration solves one graph on every bucket so the graphs per
+     * second are the number of buckets over the average time.
+     */
+    void CuckooGraph(benchmark::State& state, int edge_bits, const std::string& name)
+    {
+        if (edge_bits > gArgs.GetArg("-cuckooedgebits", DEFAULT_BENCH_EDGE_BITS)) {
+            return;
+        }
+
+        const size_t threads = std::max<int64_t>(1, gArgs.GetArg("-cuckoothreads", 1));
+        const size_t buckets = std::max<int64_t>(1, gArgs.GetArg("-cuckoobuckets", 1));
+
+        ctpl::thread_pool pool{static_cast<int>(threads * buckets)};
+        std::vector<std::unique_ptr<CuckooSolver>> solvers;
+        for (size_t b = 0; b < buckets; b++) {
+            solvers.emplace_back(new CuckooSolver{threads, pool});
+        }
+
+        PhaseSamples phases;
+        uint64_t nonce = 0;
+
+        while (state.KeepRunning()) {
+            std::vector<std::future<void>> graphs;
+            for (const auto& solver : solvers) {
+                const auto hash = GraphHash(nonce++);
+                CuckooSolver* s = solver.get();
+                graphs.push_back(std::async(std::launch::async, [s, hash, edge_bits] {
+                    std::set<uint32_t> cycle;
+                    s->FindCycle(hash, edge_bits, PROOF_SIZE, cycle);
+                }));
+            }
+            for (size_t b = 0; b < graphs.size(); b++) {
+                graphs[b].get();
+                phases.Add(solvers[b]->LastTimes());
+            }
+        }
+
+        phases.Print(name);
+    }
+
+    void CuckooSipNodes(benchmark::State& state, cuckoo::SipNodesFn sipnodes)
+    {
+        siphash_keys keys;
+        const std::string header = GraphHash(42).GetHex();
+        setKeys(header.c_str(), header.size(), &keys);
+
+        std::vector<uint32_t> edges(SIPNODES_EDGES);
+        std::vector<uint32_t> nodes(SIPNODES_EDGES);
+        std::iota(edges.begin(), edges.end(), 0);
+
+        const uint32_t mask = (1U << 29) - 1;
+        while (state.KeepRunning()) {
+            sipnodes(&keys, mask, edges.data(), 0, nodes.data(), edges.size());
+        }
+    }
+
+    struct Register
+    {
+        Register()
+        {
+            for (int edge_bits = MIN_BENCH_EDGE_BITS; edge_bits <= MAX_BENCH_EDGE_BITS; edge_bits++) {
+                const auto name = strprintf("CuckooGraph%d", edge_bits);
+                benchmark::BenchRunner{name, [edge_bits, name](benchmark::State& state) {
+                    CuckooGraph(state, edge_bits, name);
+                }};
+            }
+
+            // Hashes SIPNODES_EDGES nodes per iteration
+            for (const auto& impl : cuckoo::SupportedSipNodes()) {
+                const auto fn = impl.fn;
+                benchmark::BenchRunner{strprintf("CuckooSipNodes_%s", impl.name), [fn](benchmark::State& state) {
+                    CuckooSipNodes(state, fn);
+                }};
+            }
+        }
+    };
+
+    Register cuckoo_benchmarks;
+}
+
+// Verifies the proof of work of one header per iteration
+static void CuckooVerifyHeader(benchmark::State& state)
+{
+    SelectParams(CBaseChainParams::MAIN);
+    const auto& params = Params().GetConsensus();
+    const auto& genesis = Params().GenesisBlock();
+    const auto hash = genesis.GetHash();
+
+    while (state.KeepRunning()) {
+        bool ok = cuckoo::VerifyProofOfWork(hash, genesis.nBits, genesis.nEdgeBits, genesis.sCycle, params);
+        assert(ok);
+    }
+}
+
+// Verifies VERIFY_HEADERS headers per iteration in parallel batches
+static void CuckooVerifyHeaders(benchmark::State& state)
+{
+    SelectParams(CBaseChainParams::MAIN);
+    const auto& params = Params().GetConsensus();
+    const auto& genesis = Params().GenesisBlock();
+
+    const cuckoo::PowCheck check{genesis.GetHash(), genesis.nBits, genesis.nEdgeBits, &genesis.sCycle};
+    const cuckoo::PowChecks checks(VERIFY_HEADERS, check);
+
+    const auto threads = std::max<int64_t>(1, gArgs.GetArg("-cuckoothreads", GetNumCores()));
+    ctpl::thread_pool pool{static_cast<int>(threads)};
+
+    while (state.KeepRunning()) {
+        auto failed = cuckoo::VerifyProofsOfWork(checks, params, &pool);
+        assert(failed == checks.size());
+    }
+}
+
+BENCHMARK(CuckooVerifyHeader);
+BENCHMARK(CuckooVerifyHeaders);
@@ -6,6 +6,11 @@
 
 #include "chain.h"
 
+#include "sync.h"
+
+#include <memory>
+#include <stdexcept>
+
 /**
  * CChain implementation
  */
@@ -81,6 +86,135 @@ int static inline GetSkipHeight(int height) {
     return (height & 1) ? InvertLowestOne(InvertLowestOne(height - 1)) + 1 : InvertLowestOne(height);
 }
 
+namespace {
+
+/**
+ * Chunks of cycle slots and the slots freed by pruned cycles. Slots are
+ * only read or written under cs so a cycle pruned by one thread is never
+ * read half overwritten by another.
+ */
+struct CycleStore
+{
+    static const size_t CHUNK_SIZE = 4096;
+
+    CCriticalSection cs;
+    std::vector<std::unique_ptr<CCycle[]>> chunks;
+    size_t chunk_used = CHUNK_SIZE;
+    std::vector<CCycle*> free_slots;
+
+    CCycle* Allocate()
+    {
+        AssertLockHeld(cs);
+        if (!free_slots.empty()) {
+            CCycle* slot = free_slots.back();
+            free_slots.pop_back();
+            return slot;
+        }
+        if (chunk_used == CHUNK_SIZE) {
+            chunks.emplace_back(new CCycle[CHUNK_SIZE]);
+            chunk_used = 0;
+        }
+        return &chunks.back()[chunk_used++];
+    }
+
+    void Free(CCycle* slot)
+    {
+        AssertLockHeld(cs);
+        free_slots.push_back(slot);
+    }
+};
+
+// Never destroyed so entries outliving static destruction can still free
+// their slots.
+CycleStore& GetCycleStore()
+{
+    static CycleStore* store = new CycleStore;
+    return *store;
+}
+
+}
+
+CCycleSlot::CCycleSlot(const CCycleSlot& other)
+{
+    CCycle copy;
+    if (other.Get(copy)) {
+        Set(copy);
+    }
+}
+
+CCycleSlot& CCycleSlot::operator=(const CCycleSlot& other)
+{
+    if (this != &other) {
+        CCycle copy;
+        if (other.Get(copy)) {
+            Set(copy);
+        } else {
+            Clear();
+        }
+    }
+    return *this;
+}
+
+CCycleSlot::~CCycleSlot()
+{
+    Clear();
+}
+
+bool CCycleSlot::Get(CCycle& out) const
+{
+    auto& store = GetCycleStore();
+    LOCK(store.cs);
+    if (!cycle) {
+        return false;
+    }
+    out = *cycle;
+    return true;
+}
+
+void CCycleSlot::Set(const CCycle& in)
+{
+    auto& store = GetCycleStore();
+    LOCK(store.cs);
+    if (!cycle) {
+        cycle = store.Allocate();
+    }
+    *cycle = in;
+}
+
+void CCycleSlot::Clear()
+{
+    auto& store = GetCycleStore();
+    LOCK(store.cs);
+    if (cycle) {
+        store.Free(cycle);
+        cycle = nullptr;
+    }
+}
+
+CCycle CBlockIndex::GetCycle() const
+{
+    CCycle stored;
+    if (cycle.Get(stored)) {
+        return stored;
+    }
+
+    if (!phashBlock || !ReadBlockIndexCycle(GetBlockHash(), stored)) {
+        throw std::runtime_error(strprintf("%s: failed to read the cycle of block %s",
+                    __func__, phashBlock ? GetBlockHash().ToString() : "null"));
+    }
+    return stored;
+}
+
+void CBlockIndex::SetCycle(const CCycle& cycle_in)
+{
+    cycle.Set(cycle_in);
+}
+
+void CBlockIndex::PruneCycle()
+{
+    cycle.Clear();
+}
+
 CBlockIndex* CBlockIndex::GetAncestor(int height)
 {
     if (height > nHeight || height < 0)
@@ -163,6 +163,31 @@ enum BlockStatus: uint32_t {
     BLOCK_OPT_WITNESS       =   128, //!< block data in blk*.data was received with a witness-enforcing client
 };
 
+/**
+ * Holds the cuckoo cycle of a block index entry. Cycles are kept in large
+ * chunks shared by all entries so an entry does not allocate one of its
+ * own, and the slot of a pruned cycle is reused by the next entry. A copy
+ * gets a slot of its own.
+ */
+class CCycleSlot
+{
+public:
+    CCycleSlot() {}
+    CCycleSlot(const CCycleSlot& other);
+    CCycleSlot& operator=(const CCycleSlot& other);
+    ~CCycleSlot();
+
+    /** False if the cycle is not in memory */
+    bool Get(CCycle& cycle) const;
+    void Set(const CCycle& cycle);
+
+    /** Drops the cycle from memory, freeing the slot */
+    void Clear();
+
+private:
+    CCycle* cycle = nullptr;
+};
+
 /** The block chain is a tree shaped structure starting with the
  * genesis block at the root, with each block potentially having multiple
  * candidates to be the next block. A blockindex may have multiple pprev pointing
@@ -215,7 +240,9 @@ public:
     unsigned int nNonce;
     uint8_t nEdgeBits;
 
-    std::set<uint32_t> sCycle;
+    //! The cuckoo cycle of the header. Empty once pruned from memory, read
+    //! it with GetCycle.
+    CCycleSlot cycle;
 
     //! (memory only) Sequential id assigned to distinguish order in which blocks are received.
     int32_t nSequenceId;
@@ -245,7 +272,7 @@ public:
         nBits          = 0;
         nNonce         = 0;
         nEdgeBits      = 0;
-        sCycle.clear();
+        cycle.Clear();
     }
 
     CBlockIndex()
@@ -263,9 +290,23 @@ public:
         nBits          = block.nBits;
         nNonce         = block.nNonce;
         nEdgeBits      = block.nEdgeBits;
-        sCycle         = block.sCycle;
+        cycle.Set(block.sCycle);
     }
 
+    /**
+     * Returns the cuckoo cycle of the header. A cycle pruned from memory is
+     * read from the block tree DB through a small cache.
+     */
+    CCycle GetCycle() const;
+
+    void SetCycle(const CCycle& cycle);
+
+    /**
+     * Drops the cycle from memory. The index entry must already be written
+     * to the block tree DB.
+     */
+    void PruneCycle();
+
     CDiskBlockPos GetBlockPos() const {
         CDiskBlockPos ret;
         if (nStatus & BLOCK_HAVE_DATA) {
@@ -295,7 +336,7 @@ public:
         block.nBits          = nBits;
         block.nNonce         = nNonce;
         block.nEdgeBits     = nEdgeBits;
-        block.sCycle       = sCycle;
+        block.sCycle       = GetCycle();
         return block;
     }
 
@@ -375,6 +416,12 @@ int64_t GetBlockProofEquivalentTime(const CBlockIndex& to, const CBlockIndex& fr
 /** Find the forking point between two chain tips. */
 const CBlockIndex* LastCommonAncestor(const CBlockIndex* pa, const CBlockIndex* pb);
 
+/**
+ * Reads the cycle of a block index entry whose cycle was pruned from memory.
+ * Implemented by the block tree DB.
+ */
+bool ReadBlockIndexCycle(const uint256& hash, CCycle& cycle);
+
 
 /** Used to marshal pointers into hashes for db storage. */
 class CDiskBlockIndex : public CBlockIndex
@@ -416,7 +463,14 @@ public:
         READWRITE(nBits);
         READWRITE(nNonce);
         READWRITE(nEdgeBits);
-        READWRITE(sCycle);
+        if (ser_action.ForRead()) {
+            CCycle stored;
+            READWRITE(stored);
+            SetCycle(stored);
+        } else {
+            CCycle stored = GetCycle();
+            READWRITE(stored);
+        }
     }
 
     uint256 GetBlockHash() const
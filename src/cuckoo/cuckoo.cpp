@@ -11,6 +11,7 @@
  **/
 
 #include "cuckoo.h"
+#include "sipnodes.h"
 #include "consensus/consensus.h"
 #include "util.h"
 
@@ -238,9 +239,6 @@ int VerifyCycle(const uint256& hash, uint8_t edgeBits, uint8_t proofSize, const
 
     setKeys(hashStr.c_str(), hashStr.size(), &keys);
 
-    std::vector<uint32_t> uvs(2 * proofSize);
-    uint32_t xor0 = 0, xor1 = 0;
-
     for (uint32_t n = 0; n < proofSize; n++) {
         if (cycle[n] > edgeMask) {
             return POW_TOO_BIG;
@@ -249,9 +247,20 @@ int VerifyCycle(const uint256& hash, uint8_t edgeBits, uint8_t proofSize, const
         if (n && cycle[n] <= cycle[n - 1]) {
             return POW_TOO_SMALL;
         }
+    }
+
+    // The endpoints of all edges are hashed at once with the fastest
+    // siphash implementation of the CPU.
+    std::vector<uint32_t> us(proofSize), vs(proofSize);
+    cuckoo::SipNodes(&keys, edgeMask, cycle.data(), 0, us.data(), proofSize);
+    cuckoo::SipNodes(&keys, edgeMask, cycle.data(), 1, vs.data(), proofSize);
 
-        xor0 ^= uvs[2 * n] = sipnode(&keys, edgeMask, cycle[n], 0);
-        xor1 ^= uvs[2 * n + 1] = sipnode(&keys, edgeMask, cycle[n], 1);
+    std::vector<uint32_t> uvs(2 * proofSize);
+    uint32_t xor0 = 0, xor1 = 0;
+
+    for (uint32_t n = 0; n < proofSize; n++) {
+        xor0 ^= uvs[2 * n] = us[n] << 1;
+        xor1 ^= uvs[2 * n + 1] = vs[n] << 1 | 1;
     }
 
     // matching endpoints imply zero xors
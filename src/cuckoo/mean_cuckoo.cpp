@@ -12,19 +12,25 @@
 
 #include "mean_cuckoo.h"
 #include "cuckoo.h"
+#include "sipnodes.h"
 
 #include "consensus/consensus.h"
-#include "crypto/siphashxN.h"
 #include "tinyformat.h"
 #include <bitset>
+#include <chrono>
 #include <condition_variable>
+#include <future>
 #include <mutex>
+#include <new>
 #include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
 #include <thread>
 #include <unistd.h>
-#include <x86intrin.h>
 
 // algorithm/performance parameters
 
@@ -49,19 +55,16 @@
 // and directly count YZ values in a cache friendly 32KB.
 // A final pair of compression rounds remap YZ values from 15 into 11 bits.
 
-#ifdef __AVX2__
-
-#ifndef NSIPHASH
-#define NSIPHASH 8
-#endif
+// Nodes are generated in batches with the siphash implementation selected
+// at startup by cuckoo::SipNodesAutoDetect.
+static const uint32_t SIPNODES_BATCH = 64;
 
-#else
+using Clock = std::chrono::steady_clock;
 
-#ifndef NSIPHASH
-#define NSIPHASH 1
-#endif
-
-#endif
+static int64_t Micros(Clock::time_point begin, Clock::time_point end)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count();
+}
 
 
 // for p close to 0, Pr(X>=k) < e^{-n*p*eps^2} where k=n*p*(1+eps)
@@ -80,6 +83,40 @@
 #define TRIMFRAC256 184
 #endif
 
+// Arenas are aligned to huge page boundaries and, where the kernel supports
+// it, backed by transparent huge pages to cut page faults and TLB misses.
+static const size_t ARENA_ALIGNMENT = 2 << 20;
+
+template <typename T>
+T* AllocArena(size_t n)
+{
+    const size_t bytes = n * sizeof(T);
+    void* p = nullptr;
+#ifdef WIN32
+    p = _aligned_malloc(bytes, ARENA_ALIGNMENT);
+#else
+    if (posix_memalign(&p, ARENA_ALIGNMENT, bytes) != 0) {
+        p = nullptr;
+    }
+#endif
+    if (!p) {
+        throw std::bad_alloc();
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(p, bytes, MADV_HUGEPAGE);
+#endif
+    return static_cast<T*>(p);
+}
+
+inline void FreeArena(void* p)
+{
+#ifdef WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
 class Barrier
 {
 public:
@@ -89,17 +126,21 @@ public:
     {
     }
 
-    void Wait()
+    // Returns true if the token was cancelled when the last thread arrived.
+    // The token is sampled once so that every thread makes the same choice.
+    bool Wait(const CuckooCancelToken* cancel = nullptr)
     {
         std::unique_lock<std::mutex> lLock{mMutex};
         auto lGen = nGeneration;
         if (!--nCount) {
             nGeneration++;
             nCount = nThreads;
+            fStop = cancel && cancel->IsCancelled();
             cv.notify_all();
         } else {
             cv.wait(lLock, [this, lGen] { return lGen != nGeneration; });
         }
+        return fStop;
     }
 
 private:
@@ -108,6 +149,7 @@ private:
     std::size_t nThreads;
     std::size_t nCount;
     std::size_t nGeneration;
+    bool fStop = false;
 };
 
 template <uint8_t EDGEBITS, uint8_t XBITS>
@@ -265,6 +307,18 @@ void etworker(edgetrimmer<offset_t, EDGEBITS, XBITS>* et, uint32_t id)
     et->trimmer(id);
 }
 
+template <typename offset_t, uint8_t EDGEBITS, uint8_t XBITS>
+void genworker(edgetrimmer<offset_t, EDGEBITS, XBITS>* et, uint32_t id)
+{
+    et->genUnodes(id, 0);
+}
+
+template <typename offset_t, uint8_t EDGEBITS, uint8_t XBITS>
+void roundsworker(edgetrimmer<offset_t, EDGEBITS, XBITS>* et, uint32_t id)
+{
+    et->trimrounds(id);
+}
+
 template <typename offset_t, uint8_t EDGEBITS, uint8_t XBITS>
 void matchworker(solver_ctx<offset_t, EDGEBITS, XBITS>* solver, uint32_t id)
 {
@@ -312,6 +366,11 @@ public:
     ctpl::thread_pool& pool;
     uint32_t nTrims;
     Barrier* barry;
+    const CuckooCancelToken* cancel;
+
+    // End of every trimming round. Recorded by thread 0 once all threads
+    // passed the barrier so these cover the slowest thread of the round.
+    std::vector<Clock::time_point> round_ends;
 
     using BIGTYPE0 = offset_t;
 
@@ -324,16 +383,17 @@ public:
     edgetrimmer(
             ctpl::thread_pool& poolIn,
             size_t nThreadsIn,
-            const uint32_t nTrimsIn) : pool{poolIn}, nTrims{nTrimsIn}
+            const uint32_t nTrimsIn,
+            const CuckooCancelToken* cancelIn) : pool{poolIn}, nTrims{nTrimsIn}, cancel{cancelIn}
     {
         assert(sizeof(matrix<EDGEBITS, XBITS, P::ZBUCKETSIZE>) == P::NX * sizeof(yzbucketZ));
         assert(sizeof(matrix<EDGEBITS, XBITS, P::ZBUCKETSIZE>) == P::NX * sizeof(yzbucketZ));
 
         nThreads = nThreadsIn;
 
-        buckets = new yzbucketZ[P::NX];
+        buckets = AllocArena<yzbucketZ>(P::NX);
         touch((uint8_t*)buckets, sizeof(matrix<EDGEBITS, XBITS, P::ZBUCKETSIZE>));
-        tbuckets = new yzbucketT[nThreads];
+        tbuckets = AllocArena<yzbucketT>(nThreads);
         touch((uint8_t*)tbuckets, nThreads * sizeof(yzbucketT));
 
         tedges = new zbucket32P[nThreads];
@@ -345,14 +405,26 @@ public:
     }
     ~edgetrimmer()
     {
-        delete[] buckets;
-        delete[] tbuckets;
+        FreeArena(buckets);
+        FreeArena(tbuckets);
         delete[] tedges;
         delete[] tdegs;
         delete[] tzs;
         delete[] tcounts;
         delete barry;
     }
+    bool cancelled() const
+    {
+        return cancel && cancel->IsCancelled();
+    }
+
+    void roundend(const uint32_t id)
+    {
+        if (id == 0) {
+            round_ends.push_back(Clock::now());
+        }
+    }
+
     offset_t count() const
     {
         offset_t cnt = 0;
@@ -361,40 +433,12 @@ public:
         return cnt;
     }
 
-#if NSIPHASH == 8
-
-    template <int x, int i>
-    void store(
-        uint8_t const* base,
-        uint32_t& ux,
-        indexerZ& dst,
-        uint32_t last[],
-        const uint32_t edge,
-        __m256i v,
-        __m256i w)
-    {
-        if (!P::NEEDSYNC) {
-            ux = _mm256_extract_epi32(v, x);
-            *(uint64_t*)(base + dst.index[ux]) = _mm256_extract_epi64(w, i % 4);
-            dst.index[ux] += P::BIGSIZE0;
-        } else {
-            uint32_t zz = _mm256_extract_epi32(w, x);
-
-            if (i || likely(zz)) {
-                ux = _mm256_extract_epi32(v, x);
-                for (; unlikely(last[ux] + P::NNONYZ <= edge + i); last[ux] += P::NNONYZ, dst.index[ux] += P::BIGSIZE0)
-                    *(uint32_t*)(base + dst.index[ux]) = 0;
-                *(uint32_t*)(base + dst.index[ux]) = zz;
-                dst.index[ux] += P::BIGSIZE0;
-                last[ux] = edge + i;
-            }
-        }
-    }
-#endif
-
     void genUnodes(const uint32_t id, const uint32_t uorv)
     {
         uint32_t last[P::NX];
+        uint32_t nonces[SIPNODES_BATCH];
+        uint32_t nodes[SIPNODES_BATCH];
+        const cuckoo::SipNodesFn sipnodes = cuckoo::SipNodes;
 
         uint8_t const* base = (uint8_t*)buckets;
         indexerZ dst;
@@ -404,27 +448,8 @@ public:
         uint32_t edge = starty << P::YZBITS;
         uint32_t endedge = edge + P::NYZ;
 
-#if NSIPHASH == 8
-            static const __m256i vxmask = {P::XMASK, P::XMASK, P::XMASK, P::XMASK};
-            static const __m256i vyzmask = {P::YZMASK, P::YZMASK, P::YZMASK, P::YZMASK};
-            const __m256i vinit = _mm256_set_epi64x(
-                sip_keys.k1 ^ 0x7465646279746573ULL,
-                sip_keys.k0 ^ 0x6c7967656e657261ULL,
-                sip_keys.k1 ^ 0x646f72616e646f6dULL,
-                sip_keys.k0 ^ 0x736f6d6570736575ULL);
-            __m256i v0, v1, v2, v3, v4, v5, v6, v7;
-            const uint32_t e2 = 2 * edge + uorv;
-            __m256i vpacket0 = _mm256_set_epi64x(e2 + 6, e2 + 4, e2 + 2, e2 + 0);
-            __m256i vpacket1 = _mm256_set_epi64x(e2 + 14, e2 + 12, e2 + 10, e2 + 8);
-            static const __m256i vpacketinc = {16, 16, 16, 16};
-            uint64_t e1 = edge;
-            __m256i vhi0 = _mm256_set_epi64x((e1 + 3) << P::YZBITS, (e1 + 2) << P::YZBITS, (e1 + 1) << P::YZBITS, (e1 + 0) << P::YZBITS);
-            __m256i vhi1 = _mm256_set_epi64x((e1 + 7) << P::YZBITS, (e1 + 6) << P::YZBITS, (e1 + 5) << P::YZBITS, (e1 + 4) << P::YZBITS);
-            static const __m256i vhiinc = {8 << P::YZBITS, 8 << P::YZBITS, 8 << P::YZBITS, 8 << P::YZBITS};
-#endif
-
         offset_t sumsize = 0;
-        for (uint32_t my = starty; my < endy; my++, endedge += P::NYZ) {
+        for (uint32_t my = starty; my < endy && !cancelled(); my++, endedge += P::NYZ) {
             dst.matrixv(my);
 
             if (P::NEEDSYNC) {
@@ -433,76 +458,35 @@ public:
                 }
             }
             // edge is a "nonce" for sipnode()
-            for (; edge < endedge; edge += NSIPHASH) {
-            // bit        28..21     20..13    12..0
-            // node       XXXXXX     YYYYYY    ZZZZZ
-
-#if NSIPHASH == 1
-                const uint32_t node = _sipnode(&sip_keys, P::EDGEMASK, edge, uorv);
-                const uint32_t ux = node >> P::YZBITS;
-                const BIGTYPE0 zz = (BIGTYPE0)edge << P::YZBITS | (node & P::YZMASK);
-
-                if (!P::NEEDSYNC) {
-                    // bit        39..21     20..13    12..0
-                    // write        edge     YYYYYY    ZZZZZ
-                    *(BIGTYPE0*)(base + dst.index[ux]) = zz;
-                    dst.index[ux] += P::BIGSIZE0;
-                } else {
-                    if (zz) {
-                        for (; unlikely(last[ux] + P::NNONYZ <= edge); last[ux] += P::NNONYZ, dst.index[ux] += P::BIGSIZE0)
-                            *(uint32_t*)(base + dst.index[ux]) = 0;
-                        *(uint32_t*)(base + dst.index[ux]) = zz;
+            for (uint32_t n; edge < endedge; edge += n) {
+                n = std::min(SIPNODES_BATCH, endedge - edge);
+                for (uint32_t i = 0; i < n; i++) {
+                    nonces[i] = edge + i;
+                }
+                sipnodes(&sip_keys, P::EDGEMASK, nonces, uorv, nodes, n);
+
+                for (uint32_t i = 0; i < n; i++) {
+                    // bit        28..21     20..13    12..0
+                    // node       XXXXXX     YYYYYY    ZZZZZ
+                    const uint32_t node = nodes[i];
+                    const uint32_t ux = node >> P::YZBITS;
+                    const BIGTYPE0 zz = (BIGTYPE0)(edge + i) << P::YZBITS | (node & P::YZMASK);
+
+                    if (!P::NEEDSYNC) {
+                        // bit        39..21     20..13    12..0
+                        // write        edge     YYYYYY    ZZZZZ
+                        *(BIGTYPE0*)(base + dst.index[ux]) = zz;
                         dst.index[ux] += P::BIGSIZE0;
-                        last[ux] = edge;
+                    } else {
+                        if (zz) {
+                            for (; unlikely(last[ux] + P::NNONYZ <= edge + i); last[ux] += P::NNONYZ, dst.index[ux] += P::BIGSIZE0)
+                                *(uint32_t*)(base + dst.index[ux]) = 0;
+                            *(uint32_t*)(base + dst.index[ux]) = zz;
+                            dst.index[ux] += P::BIGSIZE0;
+                            last[ux] = edge + i;
+                        }
                     }
                 }
-#elif NSIPHASH == 8
-                v3 = _mm256_permute4x64_epi64(vinit, 0xFF);
-                v0 = _mm256_permute4x64_epi64(vinit, 0x00);
-                v1 = _mm256_permute4x64_epi64(vinit, 0x55);
-                v2 = _mm256_permute4x64_epi64(vinit, 0xAA);
-                v7 = _mm256_permute4x64_epi64(vinit, 0xFF);
-                v4 = _mm256_permute4x64_epi64(vinit, 0x00);
-                v5 = _mm256_permute4x64_epi64(vinit, 0x55);
-                v6 = _mm256_permute4x64_epi64(vinit, 0xAA);
-
-                v3 = XOR(v3, vpacket0);
-                v7 = XOR(v7, vpacket1);
-                SIPROUNDX8;
-                SIPROUNDX8;
-                v0 = XOR(v0, vpacket0);
-                v4 = XOR(v4, vpacket1);
-                v2 = XOR(v2, _mm256_broadcastq_epi64(_mm_cvtsi64_si128(0xff)));
-                v6 = XOR(v6, _mm256_broadcastq_epi64(_mm_cvtsi64_si128(0xff)));
-                SIPROUNDX8;
-                SIPROUNDX8;
-                SIPROUNDX8;
-                SIPROUNDX8;
-                v0 = XOR(XOR(v0, v1), XOR(v2, v3));
-                v4 = XOR(XOR(v4, v5), XOR(v6, v7));
-
-                vpacket0 = _mm256_add_epi64(vpacket0, vpacketinc);
-                vpacket1 = _mm256_add_epi64(vpacket1, vpacketinc);
-                v1 = _mm256_srli_epi64(v0, P::YZBITS) & vxmask;
-                v5 = _mm256_srli_epi64(v4, P::YZBITS) & vxmask;
-                v0 = (v0 & vyzmask) | vhi0;
-                v4 = (v4 & vyzmask) | vhi1;
-                vhi0 = _mm256_add_epi64(vhi0, vhiinc);
-                vhi1 = _mm256_add_epi64(vhi1, vhiinc);
-
-                uint32_t ux;
-
-                store<0, 0>(base, ux, dst, last, edge, v1, v0);
-                store<2, 1>(base, ux, dst, last, edge, v1, v0);
-                store<4, 2>(base, ux, dst, last, edge, v1, v0);
-                store<6, 3>(base, ux, dst, last, edge, v1, v0);
-                store<0, 4>(base, ux, dst, last, edge, v5, v4);
-                store<2, 5>(base, ux, dst, last, edge, v5, v4);
-                store<4, 6>(base, ux, dst, last, edge, v5, v4);
-                store<6, 7>(base, ux, dst, last, edge, v5, v4);
-#else
-#error not implemented
-#endif
             }
 
             if (P::NEEDSYNC) {
@@ -523,17 +507,8 @@ public:
     // Generate new paired nodes for remaining nodes generated in genUnodes step
     void genVnodes(const uint32_t id, const uint32_t uorv)
     {
-#if NSIPHASH == 8
-        static const __m256i vxmask = {P::XMASK, P::XMASK, P::XMASK, P::XMASK};
-        static const __m256i vyzmask = {P::YZMASK, P::YZMASK, P::YZMASK, P::YZMASK};
-        const __m256i vinit = _mm256_set_epi64x(
-            sip_keys.k1 ^ 0x7465646279746573ULL,
-            sip_keys.k0 ^ 0x6c7967656e657261ULL,
-            sip_keys.k1 ^ 0x646f72616e646f6dULL,
-            sip_keys.k0 ^ 0x736f6d6570736575ULL);
-        __m256i vpacket0, vpacket1, vhi0, vhi1;
-        __m256i v0, v1, v2, v3, v4, v5, v6, v7;
-#endif
+        uint32_t nodes[SIPNODES_BATCH];
+        const cuckoo::SipNodesFn sipnodes = cuckoo::SipNodes;
 
         static const uint32_t NONDEGBITS = std::min(40u, 2 * P::YZBITS) - P::ZBITS; // 28
         static const uint32_t NONDEGMASK = (1 << NONDEGBITS) - 1;
@@ -546,7 +521,7 @@ public:
         const uint32_t startux = P::NX * id / nThreads;
         const uint32_t endux = P::NX * (id + 1) / nThreads;
 
-        for (uint32_t ux = startux; ux < endux; ux++) { // matrix x == ux
+        for (uint32_t ux = startux; ux < endux && !cancelled(); ux++) { // matrix x == ux
             small.matrixu(0);
             for (uint32_t my = 0; my < P::NY; my++) {
                 uint32_t edge = my << P::YZBITS;
@@ -612,71 +587,25 @@ public:
                 const uint32_t* readedge = edges0;
                 int64_t uy34 = (int64_t)uy << P::YZZBITS;
 
-#if NSIPHASH == 8
-                const __m256i vuy34 = {uy34, uy34, uy34, uy34};
-                const __m256i vuorv = {uorv, uorv, uorv, uorv};
-                for (; readedge <= edges - NSIPHASH; readedge += NSIPHASH, readz += NSIPHASH) {
-                    v3 = _mm256_permute4x64_epi64(vinit, 0xFF);
-                    v0 = _mm256_permute4x64_epi64(vinit, 0x00);
-                    v1 = _mm256_permute4x64_epi64(vinit, 0x55);
-                    v2 = _mm256_permute4x64_epi64(vinit, 0xAA);
-                    v7 = _mm256_permute4x64_epi64(vinit, 0xFF);
-                    v4 = _mm256_permute4x64_epi64(vinit, 0x00);
-                    v5 = _mm256_permute4x64_epi64(vinit, 0x55);
-                    v6 = _mm256_permute4x64_epi64(vinit, 0xAA);
-
-                    vpacket0 = _mm256_slli_epi64(_mm256_cvtepu32_epi64(*(__m128i*)readedge), 1) | vuorv;
-                    vhi0 = vuy34 | _mm256_slli_epi64(_mm256_cvtepu16_epi64(_mm_set_epi64x(0, *(uint64_t*)readz)), P::YZBITS);
-                    vpacket1 = _mm256_slli_epi64(_mm256_cvtepu32_epi64(*(__m128i*)(readedge + 4)), 1) | vuorv;
-                    vhi1 = vuy34 | _mm256_slli_epi64(_mm256_cvtepu16_epi64(_mm_set_epi64x(0, *(uint64_t*)(readz + 4))), P::YZBITS);
-
-                    v3 = XOR(v3, vpacket0);
-                    v7 = XOR(v7, vpacket1);
-                    SIPROUNDX8;
-                    SIPROUNDX8;
-                    v0 = XOR(v0, vpacket0);
-                    v4 = XOR(v4, vpacket1);
-                    v2 = XOR(v2, _mm256_broadcastq_epi64(_mm_cvtsi64_si128(0xff)));
-                    v6 = XOR(v6, _mm256_broadcastq_epi64(_mm_cvtsi64_si128(0xff)));
-                    SIPROUNDX8;
-                    SIPROUNDX8;
-                    SIPROUNDX8;
-                    SIPROUNDX8;
-                    v0 = XOR(XOR(v0, v1), XOR(v2, v3));
-                    v4 = XOR(XOR(v4, v5), XOR(v6, v7));
-
-                    v1 = _mm256_srli_epi64(v0, P::YZBITS) & vxmask;
-                    v5 = _mm256_srli_epi64(v4, P::YZBITS) & vxmask;
-                    v0 = vhi0 | (v0 & vyzmask);
-                    v4 = vhi1 | (v4 & vyzmask);
-
-                    uint32_t vx;
-#define STORE(i, v, x, w)                                                \
-    vx = _mm256_extract_epi32(v, x);                                     \
-    *(uint64_t*)(base + dst.index[vx]) = _mm256_extract_epi64(w, i % 4); \
-    dst.index[vx] += P::BIGSIZE;
-                    STORE(0, v1, 0, v0);
-                    STORE(1, v1, 2, v0);
-                    STORE(2, v1, 4, v0);
-                    STORE(3, v1, 6, v0);
-                    STORE(4, v5, 0, v4);
-                    STORE(5, v5, 2, v4);
-                    STORE(6, v5, 4, v4);
-                    STORE(7, v5, 6, v4);
-                }
-#endif
-
-                for (; readedge < edges; readedge++, readz++) { // process up to 7 leftover edges if NSIPHASH==8
-                    const uint32_t node = _sipnode(&sip_keys, P::EDGEMASK, *readedge, uorv);
-                    const uint32_t vx = node >> P::YZBITS; // & XMASK;
+                while (readedge < edges) {
+                    const uint32_t n = std::min<ptrdiff_t>(SIPNODES_BATCH, edges - readedge);
+                    sipnodes(&sip_keys, P::EDGEMASK, readedge, uorv, nodes, n);
+
+                    for (uint32_t i = 0; i < n; i++) {
+                        const uint32_t node = nodes[i];
+                        const uint32_t vx = node >> P::YZBITS; // & XMASK;
+
+                        // bit        39..34    33..21     20..13     12..0
+                        // write      UYYYYY    UZZZZZ     VYYYYY     VZZZZ   within VX partition
+                        // prev bucket info generated in genUnodes is overwritten here,
+                        // as we store U and V nodes in one value (Yz and Zs; Xs are indices in a matrix)
+                        // edge is discarded here, as we do not need it anymore
+                        *(uint64_t*)(base + dst.index[vx]) = uy34 | ((uint64_t)readz[i] << P::YZBITS) | (node & P::YZMASK);
+                        dst.index[vx] += P::BIGSIZE;
+                    }
 
-                    // bit        39..34    33..21     20..13     12..0
-                    // write      UYYYYY    UZZZZZ     VYYYYY     VZZZZ   within VX partition
-                    // prev bucket info generated in genUnodes is overwritten here,
-                    // as we store U and V nodes in one value (Yz and Zs; Xs are indices in a matrix)
-                    // edge is discarded here, as we do not need it anymore
-                    *(uint64_t*)(base + dst.index[vx]) = uy34 | ((uint64_t)*readz << P::YZBITS) | (node & P::YZMASK);
-                    dst.index[vx] += P::BIGSIZE;
+                    readedge += n;
+                    readz += n;
                 }
             }
             sumsize += dst.storeu(buckets, ux);
@@ -953,18 +882,20 @@ public:
         tcounts[id] = sumsize / sizeof(uint32_t);
     }
 
-    void trim()
+    using worker = void (*)(edgetrimmer*, uint32_t);
+
+    void runworkers(worker w)
     {
         if (nThreads == 1) {
-            trimmer(0);
+            w(this, 0);
             return;
         }
 
         std::vector<std::future<void>> jobs;
         for (int t = 0; t < nThreads; t++) {
             jobs.push_back(
-                    pool.push([this, t](int id) {
-                        etworker<offset_t, EDGEBITS, XBITS>(this, t);
+                    pool.push([this, w, t](int id) {
+                        w(this, t);
                     }));
         }
 
@@ -973,13 +904,41 @@ public:
         }
     }
 
+    void trim()
+    {
+        runworkers(etworker<offset_t, EDGEBITS, XBITS>);
+    }
+
+    // trim() split in the compute bound edge generation and the memory
+    // bound trimming rounds so that the stages of two graphs can overlap.
+    void genedges()
+    {
+        runworkers(genworker<offset_t, EDGEBITS, XBITS>);
+    }
+
+    void trimrest()
+    {
+        runworkers(roundsworker<offset_t, EDGEBITS, XBITS>);
+    }
+
     void trimmer(uint32_t id)
     {
         genUnodes(id, 0);
-        barry->Wait();
+        if (barry->Wait(cancel)) {
+            return;
+        }
+        roundend(id);
+        trimrounds(id);
+    }
+
+    void trimrounds(uint32_t id)
+    {
         genVnodes(id, 1);
         for (uint32_t round = 2; round < nTrims - 2; round += 2) {
-            barry->Wait();
+            if (barry->Wait(cancel)) {
+                return;
+            }
+            roundend(id);
             if (round < P::COMPRESSROUND) {
                 if (round < P::EXPANDROUND)
                     trimedges<P::BIGSIZE, P::BIGSIZE, true>(id, round);
@@ -991,7 +950,10 @@ public:
                 trimrename<P::BIGGERSIZE, P::BIGGERSIZE, true>(id, round);
             } else
                 trimedges1<true>(id, round);
-            barry->Wait();
+            if (barry->Wait(cancel)) {
+                return;
+            }
+            roundend(id);
             if (round < P::COMPRESSROUND) {
                 if (round + 1 < P::EXPANDROUND)
                     trimedges<P::BIGSIZE, P::BIGSIZE, false>(id, round + 1);
@@ -1004,9 +966,15 @@ public:
             } else
                 trimedges1<false>(id, round + 1);
         }
-        barry->Wait();
+        if (barry->Wait(cancel)) {
+            return;
+        }
+        roundend(id);
         trimrename1<true>(id, nTrims - 2);
-        barry->Wait();
+        if (barry->Wait(cancel)) {
+            return;
+        }
+        roundend(id);
         trimrename1<false>(id, nTrims - 1);
     }
 };
@@ -1036,23 +1004,37 @@ public:
     ctpl::thread_pool& pool;
     size_t nThreads;
     uint8_t proofSize;
+    CuckooSolveTimes times;
 
     solver_ctx(
             ctpl::thread_pool& poolIn,
             size_t nThreadsIn,
-            const char* header,
-            const uint32_t headerlen,
             const uint32_t nTrims,
-            const uint8_t proofSizeIn) : pool{poolIn}, nThreads{nThreadsIn}, proofSize{proofSizeIn}
+            const uint8_t proofSizeIn,
+            const CuckooCancelToken* cancel) : pool{poolIn}, nThreads{nThreadsIn}, proofSize{proofSizeIn}
     {
-        trimmer = new edgetrimmer<offset_t, EDGEBITS, XBITS>(pool, nThreadsIn, nTrims);
+        trimmer = new edgetrimmer<offset_t, EDGEBITS, XBITS>(pool, nThreadsIn, nTrims, cancel);
+
+        cycleus.resize(proofSize);
+        cyclevs.resize(proofSize);
 
-        cycleus.reserve(proofSize);
-        cyclevs.reserve(proofSize);
+        cuckoo = 0;
+    }
 
+    // Prepares the context for a new graph. The trimmer's buckets are
+    // rewritten from scratch by every trim so only the keys and the
+    // per graph solution state need to change.
+    void reset(const char* header, const uint32_t headerlen)
+    {
         setKeys(header, headerlen, &trimmer->sip_keys);
 
+        sols.clear();
+        uxymap.reset();
         cuckoo = 0;
+
+        times = CuckooSolveTimes{};
+        times.compress_round = P::COMPRESSROUND;
+        trimmer->round_ends.clear();
     }
 
     ~solver_ctx()
@@ -1094,7 +1076,7 @@ public:
         uxymap[u / 2 >> P::ZBITS] = 1;
     }
 
-    void solution(const uint32_t* us, uint32_t nu, const uint32_t* vs, uint32_t nv)
+    bool solution(const uint32_t* us, uint32_t nu, const uint32_t* vs, uint32_t nv)
     {
         uint32_t ni = 0;
         recordedge(ni++, *us, *vs);
@@ -1105,6 +1087,7 @@ public:
 
         sols.resize(sols.size() + proofSize);
 
+        const auto start = Clock::now();
         std::vector<std::future<void>> jobs;
         for (size_t t = 0; t < nThreads; t++) {
             jobs.push_back(
@@ -1117,8 +1100,15 @@ public:
         for (auto& j : jobs) {
             j.wait();
         }
+        times.recover = Micros(start, Clock::now());
+
+        // The nonces of a cancelled match are incomplete
+        if (trimmer->cancelled()) {
+            return false;
+        }
 
         qsort(&sols[sols.size() - proofSize], proofSize, sizeof(uint32_t), nonce_cmp);
+        return true;
     }
 
     static const uint32_t CUCKOO_NIL = ~0;
@@ -1146,6 +1136,10 @@ public:
         uint32_t us[MAXPATHLEN], vs[MAXPATHLEN];
 
         for (uint32_t vx = 0; vx < P::NX; vx++) {
+            if (trimmer->cancelled()) {
+                return false;
+            }
+
             for (uint32_t ux = 0; ux < P::NX; ux++) {
                 zbucketZ& zb = trimmer->buckets[ux][vx];
                 uint32_t *readbig = zb.words, *endreadbig = readbig + zb.size / sizeof(uint32_t);
@@ -1166,8 +1160,7 @@ public:
                                 ;
                             const uint32_t len = nu + nv + 1;
                             if (len == proofSize) {
-                                solution(us, nu, vs, nv);
-                                return true;
+                                return solution(us, nu, vs, nv);
                             }
                         } else if (nu < nv) {
                             while (nu--)
@@ -1188,12 +1181,58 @@ public:
 
     bool solve()
     {
-        assert((uint64_t)P::CUCKOO_SIZE * sizeof(uint32_t) <= trimmer->nThreads * sizeof(yzbucketT));
+        const auto start = Clock::now();
         trimmer->trim();
+        trimmed();
+        if (!trimmer->round_ends.empty()) {
+            times.generate = Micros(start, trimmer->round_ends.front());
+        }
+        return search();
+    }
+
+    // First stage of a pipelined solve
+    void generate()
+    {
+        const auto start = Clock::now();
+        trimmer->genedges();
+        times.generate = Micros(start, Clock::now());
+    }
+
+    // Second stage of a pipelined solve
+    bool finish()
+    {
+        // Round 1 starts now rather than when the edges were generated
+        trimmer->round_ends.assign(1, Clock::now());
+        trimmer->trimrest();
+        trimmed();
+        return search();
+    }
+
+    // Turns the ends of the trimming rounds into the times of rounds 1 on
+    void trimmed()
+    {
+        auto& ends = trimmer->round_ends;
+        ends.push_back(Clock::now());
+        for (size_t i = 1; i < ends.size(); i++) {
+            times.rounds.push_back(Micros(ends[i - 1], ends[i]));
+        }
+    }
+
+    bool search()
+    {
+        if (trimmer->cancelled()) {
+            return false;
+        }
+
+        const auto start = Clock::now();
+
+        assert((uint64_t)P::CUCKOO_SIZE * sizeof(uint32_t) <= trimmer->nThreads * sizeof(yzbucketT));
         cuckoo = (uint32_t*)trimmer->tbuckets;
         memset(cuckoo, CUCKOO_NIL, P::CUCKOO_SIZE * sizeof(uint32_t));
 
-        return findcycles();
+        const bool found = findcycles();
+        times.search = Micros(start, Clock::now()) - times.recover;
+        return found;
     }
 
     void* matchUnodes(uint32_t threadId)
@@ -1204,89 +1243,30 @@ public:
         uint32_t edge = starty << P::YZBITS;
         uint32_t endedge = edge + P::NYZ;
 
-#if NSIPHASH == 8
-            static const __m256i vnodemask = {P::EDGEMASK, P::EDGEMASK, P::EDGEMASK, P::EDGEMASK};
-            const __m256i vinit = _mm256_set_epi64x(
-                trimmer->sip_keys.k1 ^ 0x7465646279746573ULL,
-                trimmer->sip_keys.k0 ^ 0x6c7967656e657261ULL,
-                trimmer->sip_keys.k1 ^ 0x646f72616e646f6dULL,
-                trimmer->sip_keys.k0 ^ 0x736f6d6570736575ULL);
-            __m256i v0, v1, v2, v3, v4, v5, v6, v7;
-            const uint32_t e2 = 2 * edge;
-            __m256i vpacket0 = _mm256_set_epi64x(e2 + 6, e2 + 4, e2 + 2, e2 + 0);
-            __m256i vpacket1 = _mm256_set_epi64x(e2 + 14, e2 + 12, e2 + 10, e2 + 8);
-            static const __m256i vpacketinc = {16, 16, 16, 16};
-#endif
+        uint32_t nonces[SIPNODES_BATCH];
+        uint32_t nodes[SIPNODES_BATCH];
+        const cuckoo::SipNodesFn sipnodes = cuckoo::SipNodes;
 
-        for (uint32_t my = starty; my < endy; my++, endedge += P::NYZ) {
-            for (; edge < endedge; edge += NSIPHASH) {
-// bit        28..21     20..13    12..0
-// node       XXXXXX     YYYYYY    ZZZZZ
-#if NSIPHASH == 1
-                const uint32_t nodeu = _sipnode(&trimmer->sip_keys, P::EDGEMASK, edge, 0);
-                if (uxymap[nodeu >> P::ZBITS]) {
-                    for (uint32_t j = 0; j < proofSize; j++) {
-                        if (cycleus[j] == nodeu && cyclevs[j] == _sipnode(&trimmer->sip_keys, P::EDGEMASK, edge, 1)) {
-                            sols[sols.size() - proofSize + j] = edge;
+        for (uint32_t my = starty; my < endy && !trimmer->cancelled(); my++, endedge += P::NYZ) {
+            for (uint32_t n; edge < endedge; edge += n) {
+                n = std::min(SIPNODES_BATCH, endedge - edge);
+                for (uint32_t i = 0; i < n; i++) {
+                    nonces[i] = edge + i;
+                }
+                sipnodes(&trimmer->sip_keys, P::EDGEMASK, nonces, 0, nodes, n);
+
+                for (uint32_t i = 0; i < n; i++) {
+                    // bit        28..21     20..13    12..0
+                    // node       XXXXXX     YYYYYY    ZZZZZ
+                    const uint32_t nodeu = nodes[i];
+                    if (uxymap[nodeu >> P::ZBITS]) {
+                        for (uint32_t j = 0; j < proofSize; j++) {
+                            if (cycleus[j] == nodeu && cyclevs[j] == _sipnode(&trimmer->sip_keys, P::EDGEMASK, edge + i, 1)) {
+                                sols[sols.size() - proofSize + j] = edge + i;
+                            }
                         }
                     }
                 }
-// bit        39..21     20..13    12..0
-// write        edge     YYYYYY    ZZZZZ
-#elif NSIPHASH == 8
-                v3 = _mm256_permute4x64_epi64(vinit, 0xFF);
-                v0 = _mm256_permute4x64_epi64(vinit, 0x00);
-                v1 = _mm256_permute4x64_epi64(vinit, 0x55);
-                v2 = _mm256_permute4x64_epi64(vinit, 0xAA);
-                v7 = _mm256_permute4x64_epi64(vinit, 0xFF);
-                v4 = _mm256_permute4x64_epi64(vinit, 0x00);
-                v5 = _mm256_permute4x64_epi64(vinit, 0x55);
-                v6 = _mm256_permute4x64_epi64(vinit, 0xAA);
-
-                v3 = XOR(v3, vpacket0);
-                v7 = XOR(v7, vpacket1);
-                SIPROUNDX8;
-                SIPROUNDX8;
-                v0 = XOR(v0, vpacket0);
-                v4 = XOR(v4, vpacket1);
-                v2 = XOR(v2, _mm256_broadcastq_epi64(_mm_cvtsi64_si128(0xff)));
-                v6 = XOR(v6, _mm256_broadcastq_epi64(_mm_cvtsi64_si128(0xff)));
-                SIPROUNDX8;
-                SIPROUNDX8;
-                SIPROUNDX8;
-                SIPROUNDX8;
-                v0 = XOR(XOR(v0, v1), XOR(v2, v3));
-                v4 = XOR(XOR(v4, v5), XOR(v6, v7));
-
-                vpacket0 = _mm256_add_epi64(vpacket0, vpacketinc);
-                vpacket1 = _mm256_add_epi64(vpacket1, vpacketinc);
-                v0 = v0 & vnodemask;
-                v4 = v4 & vnodemask;
-                v1 = _mm256_srli_epi64(v0, P::ZBITS);
-                v5 = _mm256_srli_epi64(v4, P::ZBITS);
-
-                uint32_t uxy;
-#define MATCH(i, v, x, w)                                                                                  \
-    uxy = _mm256_extract_epi32(v, x);                                                                      \
-    if (uxymap[uxy]) {                                                                                     \
-        uint32_t u = _mm256_extract_epi32(w, x);                                                           \
-        for (uint32_t j = 0; j < proofSize; j++) {                                                         \
-            if (cycleus[j] == u && cyclevs[j] == _sipnode(&trimmer->sip_keys, P::EDGEMASK, edge + i, 1)) { \
-                sols[sols.size() - proofSize + j] = edge + i;                                              \
-            }                                                                                              \
-        }                                                                                                  \
-    }
-                MATCH(0, v1, 0, v0);
-                MATCH(1, v1, 2, v0);
-                MATCH(2, v1, 4, v0);
-                MATCH(3, v1, 6, v0);
-                MATCH(4, v5, 0, v4);
-                MATCH(5, v5, 2, v4);
-                MATCH(6, v5, 4, v4);
-                MATCH(7, v5, 6, v4);
-#else
-#error not implemented
-#endif
             }
         }
 
@@ -1294,68 +1274,230 @@ public:
     }
 };
 
+class CuckooGraphSolver
+{
+public:
+    CuckooGraphSolver(uint8_t edgeBitsIn, uint8_t proofSizeIn) : edgeBits{edgeBitsIn}, proofSize{proofSizeIn} {}
+    virtual ~CuckooGraphSolver() {}
+
+    virtual bool FindCycle(const uint256& hash, std::set<uint32_t>& cycle) = 0;
+
+    // FindCycle in two stages which may run concurrently on different solvers
+    virtual void Generate(const uint256& hash) = 0;
+    virtual bool Finish(std::set<uint32_t>& cycle) = 0;
+
+    virtual const CuckooSolveTimes& Times() const = 0;
+
+    const uint8_t edgeBits;
+    const uint8_t proofSize;
+};
+
 template <typename offset_t, uint8_t EDGEBITS, uint8_t XBITS>
-bool run(const uint256& hash, uint8_t proofSize, std::set<uint32_t>& cycle, size_t nThreads, ctpl::thread_pool& pool)
+class GraphSolver : public CuckooGraphSolver
 {
-    assert(EDGEBITS >= MIN_EDGE_BITS && EDGEBITS <= MAX_EDGE_BITS);
+public:
+    GraphSolver(uint8_t proofSize, size_t nThreads, ctpl::thread_pool& pool, const CuckooCancelToken* cancel) :
+        CuckooGraphSolver{EDGEBITS, proofSize},
+        ctx{pool, nThreads, EDGEBITS >= 30 ? 96u : 68u, proofSize, cancel}
+    {
+        assert(EDGEBITS >= MIN_EDGE_BITS && EDGEBITS <= MAX_EDGE_BITS);
+    }
+
+    bool FindCycle(const uint256& hash, std::set<uint32_t>& cycle) override
+    {
+        auto hashStr = hash.GetHex();
 
-    uint32_t nTrims = EDGEBITS >= 30 ? 96 : 68;
+        ctx.reset(hashStr.c_str(), hashStr.size());
 
-    auto hashStr = hash.GetHex();
+        return Found(ctx.solve(), cycle);
+    }
 
-    solver_ctx<offset_t, EDGEBITS, XBITS> ctx(pool, nThreads, hashStr.c_str(), hashStr.size(), nTrims, proofSize);
+    void Generate(const uint256& hash) override
+    {
+        auto hashStr = hash.GetHex();
 
-    bool found = ctx.solve();
+        ctx.reset(hashStr.c_str(), hashStr.size());
+        ctx.generate();
+    }
 
-    if (found) {
-        copy(ctx.sols.begin(), ctx.sols.begin() + ctx.sols.size(), inserter(cycle, cycle.begin()));
+    bool Finish(std::set<uint32_t>& cycle) override
+    {
+        return Found(ctx.finish(), cycle);
     }
 
-    return found;
+    const CuckooSolveTimes& Times() const override
+    {
+        return ctx.times;
+    }
+
+private:
+    bool Found(bool found, std::set<uint32_t>& cycle) const
+    {
+        if (found) {
+            copy(ctx.sols.begin(), ctx.sols.begin() + ctx.sols.size(), inserter(cycle, cycle.begin()));
+        }
+
+        return found;
+    }
+
+    solver_ctx<offset_t, EDGEBITS, XBITS> ctx;
+};
+
+template <typename offset_t, uint8_t EDGEBITS, uint8_t XBITS>
+CuckooGraphSolver* MakeGraphSolver(uint8_t proofSize, size_t nThreads, ctpl::thread_pool& pool, const CuckooCancelToken* cancel)
+{
+    return new GraphSolver<offset_t, EDGEBITS, XBITS>(proofSize, nThreads, pool, cancel);
 }
 
-bool FindCycleAdvanced(const uint256& hash,
-    uint8_t edgeBits,
-    uint8_t proofSize,
-    std::set<uint32_t>& cycle,
-    size_t nThreads,
-    ctpl::thread_pool& pool)
+CuckooGraphSolver* MakeGraphSolver(
+        uint8_t edgeBits,
+        uint8_t proofSize,
+        size_t nThreads,
+        ctpl::thread_pool& pool,
+        const CuckooCancelToken* cancel)
 {
     switch (edgeBits) {
     case 16:
-        return run<uint32_t, 16u, 0u>(hash, proofSize, cycle, nThreads, pool);
+        return MakeGraphSolver<uint32_t, 16u, 0u>(proofSize, nThreads, pool, cancel);
     case 17:
-        return run<uint32_t, 17u, 1u>(hash, proofSize, cycle, nThreads, pool);
+        return MakeGraphSolver<uint32_t, 17u, 1u>(proofSize, nThreads, pool, cancel);
     case 18:
-        return run<uint32_t, 18u, 1u>(hash, proofSize, cycle, nThreads, pool);
+        return MakeGraphSolver<uint32_t, 18u, 1u>(proofSize, nThreads, pool, cancel);
     case 19:
-        return run<uint32_t, 19u, 2u>(hash, proofSize, cycle, nThreads, pool);
+        return MakeGraphSolver<uint32_t, 19u, 2u>(proofSize, nThreads, pool, cancel);
     case 20:
-        return run<uint32_t, 20u, 2u>(hash, proofSize, cycle, nThreads, pool);
+        return MakeGraphSolver<uint32_t, 20u, 2u>(proofSize, nThreads, pool, cancel);
     case 21:
-        return run<uint32_t, 21u, 3u>(hash, proofSize, cycle, nThreads, pool);
+        return MakeGraphSolver<uint32_t, 21u, 3u>(proofSize, nThreads, pool, cancel);
     case 22:
-        return run<uint32_t, 22u, 3u>(hash, proofSize, cycle, nThreads, pool);
+        return MakeGraphSolver<uint32_t, 22u, 3u>(proofSize, nThreads, pool, cancel);
     case 23:
-        return run<uint32_t, 23u, 4u>(hash, proofSize, cycle, nThreads, pool);
+        return MakeGraphSolver<uint32_t, 23u, 4u>(proofSize, nThreads, pool, cancel);
     case 24:
-        return run<uint32_t, 24u, 4u>(hash, proofSize, cycle, nThreads, pool);
+        return MakeGraphSolver<uint32_t, 24u, 4u>(proofSize, nThreads, pool, cancel);
     case 25:
-        return run<uint32_t, 25u, 5u>(hash, proofSize, cycle, nThreads, pool);
+        return MakeGraphSolver<uint32_t, 25u, 5u>(proofSize, nThreads, pool, cancel);
     case 26:
-        return run<uint32_t, 26u, 5u>(hash, proofSize, cycle, nThreads, pool);
+        return MakeGraphSolver<uint32_t, 26u, 5u>(proofSize, nThreads, pool, cancel);
     case 27:
-        return run<uint32_t, 27u, 6u>(hash, proofSize, cycle, nThreads, pool);
+        return MakeGraphSolver<uint32_t, 27u, 6u>(proofSize, nThreads, pool, cancel);
     case 28:
-        return run<uint32_t, 28u, 6u>(hash, proofSize, cycle, nThreads, pool);
+        return MakeGraphSolver<uint32_t, 28u, 6u>(proofSize, nThreads, pool, cancel);
     case 29:
-        return run<uint32_t, 29u, 7u>(hash, proofSize, cycle, nThreads, pool);
+        return MakeGraphSolver<uint32_t, 29u, 7u>(proofSize, nThreads, pool, cancel);
     case 30:
-        return run<uint64_t, 30u, 8u>(hash, proofSize, cycle, nThreads, pool);
+        return MakeGraphSolver<uint64_t, 30u, 8u>(proofSize, nThreads, pool, cancel);
     case 31:
-        return run<uint64_t, 31u, 8u>(hash, proofSize, cycle, nThreads, pool);
+        return MakeGraphSolver<uint64_t, 31u, 8u>(proofSize, nThreads, pool, cancel);
 
     default:
         throw std::runtime_error(strprintf("%s: EDGEBITS equal to %d is not suppoerted", __func__, edgeBits));
     }
 }
+
+CuckooSolver::CuckooSolver(
+        size_t threads_number,
+        ctpl::thread_pool& poolIn,
+        bool pipelineIn,
+        const CuckooCancelToken* cancelIn) :
+    nThreads{threads_number}, pool(poolIn), pipeline{pipelineIn}, cancel{cancelIn}
+{
+    if (pipeline) {
+        generator.reset(new ctpl::thread_pool{1});
+    }
+}
+
+bool CuckooSolver::Cancelled() const
+{
+    return cancelled;
+}
+
+const CuckooSolveTimes& CuckooSolver::LastTimes() const
+{
+    return times;
+}
+
+CuckooSolver::~CuckooSolver() {}
+
+bool CuckooSolver::FindCycle(
+    const uint256& hash,
+    uint8_t edgeBits,
+    uint8_t proofSize,
+    std::set<uint32_t>& cycle,
+    const uint256* next_hash)
+{
+    // Only the arenas of the current graph size are kept since they can be
+    // gigabytes large and the edge bits rarely change.
+    if (!solver || solver->edgeBits != edgeBits || solver->proofSize != proofSize) {
+        solver.reset();
+        next_solver.reset();
+        prepared = false;
+
+        solver.reset(MakeGraphSolver(edgeBits, proofSize, nThreads, pool, cancel));
+        if (pipeline) {
+            next_solver.reset(MakeGraphSolver(edgeBits, proofSize, nThreads, pool, cancel));
+        }
+    }
+
+    cancelled = false;
+
+    if (!pipeline) {
+        bool found = solver->FindCycle(hash, cycle);
+        times = solver->Times();
+        cancelled = cancel && cancel->IsCancelled();
+        return found && !cancelled;
+    }
+
+    if (!prepared || prepared_hash != hash) {
+        solver->Generate(hash);
+    }
+    prepared = false;
+
+    if (!next_hash) {
+        bool found = solver->Finish(cycle);
+        times = solver->Times();
+        cancelled = cancel && cancel->IsCancelled();
+        return found && !cancelled;
+    }
+
+    // Generate the edges of the next graph in the second arena while this
+    // graph is trimmed and searched.
+    const uint256 next = *next_hash;
+    CuckooGraphSolver* next_graph = next_solver.get();
+    auto generating = generator->push([next_graph, next](int id) {
+        next_graph->Generate(next);
+    });
+
+    bool found;
+    try {
+        found = solver->Finish(cycle);
+    } catch (...) {
+        generating.wait();
+        throw;
+    }
+    generating.get();
+    times = solver->Times();
+
+    // A cancelled generation may have left the next graph incomplete
+    cancelled = cancel && cancel->IsCancelled();
+    if (cancelled) {
+        return false;
+    }
+
+    std::swap(solver, next_solver);
+    prepared_hash = next;
+    prepared = true;
+
+    return found;
+}
+
+bool FindCycleAdvanced(const uint256& hash,
+    uint8_t edgeBits,
+    uint8_t proofSize,
+    std::set<uint32_t>& cycle,
+    size_t nThreads,
+    ctpl::thread_pool& pool)
+{
+    CuckooSolver solver{nThreads, pool};
+    return solver.FindCycle(hash, edgeBits, proofSize, cycle);
+}
@@ -16,9 +16,112 @@
 #include "uint256.h"
 #include "ctpl/ctpl.h"
 
+#include <atomic>
+#include <memory>
 #include <set>
+#include <stdint.h>
 #include <vector>
 
+class CuckooGraphSolver;
+
+/**
+ * Wall clock time in microseconds spent in each phase of the last graph a
+ * solver searched. Meant for benchmarking and tuning the solver.
+ */
+struct CuckooSolveTimes
+{
+    /** Generating the edges and bucketing them on their U nodes, round 0 */
+    int64_t generate = 0;
+
+    /** Every following trimming round in order starting with round 1 */
+    std::vector<int64_t> rounds;
+
+    /** First of the two rounds renaming the surviving nodes */
+    uint32_t compress_round = 0;
+
+    /** Looking for a cycle in the trimmed graph */
+    int64_t search = 0;
+
+    /** Recovering the edge nonces of a cycle found */
+    int64_t recover = 0;
+};
+
+/**
+ * Stops the solves using it from another thread. Solvers check it between
+ * trimming rounds and while generating and matching edges, so a solve on a
+ * stale block header gives up within a round. It stays cancelled until
+ * reset.
+ */
+class CuckooCancelToken
+{
+public:
+    void Cancel() { cancelled = true; }
+    void Reset() { cancelled = false; }
+    bool IsCancelled() const { return cancelled.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<bool> cancelled{false};
+};
+
+/**
+ * Long lived cuckoo cycle solver. The bucket arenas of the trimmer are
+ * allocated and faulted in once and reused for every graph of the same edge
+ * bits so that only the siphash keys change between nonces. A solver must
+ * not be used by more than one thread at a time.
+ *
+ * A pipelined solver keeps two sets of arenas. While one graph is trimmed
+ * and searched the edges of the next one are generated in the other set by
+ * a thread the solver keeps, which needs threads_number more pool threads.
+ */
+class CuckooSolver
+{
+public:
+    CuckooSolver(
+            size_t threads_number,
+            ctpl::thread_pool&,
+            bool pipeline = false,
+            const CuckooCancelToken* cancel = nullptr);
+    ~CuckooSolver();
+
+    CuckooSolver(const CuckooSolver&) = delete;
+    CuckooSolver& operator=(const CuckooSolver&) = delete;
+
+    /**
+     * Find proofsize-length cuckoo cycle in random graph. A pipelined
+     * solver starts generating the graph of next_hash, if given, which the
+     * next call can use when it asks for that hash.
+     */
+    bool FindCycle(
+        const uint256& hash,
+        uint8_t edgeBits,
+        uint8_t proofSize,
+        std::set<uint32_t>& cycle,
+        const uint256* next_hash = nullptr);
+
+    /** True if the last FindCycle was cancelled. It found no cycle then. */
+    bool Cancelled() const;
+
+    /** Phase times of the graph searched by the last FindCycle */
+    const CuckooSolveTimes& LastTimes() const;
+
+private:
+    size_t nThreads;
+    ctpl::thread_pool& pool;
+    bool pipeline;
+    const CuckooCancelToken* cancel;
+    bool cancelled = false;
+    CuckooSolveTimes times;
+    std::unique_ptr<CuckooGraphSolver> solver;
+
+    // Pipelined mode only. Second set of arenas, the thread generating the
+    // next graph in them for the life of the solver and the graph ready in
+    // the current one.
+    std::unique_ptr<CuckooGraphSolver> next_solver;
+    std::unique_ptr<ctpl::thread_pool> generator;
+    uint256 prepared_hash;
+    bool prepared = false;
+};
+
 // Find proofsize-length cuckoo cycle in random graph
 bool FindCycleAdvanced(
     const uint256& hash,
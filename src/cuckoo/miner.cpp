@@ -18,7 +18,10 @@
 #include "hash.h"
 #include "pow.h"
 
+#include <algorithm>
 #include <assert.h>
+#include <atomic>
+#include <future>
 #include <numeric>
 #include <set>
 #include <stdio.h>
@@ -30,11 +33,35 @@
 namespace cuckoo
 {
 
+namespace
+{
+ctpl::thread_pool g_verify_pool;
+
+// Headers verified by one pool job. A verify takes a few microseconds so
+// smaller batches would spend more time in the pool queue than verifying.
+const size_t VERIFY_BATCH_SIZE = 64;
+
+bool VerifyCheck(const PowCheck& check, const Consensus::Params& params)
+{
+    return VerifyProofOfWork(check.hash, check.nBits, check.edgeBits, *check.cycle, params);
+}
+}
+
+void SetupVerifyThreadPool(size_t threads)
+{
+    g_verify_pool.resize(threads);
+}
+
+ctpl::thread_pool* GetVerifyThreadPool()
+{
+    return &g_verify_pool;
+}
+
 bool VerifyProofOfWork(
         uint256 hash,
         unsigned int nBits,
         uint8_t edgeBits,
-        const std::set<uint32_t>& cycle,
+        const CCycle& cycle,
         const Consensus::Params& params)
 {
 
@@ -60,19 +87,62 @@ bool VerifyProofOfWork(
     return false;
 }
 
+size_t VerifyProofsOfWork(
+        const PowChecks& checks,
+        const Consensus::Params& params,
+        ctpl::thread_pool* pool)
+{
+    if (!pool || pool->size() == 0 || checks.size() <= VERIFY_BATCH_SIZE) {
+        for (size_t i = 0; i < checks.size(); i++) {
+            if (!VerifyCheck(checks[i], params)) {
+                return i;
+            }
+        }
+        return checks.size();
+    }
+
+    // Batches after a failure are skipped. The batches before it still run
+    // to completion so the first failure is the one reported.
+    std::atomic<size_t> first_failure{checks.size()};
+
+    std::vector<std::future<void>> jobs;
+    jobs.reserve(checks.size() / VERIFY_BATCH_SIZE + 1);
+    for (size_t b = 0; b < checks.size(); b += VERIFY_BATCH_SIZE) {
+        jobs.push_back(
+                pool->push([b, &checks, &params, &first_failure](int id) {
+                    const auto batch_end = std::min(checks.size(), b + VERIFY_BATCH_SIZE);
+                    for (size_t i = b; i < batch_end && i < first_failure; i++) {
+                        if (VerifyCheck(checks[i], params)) {
+                            continue;
+                        }
+
+                        size_t failure = first_failure;
+                        while (i < failure && !first_failure.compare_exchange_weak(failure, i)) {
+                        }
+                        return;
+                    }
+                }));
+    }
+    for (auto& j : jobs) {
+        j.wait();
+    }
+
+    return first_failure;
+}
+
 bool FindProofOfWorkAdvanced(
     const uint256 hash,
     unsigned int nBits,
     uint8_t edgeBits,
     std::set<uint32_t>& cycle,
     const Consensus::Params& params,
-    size_t nThreads,
+    CuckooSolver& solver,
     bool& cycleFound,
-    ctpl::thread_pool& pool)
+    const uint256* nextHash)
 {
     assert(cycle.empty());
     cycleFound =
-        FindCycleAdvanced(hash, edgeBits, params.nCuckooProofSize, cycle, nThreads, pool);
+        solver.FindCycle(hash, edgeBits, params.nCuckooProofSize, cycle, nextHash);
 
     if (cycleFound && ::CheckProofOfWork(SerializeHash(cycle), nBits, params)) {
         return true;
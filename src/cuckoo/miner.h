@@ -17,6 +17,7 @@
 #include "consensus/params.h"
 #include "uint256.h"
 #include "ctpl/ctpl.h"
+#include "cuckoo/mean_cuckoo.h"
 #include <set>
 #include <vector>
 
@@ -31,12 +32,40 @@ bool VerifyProofOfWork(
         uint256 hash,
         unsigned int nBits,
         uint8_t edgeBits,
-        const std::set<uint32_t>& cycle,
+        const CCycle& cycle,
         const Consensus::Params& params);
 
+/** Proof-of-work of one header. The cycle must outlive the check. */
+struct PowCheck
+{
+    uint256 hash;
+    unsigned int nBits;
+    uint8_t edgeBits;
+    const CCycle* cycle;
+};
+
+using PowChecks = std::vector<PowCheck>;
+
+/**
+ * Verifies the proof-of-work of many headers at once with the checks split
+ * over the pool. Returns the index of the first check that fails or
+ * checks.size() if all of them pass. Checks after a failure may be skipped.
+ * Without a pool, or with an empty one, the checks run on this thread.
+ */
+size_t VerifyProofsOfWork(
+        const PowChecks& checks,
+        const Consensus::Params& params,
+        ctpl::thread_pool* pool);
+
+void SetupVerifyThreadPool(size_t threads);
+ctpl::thread_pool* GetVerifyThreadPool();
+
 /**
  * Find cycle for block that satisfies the proof-of-work requirement
- * specified by block hash with advanced edge trimming and matrix solver
+ * specified by block hash with advanced edge trimming and matrix solver.
+ * The solver keeps its memory between calls so it should be reused for
+ * every nonce tried by the same thread. A pipelined solver generates the
+ * graph of nextHash in the background for the next call.
  */
 bool FindProofOfWorkAdvanced(
         uint256 hash,
@@ -44,9 +73,9 @@ bool FindProofOfWorkAdvanced(
         uint8_t edgeBits,
         std::set<uint32_t>& cycle,
         const Consensus::Params& params,
-        size_t nThreads,
+        CuckooSolver& solver,
         bool& cycleFound,
-        ctpl::thread_pool& pool);
+        const uint256* nextHash = nullptr);
 }
 
 #endif // MERIT_CUCKOO_MINER_H
@@ -0,0 +1,381 @@
+/*
+ * Cuckoo Cycle, a memory-hard proof-of-work
+ * Copyright (c) 2013-2018 John Tromp
+ * Copyright (c) 2017-2018 The Merit Foundation developers
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the The FAIR MINING License and, alternatively,
+ * GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See src/cuckoo/LICENSE.md for more details.
+ **/
+
+#include "sipnodes.h"
+
+#include <assert.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__amd64__) || defined(__i386__))
+#define SIPNODES_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+// The vector implementations are compiled for their instruction set with
+// function target attributes so that one binary carries all of them and
+// picks one at runtime like SHA256AutoDetect does.
+
+namespace cuckoo
+{
+
+namespace
+{
+
+const uint64_t SIP_C0 = 0x736f6d6570736575ULL;
+const uint64_t SIP_C1 = 0x646f72616e646f6dULL;
+const uint64_t SIP_C2 = 0x6c7967656e657261ULL;
+const uint64_t SIP_C3 = 0x7465646279746573ULL;
+
+void SipNodesScalar(
+        const siphash_keys* keys,
+        uint32_t mask,
+        const uint32_t* edges,
+        uint32_t uorv,
+        uint32_t* nodes,
+        size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        nodes[i] = _sipnode(keys, mask, edges[i], uorv);
+    }
+}
+
+#ifdef SIPNODES_X86
+
+// Two SipHash-2-4 states of two lanes each.
+#define SSE_ADD(a, b) _mm_add_epi64(a, b)
+#define SSE_XOR(a, b) _mm_xor_si128(a, b)
+#define SSE_ROT(x, b) _mm_or_si128(_mm_slli_epi64(x, b), _mm_srli_epi64(x, 64 - (b)))
+#define SSE_ROT16(x) _mm_shuffle_epi8((x), _mm_set_epi64x(0x0D0C0B0A09080F0EULL, 0x0504030201000706ULL))
+#define SSE_ROT32(x) _mm_shuffle_epi32((x), _MM_SHUFFLE(2, 3, 0, 1))
+#define SSE_SIPROUND(v0, v1, v2, v3) \
+    do {                             \
+        v0 = SSE_ADD(v0, v1);        \
+        v2 = SSE_ADD(v2, v3);        \
+        v1 = SSE_ROT(v1, 13);        \
+        v3 = SSE_ROT16(v3);          \
+        v1 = SSE_XOR(v1, v0);        \
+        v3 = SSE_XOR(v3, v2);        \
+        v0 = SSE_ROT32(v0);          \
+        v2 = SSE_ADD(v2, v1);        \
+        v0 = SSE_ADD(v0, v3);        \
+        v1 = SSE_ROT(v1, 17);        \
+        v3 = SSE_ROT(v3, 21);        \
+        v1 = SSE_XOR(v1, v2);        \
+        v3 = SSE_XOR(v3, v0);        \
+        v2 = SSE_ROT32(v2);          \
+    } while (0)
+
+__attribute__((target("sse4.1")))
+void SipNodesSSE41(
+        const siphash_keys* keys,
+        uint32_t mask,
+        const uint32_t* edges,
+        uint32_t uorv,
+        uint32_t* nodes,
+        size_t n)
+{
+    const __m128i k0 = _mm_set1_epi64x(keys->k0 ^ SIP_C0);
+    const __m128i k1 = _mm_set1_epi64x(keys->k1 ^ SIP_C1);
+    const __m128i k2 = _mm_set1_epi64x(keys->k0 ^ SIP_C2);
+    const __m128i k3 = _mm_set1_epi64x(keys->k1 ^ SIP_C3);
+    const __m128i ff = _mm_set1_epi64x(0xff);
+    const __m128i vuorv = _mm_set1_epi64x(uorv);
+
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const __m128i nonce0 = _mm_or_si128(
+                _mm_slli_epi64(_mm_cvtepu32_epi64(_mm_loadl_epi64((const __m128i*)(edges + i))), 1), vuorv);
+        const __m128i nonce1 = _mm_or_si128(
+                _mm_slli_epi64(_mm_cvtepu32_epi64(_mm_loadl_epi64((const __m128i*)(edges + i + 2))), 1), vuorv);
+
+        __m128i v0 = k0, v1 = k1, v2 = k2, v3 = SSE_XOR(k3, nonce0);
+        __m128i v4 = k0, v5 = k1, v6 = k2, v7 = SSE_XOR(k3, nonce1);
+
+        SSE_SIPROUND(v0, v1, v2, v3);
+        SSE_SIPROUND(v4, v5, v6, v7);
+        SSE_SIPROUND(v0, v1, v2, v3);
+        SSE_SIPROUND(v4, v5, v6, v7);
+        v0 = SSE_XOR(v0, nonce0);
+        v4 = SSE_XOR(v4, nonce1);
+        v2 = SSE_XOR(v2, ff);
+        v6 = SSE_XOR(v6, ff);
+        for (int r = 0; r < 4; r++) {
+            SSE_SIPROUND(v0, v1, v2, v3);
+            SSE_SIPROUND(v4, v5, v6, v7);
+        }
+        v0 = SSE_XOR(SSE_XOR(v0, v1), SSE_XOR(v2, v3));
+        v4 = SSE_XOR(SSE_XOR(v4, v5), SSE_XOR(v6, v7));
+
+        nodes[i + 0] = (uint32_t)_mm_extract_epi32(v0, 0) & mask;
+        nodes[i + 1] = (uint32_t)_mm_extract_epi32(v0, 2) & mask;
+        nodes[i + 2] = (uint32_t)_mm_extract_epi32(v4, 0) & mask;
+        nodes[i + 3] = (uint32_t)_mm_extract_epi32(v4, 2) & mask;
+    }
+
+    SipNodesScalar(keys, mask, edges + i, uorv, nodes + i, n - i);
+}
+
+// Two SipHash-2-4 states of four lanes each.
+#define AVX2_ADD(a, b) _mm256_add_epi64(a, b)
+#define AVX2_XOR(a, b) _mm256_xor_si256(a, b)
+#define AVX2_ROT(x, b) _mm256_or_si256(_mm256_slli_epi64(x, b), _mm256_srli_epi64(x, 64 - (b)))
+#define AVX2_ROT16(x) _mm256_shuffle_epi8((x), _mm256_set_epi64x(0x0D0C0B0A09080F0EULL, 0x0504030201000706ULL, \
+                                                                 0x0D0C0B0A09080F0EULL, 0x0504030201000706ULL))
+#define AVX2_ROT32(x) _mm256_shuffle_epi32((x), _MM_SHUFFLE(2, 3, 0, 1))
+#define AVX2_SIPROUND(v0, v1, v2, v3) \
+    do {                              \
+        v0 = AVX2_ADD(v0, v1);        \
+        v2 = AVX2_ADD(v2, v3);        \
+        v1 = AVX2_ROT(v1, 13);        \
+        v3 = AVX2_ROT16(v3);          \
+        v1 = AVX2_XOR(v1, v0);        \
+        v3 = AVX2_XOR(v3, v2);        \
+        v0 = AVX2_ROT32(v0);          \
+        v2 = AVX2_ADD(v2, v1);        \
+        v0 = AVX2_ADD(v0, v3);        \
+        v1 = AVX2_ROT(v1, 17);        \
+        v3 = AVX2_ROT(v3, 21);        \
+        v1 = AVX2_XOR(v1, v2);        \
+        v3 = AVX2_XOR(v3, v0);        \
+        v2 = AVX2_ROT32(v2);          \
+    } while (0)
+
+__attribute__((target("avx2")))
+void SipNodesAVX2(
+        const siphash_keys* keys,
+        uint32_t mask,
+        const uint32_t* edges,
+        uint32_t uorv,
+        uint32_t* nodes,
+        size_t n)
+{
+    const __m256i k0 = _mm256_set1_epi64x(keys->k0 ^ SIP_C0);
+    const __m256i k1 = _mm256_set1_epi64x(keys->k1 ^ SIP_C1);
+    const __m256i k2 = _mm256_set1_epi64x(keys->k0 ^ SIP_C2);
+    const __m256i k3 = _mm256_set1_epi64x(keys->k1 ^ SIP_C3);
+    const __m256i ff = _mm256_set1_epi64x(0xff);
+    const __m256i vuorv = _mm256_set1_epi64x(uorv);
+    // Gathers the low halves of the eight 64 bit lanes into the low 128 bits
+    const __m256i vlow = _mm256_set_epi32(7, 5, 3, 1, 6, 4, 2, 0);
+    const __m128i vmask = _mm_set1_epi32(mask);
+
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m256i nonce0 = _mm256_or_si256(
+                _mm256_slli_epi64(_mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i*)(edges + i))), 1), vuorv);
+        const __m256i nonce1 = _mm256_or_si256(
+                _mm256_slli_epi64(_mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i*)(edges + i + 4))), 1), vuorv);
+
+        __m256i v0 = k0, v1 = k1, v2 = k2, v3 = AVX2_XOR(k3, nonce0);
+        __m256i v4 = k0, v5 = k1, v6 = k2, v7 = AVX2_XOR(k3, nonce1);
+
+        AVX2_SIPROUND(v0, v1, v2, v3);
+        AVX2_SIPROUND(v4, v5, v6, v7);
+        AVX2_SIPROUND(v0, v1, v2, v3);
+        AVX2_SIPROUND(v4, v5, v6, v7);
+        v0 = AVX2_XOR(v0, nonce0);
+        v4 = AVX2_XOR(v4, nonce1);
+        v2 = AVX2_XOR(v2, ff);
+        v6 = AVX2_XOR(v6, ff);
+        for (int r = 0; r < 4; r++) {
+            AVX2_SIPROUND(v0, v1, v2, v3);
+            AVX2_SIPROUND(v4, v5, v6, v7);
+        }
+        v0 = AVX2_XOR(AVX2_XOR(v0, v1), AVX2_XOR(v2, v3));
+        v4 = AVX2_XOR(AVX2_XOR(v4, v5), AVX2_XOR(v6, v7));
+
+        const __m128i lo0 = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(v0, vlow));
+        const __m128i lo1 = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(v4, vlow));
+        _mm_storeu_si128((__m128i*)(nodes + i), _mm_and_si128(lo0, vmask));
+        _mm_storeu_si128((__m128i*)(nodes + i + 4), _mm_and_si128(lo1, vmask));
+    }
+
+    SipNodesScalar(keys, mask, edges + i, uorv, nodes + i, n - i);
+}
+
+// Two SipHash-2-4 states of eight lanes each. AVX-512 has native rotates.
+#define AVX512_ADD(a, b) _mm512_add_epi64(a, b)
+#define AVX512_XOR(a, b) _mm512_xor_si512(a, b)
+#define AVX512_ROT(x, b) _mm512_rol_epi64(x, b)
+#define AVX512_SIPROUND(v0, v1, v2, v3) \
+    do {                                \
+        v0 = AVX512_ADD(v0, v1);        \
+        v2 = AVX512_ADD(v2, v3);        \
+        v1 = AVX512_ROT(v1, 13);        \
+        v3 = AVX512_ROT(v3, 16);        \
+        v1 = AVX512_XOR(v1, v0);        \
+        v3 = AVX512_XOR(v3, v2);        \
+        v0 = AVX512_ROT(v0, 32);        \
+        v2 = AVX512_ADD(v2, v1);        \
+        v0 = AVX512_ADD(v0, v3);        \
+        v1 = AVX512_ROT(v1, 17);        \
+        v3 = AVX512_ROT(v3, 21);        \
+        v1 = AVX512_XOR(v1, v2);        \
+        v3 = AVX512_XOR(v3, v0);        \
+        v2 = AVX512_ROT(v2, 32);        \
+    } while (0)
+
+__attribute__((target("avx512f")))
+void SipNodesAVX512(
+        const siphash_keys* keys,
+        uint32_t mask,
+        const uint32_t* edges,
+        uint32_t uorv,
+        uint32_t* nodes,
+        size_t n)
+{
+    const __m512i k0 = _mm512_set1_epi64(keys->k0 ^ SIP_C0);
+    const __m512i k1 = _mm512_set1_epi64(keys->k1 ^ SIP_C1);
+    const __m512i k2 = _mm512_set1_epi64(keys->k0 ^ SIP_C2);
+    const __m512i k3 = _mm512_set1_epi64(keys->k1 ^ SIP_C3);
+    const __m512i ff = _mm512_set1_epi64(0xff);
+    const __m512i vuorv = _mm512_set1_epi64(uorv);
+    const __m256i vmask = _mm256_set1_epi32(mask);
+
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m512i nonce0 = _mm512_or_si512(
+                _mm512_slli_epi64(_mm512_cvtepu32_epi64(_mm256_loadu_si256((const __m256i*)(edges + i))), 1), vuorv);
+        const __m512i nonce1 = _mm512_or_si512(
+                _mm512_slli_epi64(_mm512_cvtepu32_epi64(_mm256_loadu_si256((const __m256i*)(edges + i + 8))), 1), vuorv);
+
+        __m512i v0 = k0, v1 = k1, v2 = k2, v3 = AVX512_XOR(k3, nonce0);
+        __m512i v4 = k0, v5 = k1, v6 = k2, v7 = AVX512_XOR(k3, nonce1);
+
+        AVX512_SIPROUND(v0, v1, v2, v3);
+        AVX512_SIPROUND(v4, v5, v6, v7);
+        AVX512_SIPROUND(v0, v1, v2, v3);
+        AVX512_SIPROUND(v4, v5, v6, v7);
+        v0 = AVX512_XOR(v0, nonce0);
+        v4 = AVX512_XOR(v4, nonce1);
+        v2 = AVX512_XOR(v2, ff);
+        v6 = AVX512_XOR(v6, ff);
+        for (int r = 0; r < 4; r++) {
+            AVX512_SIPROUND(v0, v1, v2, v3);
+            AVX512_SIPROUND(v4, v5, v6, v7);
+        }
+        v0 = AVX512_XOR(AVX512_XOR(v0, v1), AVX512_XOR(v2, v3));
+        v4 = AVX512_XOR(AVX512_XOR(v4, v5), AVX512_XOR(v6, v7));
+
+        _mm256_storeu_si256((__m256i*)(nodes + i), _mm256_and_si256(_mm512_cvtepi64_epi32(v0), vmask));
+        _mm256_storeu_si256((__m256i*)(nodes + i + 8), _mm256_and_si256(_mm512_cvtepi64_epi32(v4), vmask));
+    }
+
+    SipNodesScalar(keys, mask, edges + i, uorv, nodes + i, n - i);
+}
+
+uint64_t XGetBV()
+{
+    uint32_t a, d;
+    __asm__("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+    return a | (static_cast<uint64_t>(d) << 32);
+}
+
+#endif // SIPNODES_X86
+
+} // namespace
+
+SipNodesFn SipNodes = SipNodesScalar;
+
+std::vector<SipNodesImpl> SupportedSipNodes()
+{
+    std::vector<SipNodesImpl> impls{{"scalar", SipNodesScalar}};
+
+#ifdef SIPNODES_X86
+    uint32_t eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return impls;
+    }
+
+    const bool ssse3 = (ecx >> 9) & 1;
+    const bool sse41 = (ecx >> 19) & 1;
+    const bool osxsave = (ecx >> 27) & 1;
+    const bool avx = (ecx >> 28) & 1;
+
+    if (ssse3 && sse41) {
+        impls.push_back({"sse4.1", SipNodesSSE41});
+    }
+
+    // The OS must save the wider registers on context switches
+    if (!osxsave || !avx || __get_cpuid_max(0, nullptr) < 7) {
+        return impls;
+    }
+
+    const uint64_t xcr0 = XGetBV();
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+
+    if ((xcr0 & 0x6) == 0x6 && (ebx >> 5) & 1) {
+        impls.push_back({"avx2", SipNodesAVX2});
+
+        if ((xcr0 & 0xe6) == 0xe6 && (ebx >> 16) & 1) {
+            impls.push_back({"avx512", SipNodesAVX512});
+        }
+    }
+#endif
+
+    return impls;
+}
+
+void UseSipNodes(const SipNodesImpl& impl)
+{
+    SipNodes = impl.fn;
+}
+
+bool SipNodesSelfTest(SipNodesFn fn)
+{
+    static const size_t N = 67;
+
+    siphash_keys keys;
+    uint32_t edges[N];
+    uint32_t expected[N];
+    uint32_t nodes[N];
+
+    for (uint32_t k = 0; k < 4; k++) {
+        keys.k0 = 0x0706050403020100ULL * (k + 1);
+        keys.k1 = 0x0f0e0d0c0b0a0908ULL ^ (0x9e3779b97f4a7c15ULL * k);
+
+        for (size_t i = 0; i < N; i++) {
+            edges[i] = (0x7fffffffU - i * 0x01234567U * k) & 0x7fffffffU;
+        }
+
+        for (uint32_t uorv = 0; uorv < 2; uorv++) {
+            const uint32_t mask = k % 2 ? 0xffffU : 0x7fffffffU;
+
+            SipNodesScalar(&keys, mask, edges, uorv, expected, N);
+
+            // Every length so that vector bodies and scalar tails are covered
+            for (size_t n = 0; n <= N; n += 13) {
+                fn(&keys, mask, edges, uorv, nodes, n);
+                for (size_t i = 0; i < n; i++) {
+                    if (nodes[i] != expected[i]) {
+                        return false;
+                    }
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+std::string SipNodesAutoDetect()
+{
+    const auto impls = SupportedSipNodes();
+    for (const auto& impl : impls) {
+        assert(SipNodesSelfTest(impl.fn));
+    }
+
+    UseSipNodes(impls.back());
+    return impls.back().name;
+}
+
+}
@@ -0,0 +1,67 @@
+/*
+ * Cuckoo Cycle, a memory-hard proof-of-work
+ * Copyright (c) 2013-2018 John Tromp
+ * Copyright (c) 2017-2018 The Merit Foundation developers
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the The FAIR MINING License and, alternatively,
+ * GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See src/cuckoo/LICENSE.md for more details.
+ **/
+
+#ifndef MERIT_CUCKOO_SIPNODES_H
+#define MERIT_CUCKOO_SIPNODES_H
+
+#include "cuckoo.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace cuckoo
+{
+
+/**
+ * Computes nodes[i] = _sipnode(keys, mask, edges[i], uorv) for every i < n.
+ * Edges must be below 2^31 which holds for every supported edge bits.
+ */
+typedef void (*SipNodesFn)(
+        const siphash_keys* keys,
+        uint32_t mask,
+        const uint32_t* edges,
+        uint32_t uorv,
+        uint32_t* nodes,
+        size_t n);
+
+struct SipNodesImpl
+{
+    const char* name;
+    SipNodesFn fn;
+};
+
+/** Implementation used by the mean miner. Defaults to the scalar one. */
+extern SipNodesFn SipNodes;
+
+/**
+ * Returns every implementation the running CPU supports, scalar first and
+ * fastest last.
+ */
+std::vector<SipNodesImpl> SupportedSipNodes();
+
+/** Makes the mean miner use the given implementation */
+void UseSipNodes(const SipNodesImpl& impl);
+
+/** Checks an implementation against the scalar siphash */
+bool SipNodesSelfTest(SipNodesFn fn);
+
+/**
+ * Selects the fastest implementation the CPU supports and returns its name.
+ * Every supported implementation is self tested first.
+ */
+std::string SipNodesAutoDetect();
+
+}
+
+#endif // MERIT_CUCKOO_SIPNODES_H
@@ -17,6 +17,8 @@
 #include "checkpoints.h"
 #include "compat/sanity.h"
 #include "consensus/validation.h"
+#include "cuckoo/miner.h"
+#include "cuckoo/sipnodes.h"
 #include "fs.h"
 #include "httpserver.h"
 #include "httprpc.h"
@@ -122,6 +124,7 @@ static const char* FEE_ESTIMATES_FILENAME="fee_estimates.dat";
 
 std::atomic<bool> fRequestShutdown(false);
 std::atomic<bool> fDumpMempoolLater(false);
+std::atomic<bool> fDumpUnspentCacheLater(false);
 
 void StartShutdown()
 {
@@ -241,6 +244,9 @@ void Shutdown()
         if (pcoinsTip != nullptr) {
             FlushStateToDisk();
         }
+        if (fDumpUnspentCacheLater) {
+            DumpUnspentCache();
+        }
         delete pcoinsTip;
         pcoinsTip = nullptr;
         delete pcoinscatcher;
@@ -341,11 +347,14 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-?", _("Print this help message and exit"));
     strUsage += HelpMessageOpt("-version", _("Print version and exit"));
     strUsage += HelpMessageOpt("-alertnotify=<cmd>", _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)"));
+    strUsage += HelpMessageOpt("-blockindexkey=<file>", strprintf(_("Specify the key file of the block index seals written with -trustblockindex, created if missing. The seals only detect tampering with the block index when the key is kept outside the data directory where those able to write the block index cannot read it (default: %s, relative to the data directory)"), DEFAULT_BLOCK_INDEX_KEY_FILE));
     strUsage += HelpMessageOpt("-blocknotify=<cmd>", _("Execute command when the best block changes (%s in cmd is replaced by block hash)"));
     if (showDebug)
         strUsage += HelpMessageOpt("-blocksonly", strprintf(_("Whether to operate in a blocks only mode (default: %u)"), DEFAULT_BLOCKSONLY));
     strUsage +=HelpMessageOpt("-assumevalid=<hex>", strprintf(_("If this block is in the chain assume that it and its ancestors are valid and potentially skip their script verification (0 to verify all, default: %s, testnet: %s)"), defaultChainParams->GetConsensus().defaultAssumeValid.GetHex(), testnetChainParams->GetConsensus().defaultAssumeValid.GetHex()));
     strUsage += HelpMessageOpt("-conf=<file>", strprintf(_("Specify configuration file (default: %s)"), MERIT_CONF_FILENAME));
+    strUsage += HelpMessageOpt("-cyclecache=<n>", strprintf(_("Number of cuckoo cycles read back from the block index kept in memory (default: %u)"), DEFAULT_CYCLE_CACHE_SIZE));
+    strUsage += HelpMessageOpt("-cycledepth=<n>", strprintf(_("Keep the cuckoo cycles of blocks loaded at startup or buried deeper than <n> blocks on disk only and read them on demand (0 = keep all in memory, default: %u)"), DEFAULT_CYCLE_DEPTH));
     if (mode == HMM_MERITD)
     {
 #if HAVE_DECL_DAEMON
@@ -356,6 +365,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-minepowthreads=<n>", strprintf(_("Set the number of threads for pow attempt if enabled (-1 = all cores, default: %d)"), DEFAULT_MINING_POW_THREADS));
     strUsage += HelpMessageOpt("-minebucketsize=<n>", strprintf(_("Set the number of nonces to check by one bucket (0 - unlimited) (default: %d)"), DEFAULT_MINING_BUCKET_SIZE));
     strUsage += HelpMessageOpt("-minebucketthreads=<n>", strprintf(_("Set the number of buckets run in parrallel (default: %d)"), DEFAULT_MINING_BUCKET_THREADS));
+    strUsage += HelpMessageOpt("-minepipeline", strprintf(_("Generate the graph of the next nonce while the current one is trimmed. Uses twice the pow threads and graph memory (default: %u)"), DEFAULT_MINING_PIPELINE));
 
     strUsage += HelpMessageOpt("-datadir=<dir>", _("Specify data directory"));
     if (showDebug) {
@@ -374,6 +384,7 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-minimumchainwork=<hex>", strprintf("Minimum work assumed to exist on a valid chain in hex (default: %s, testnet: %s)", defaultChainParams->GetConsensus().nMinimumChainWork.GetHex(), testnetChainParams->GetConsensus().nMinimumChainWork.GetHex()));
     }
     strUsage += HelpMessageOpt("-persistmempool", strprintf(_("Whether to save the mempool on shutdown and load on restart (default: %u)"), DEFAULT_PERSIST_MEMPOOL));
+    strUsage += HelpMessageOpt("-persistunspentcache", strprintf(_("Whether to save the address unspent cache on shutdown and every %u hours and load it on restart (default: %u)"), UNSPENT_CACHE_DUMP_INTERVAL / (60 * 60), DEFAULT_PERSIST_UNSPENT_CACHE));
     strUsage += HelpMessageOpt("-blockreconstructionextratxn=<n>", strprintf(_("Extra transactions to keep in memory for compact block reconstructions (default: %u)"), DEFAULT_BLOCK_RECONSTRUCTION_EXTRA_TXN));
     strUsage += HelpMessageOpt("-par=<n>", strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
         -GetNumCores(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS));
@@ -385,6 +396,8 @@ std::string HelpMessage(HelpMessageMode mode)
             "(default: 0 = disable pruning blocks, 1 = allow manual pruning via RPC, >%u = automatically prune block files to stay under the specified target size in MiB)"), MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024));
     strUsage += HelpMessageOpt("-reindex-chainstate", _("Rebuild chain state from the currently indexed blocks"));
     strUsage += HelpMessageOpt("-reindex", _("Rebuild chain state and block index from the blk*.dat files on disk"));
+    strUsage += HelpMessageOpt("-reverifyblockindex", strprintf(_("Verify the proof-of-work of the headers trusted by -trustblockindex in the background after startup (default: %u)"), DEFAULT_REVERIFY_BLOCK_INDEX));
+    strUsage += HelpMessageOpt("-trustblockindex", strprintf(_("Trust the proof-of-work of headers verified by an earlier startup when loading the block index. With the -blockindexkey default this only guards against accidental corruption, not against anyone able to write to the data directory (default: %u)"), DEFAULT_TRUST_BLOCK_INDEX));
     strUsage += HelpMessageOpt("-validationsamplecount=<n>", _("Take 1 out of N samples for validation when initially downloading or reindexing the blockchain (\"0\" to run validation on each block)."));
 #ifndef WIN32
     strUsage += HelpMessageOpt("-sysperms", _("Create new files with system default permissions, instead of umask 077 (only effective with disabled wallet functionality)"));
@@ -392,9 +405,11 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt(flags::ConvertToCliFlag(flags::txindex), strprintf(_("Maintain a full transaction index, used by the getrawtransaction rpc call (default: %u)"), DEFAULT_TXINDEX));
 
     strUsage += HelpMessageOpt(flags::ConvertToCliFlag(flags::addressindex), strprintf(_("Maintain a full address index, used to query for the balance, txids and unspent outputs for addresses (default: %u)"), DEFAULT_ADDRESSINDEX));
+    strUsage += HelpMessageOpt("-addressindexthreads=<n>", strprintf(_("Set the number of threads reading the address index for RPC calls with many addresses (0 = auto, default: %d)"), DEFAULT_ADDRESS_INDEX_THREADS));
     strUsage += HelpMessageOpt(flags::ConvertToCliFlag(flags::timestampindex), strprintf(_("Maintain a timestamp index for block hashes, used to query blocks hashes by a range of timestamps (default: %u)"), DEFAULT_TIMESTAMPINDEX));
     strUsage += HelpMessageOpt(flags::ConvertToCliFlag(flags::spentindex), strprintf(_("Maintain a full spent index, used to query the spending txid and input index for an outpoint (default: %u)"), DEFAULT_SPENTINDEX));
     strUsage += HelpMessageOpt(flags::ConvertToCliFlag(flags::referralindex), strprintf(_("Maintain a full referral index, used to query the referral txid (default: %u)"), DEFAULT_REFERRALINDEX));
+    strUsage += HelpMessageOpt(flags::ConvertToCliFlag(flags::balanceindex), strprintf(_("Maintain the balance of every address, used by getaddressbalance instead of scanning the address index. Built from the address index when first enabled (default: %u)"), DEFAULT_BALANCEINDEX));
 
     strUsage += HelpMessageGroup(_("Connection options:"));
     strUsage += HelpMessageOpt("-addnode=<ip>", _("Add a node to connect to and attempt to keep the connection open"));
@@ -461,6 +476,7 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-checkblocks=<n>", strprintf(_("How many blocks to check at startup (default: %u, 0 = all)"), DEFAULT_CHECKBLOCKS));
         strUsage += HelpMessageOpt("-checklevel=<n>", strprintf(_("How thorough the block verification of -checkblocks is (0-4, default: %u)"), DEFAULT_CHECKLEVEL));
         strUsage += HelpMessageOpt("-checkblockindex", strprintf("Do a full consistency check for mapBlockIndex, setBlockIndexCandidates, chainActive and mapBlocksUnlinked occasionally. Also sets -checkmempool (default: %u)", defaultChainParams->DefaultConsistencyChecks()));
+        strUsage += HelpMessageOpt("-checkcgs", strprintf("Compare the incrementally maintained CGS state against a full recomputation for every ambassador lottery (default: %u)", DEFAULT_CHECK_CGS));
         strUsage += HelpMessageOpt("-checkmempool=<n>", strprintf("Run checks every <n> transactions (default: %u)", defaultChainParams->DefaultConsistencyChecks()));
         strUsage += HelpMessageOpt("-checkpoints", strprintf("Disable expensive verification for known chain history (default: %u)", DEFAULT_CHECKPOINTS_ENABLED));
         strUsage += HelpMessageOpt("-disablesafemode", strprintf("Disable safemode, override a real safe mode event (default: %u)", DEFAULT_DISABLE_SAFEMODE));
@@ -993,6 +1009,7 @@ bool AppInitParameterInteraction()
         mempool.setSanityCheck(1.0 / ratio);
     }
     fCheckBlockIndex = gArgs.GetBoolArg("-checkblockindex", chainparams.DefaultConsistencyChecks());
+    fCheckCGS = gArgs.GetBoolArg("-checkcgs", DEFAULT_CHECK_CGS);
     fCheckpointsEnabled = gArgs.GetBoolArg("-checkpoints", DEFAULT_CHECKPOINTS_ENABLED);
 
     hashAssumeValid = uint256S(gArgs.GetArg("-assumevalid", chainparams.GetConsensus().defaultAssumeValid.GetHex()));
@@ -1206,6 +1223,8 @@ bool AppInitSanityChecks()
     // Initialize elliptic curve code
     std::string sha256_algo = SHA256AutoDetect();
     LogPrintf("Using the '%s' SHA256 implementation\n", sha256_algo);
+    std::string sipnodes_algo = cuckoo::SipNodesAutoDetect();
+    LogPrintf("Using the '%s' cuckoo siphash implementation\n", sipnodes_algo);
     RandomInit();
     ECC_Start();
     globalVerifyHandle.reset(new ECCVerifyHandle());
@@ -1256,6 +1275,13 @@ bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler)
     LogPrintf("Using at most %i automatic connections (%i file descriptors available)\n", nMaxConnections, nFD);
 
     pog3::SetupCgsThreadPool(boost::thread::hardware_concurrency());
+    cuckoo::SetupVerifyThreadPool(boost::thread::hardware_concurrency());
+
+    int address_index_threads = gArgs.GetArg("-addressindexthreads", DEFAULT_ADDRESS_INDEX_THREADS);
+    if (address_index_threads <= 0) {
+        address_index_threads = boost::thread::hardware_concurrency();
+    }
+    SetupAddressIndexThreadPool(address_index_threads);
     InitSignatureCache();
     InitScriptExecutionCache();
 
@@ -1484,6 +1510,13 @@ bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler)
 
                 prefviewcache = new referral::ReferralsViewCache{prefviewdb};
 
+                // Convert children stored as one vector per address to one
+                // record per child. This is a no-op on new databases.
+                if (!prefviewdb->Upgrade()) {
+                    strLoadError = _("Error upgrading referral database");
+                    break;
+                }
+
                 if (fReset) {
                     pblocktree->WriteReindexing(true);
                     //If we're reindexing in prune mode, wipe away unusable block files and all undo data files
@@ -1491,6 +1524,13 @@ bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler)
                         CleanupBlockRevFiles();
                 }
 
+                // Blocks disconnected by ReplayBlocks and RewindBlockIndex
+                // below must already update the balance index.
+                if (!pblocktree->SetBalanceIndex(gArgs.GetBoolArg(flags::ConvertToCliFlag(flags::balanceindex), DEFAULT_BALANCEINDEX))) {
+                    strLoadError = _("Error building the balance index");
+                    break;
+                }
+
                 if (fRequestShutdown) break;
 
                 // LoadBlockIndex will load tx index from the db, or set it if
@@ -1568,7 +1608,17 @@ bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler)
                 }
 
                 LogPrintf("Caching Unspent Coins...");
-                pblocktree->CacheAllUnspent();
+                {
+                    // The snapshot is only used if it matches the chain tip
+                    uint256 best_block;
+                    if (gArgs.GetBoolArg("-persistunspentcache", DEFAULT_PERSIST_UNSPENT_CACHE)) {
+                        LOCK(cs_main);
+                        if (chainActive.Tip()) {
+                            best_block = chainActive.Tip()->GetBlockHash();
+                        }
+                    }
+                    pblocktree->CacheAllUnspent(best_block);
+                }
                 LogPrintf("Cached\n");
 
                 if (!is_coinsview_empty) {
@@ -1646,6 +1696,11 @@ bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler)
         ::feeEstimator.Read(est_filein);
     fFeeEstimatesInitialized = true;
 
+    if (gArgs.GetBoolArg("-persistunspentcache", DEFAULT_PERSIST_UNSPENT_CACHE)) {
+        fDumpUnspentCacheLater = true;
+        scheduler.scheduleEvery([] { DumpUnspentCache(); }, UNSPENT_CACHE_DUMP_INTERVAL * 1000);
+    }
+
     // ********************************************************* Step 8: load wallet
 #ifdef ENABLE_WALLET
     if (!InitLoadWallet())
@@ -1700,6 +1755,10 @@ bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles));
 
+    if (gArgs.GetBoolArg("-reverifyblockindex", DEFAULT_REVERIFY_BLOCK_INDEX)) {
+        threadGroup.create_thread(&ThreadReverifyBlockIndex);
+    }
+
     // Wait for genesis block to be processed
     {
         boost::unique_lock<boost::mutex> lock(cs_GenesisWait);
@@ -76,6 +76,7 @@ namespace flags
     const std::string addressindex = "addressindex";
     const std::string spentindex = "spentindex";
     const std::string referralindex = "referralindex";
+    const std::string balanceindex = "balanceindex";
 
     inline std::string ConvertToCliFlag(const std::string& flag)
     {
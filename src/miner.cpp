@@ -57,6 +57,66 @@ extern CCoinsViewCache *pcoinsTip;
 
 const int MAX_NONCE = 0xfffff;
 
+using AmbassadorRewards = std::tuple<
+    pog::AmbassadorLottery,
+    pog2::AddressSelectorPtr,
+    pog3::AddressSelectorPtr>;
+
+/**
+ * The entrants of the ambassador lottery only depend on the previous block
+ * and the chain state leading to it. Computing them walks the whole referral
+ * tree so they are computed once per tip and reused by every template built
+ * on that tip. The selectors are not cached because the ambassador and invite
+ * lotteries sample from them without replacement, so every template builds
+ * fresh ones from the entrants. Guarded by cs_main.
+ */
+struct TipEntrants
+{
+    uint256 previous_block_hash;
+    int height = -1;
+    pog2::Entrants pog2;
+    pog3::Entrants pog3;
+};
+
+static TipEntrants tip_entrants;
+
+static AmbassadorRewards GetTipAmbassadorRewards(
+        int height,
+        const uint256& previous_block_hash,
+        CAmount total,
+        const Consensus::Params& params)
+{
+    AssertLockHeld(cs_main);
+
+    const bool cached =
+        tip_entrants.height == height &&
+        tip_entrants.previous_block_hash == previous_block_hash;
+
+    if (!cached || height < params.pog2_blockheight) {
+        auto rewards = RewardAmbassadors(height, previous_block_hash, total, params);
+
+        tip_entrants.previous_block_hash = previous_block_hash;
+        tip_entrants.height = height;
+        tip_entrants.pog2 = std::get<1>(rewards) ?
+            std::get<1>(rewards)->Entrants() : pog2::Entrants{};
+        tip_entrants.pog3 = std::get<2>(rewards) ?
+            std::get<2>(rewards)->Entrants() : pog3::Entrants{};
+        return rewards;
+    }
+
+    LogPrint(BCLog::POG, "%s: reusing lottery entrants for %s\n", __func__, previous_block_hash.GetHex());
+
+    if (height >= params.pog3_blockheight) {
+        const auto rewards = Pog3RewardAmbassadors(
+                height, previous_block_hash, total, params, tip_entrants.pog3);
+        return std::make_tuple(rewards.first, pog2::AddressSelectorPtr{}, rewards.second);
+    }
+
+    const auto rewards = Pog2RewardAmbassadors(
+            height, previous_block_hash, total, params, tip_entrants.pog2);
+    return std::make_tuple(rewards.first, rewards.second, pog3::AddressSelectorPtr{});
+}
+
 int64_t UpdateTime(
         CBlockHeader* pblock,
         const Consensus::Params& consensusParams,
@@ -240,7 +300,7 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
      * via referrals. The rewards are given out in a lottery where the probability
      * of winning is based on an ambassadors referral network.
      */
-    const auto lottery = RewardAmbassadors(
+    const auto lottery = GetTipAmbassadorRewards(
             nHeight,
             previousBlockHash,
             subsidy.ambassador,
@@ -942,20 +1002,134 @@ static bool ProcessBlockFound(const CBlock* pblock, const CChainParams& chainpar
     return true;
 }
 
+void MinerController::UpdatedBlockTip(const CBlockIndex*, const CBlockIndex*, bool)
+{
+    boost::unique_lock<boost::mutex> lock{mutex};
+    tip_generation++;
+    cond.notify_one();
+}
+
+void MinerController::TransactionAddedToMempool(const CTransactionRef&)
+{
+    MempoolChanged();
+}
+
+void MinerController::ReferralTransactionAddedToMempool(const referral::ReferralRef&)
+{
+    MempoolChanged();
+}
+
+void MinerController::BeginTemplate(size_t bucket)
+{
+    boost::unique_lock<boost::mutex> lock{mutex};
+    auto& slot = slots[bucket];
+    slot.active = true;
+    slot.abandon = false;
+    slot.cancel.Reset();
+    slot.start = GetTimeMillis();
+    slot.tip_generation = tip_generation;
+    slot.mempool_generation = mempool_generation;
+}
+
+void MinerController::EndTemplate(size_t bucket)
+{
+    boost::unique_lock<boost::mutex> lock{mutex};
+    slots[bucket].active = false;
+}
+
+void MinerController::AbandonAll()
+{
+    boost::unique_lock<boost::mutex> lock{mutex};
+    for (auto& slot : slots) {
+        slot.abandon = true;
+        slot.cancel.Cancel();
+    }
+}
+
+void MinerController::Run()
+{
+    boost::unique_lock<boost::mutex> lock{mutex};
+    while (true) {
+        const int64_t now = GetTimeMillis();
+        int64_t deadline = std::numeric_limits<int64_t>::max();
+
+        for (auto& slot : slots) {
+            if (!slot.active || slot.abandon) {
+                continue;
+            }
+
+            if (slot.tip_generation != tip_generation) {
+                slot.abandon = true;
+                slot.cancel.Cancel();
+            } else if (slot.mempool_generation != mempool_generation) {
+                if (now - slot.start > stale_time) {
+                    slot.abandon = true;
+                } else {
+                    deadline = std::min(deadline, slot.start + stale_time + 1);
+                }
+            }
+        }
+
+        // Waiting is an interruption point
+        if (deadline == std::numeric_limits<int64_t>::max()) {
+            cond.wait(lock);
+        } else {
+            cond.wait_for(lock, boost::chrono::milliseconds(deadline - now));
+        }
+    }
+}
+
+void MinerController::MempoolChanged()
+{
+    boost::unique_lock<boost::mutex> lock{mutex};
+    mempool_generation++;
+    cond.notify_one();
+}
+
+MinerControllerRegistration::MinerControllerRegistration(MinerController& controller_in) :
+    controller(controller_in)
+{
+    RegisterValidationInterface(&controller);
+}
+
+MinerControllerRegistration::~MinerControllerRegistration()
+{
+    UnregisterValidationInterface(&controller);
+}
+
 struct MinerContext {
     std::atomic<bool>& alive;
+    MinerController& controller;
     int pow_threads;
     int threads_number;
     int nonces_per_thread;
+    bool pipeline;
     const CChainParams& chainparams;
     std::shared_ptr<CReserveScript>& coinbase_script;
     ctpl::thread_pool& pool;
 };
 
+/** Nonces are handed out to the buckets in interleaved ranges */
+static uint32_t NextNonce(uint32_t nonce, const MinerContext& ctx)
+{
+    nonce++;
+
+    if (nonce % ctx.nonces_per_thread == 0) {
+        nonce += ctx.nonces_per_thread * (ctx.threads_number - 1);
+    }
+
+    return nonce;
+}
+
 void MinerWorker(int thread_id, MinerContext& ctx)
 {
     auto start_nonce = thread_id * ctx.nonces_per_thread;
     unsigned int nExtraNonce = 0;
+    CuckooSolver solver{
+        static_cast<size_t>(ctx.pow_threads),
+        ctx.pool,
+        ctx.pipeline,
+        &ctx.controller.CancelToken(thread_id)};
 
     while (ctx.alive) {
         if (ctx.chainparams.MiningRequiresPeers()) {
@@ -986,7 +1160,7 @@ void MinerWorker(int thread_id, MinerContext& ctx)
         //
         // Create new block
         //
-        unsigned int nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
+        ctx.controller.BeginTemplate(thread_id);
         CBlockIndex* pindexPrev = chainActive.Tip();
 
         std::unique_ptr<CBlockTemplate> pblocktemplate{
@@ -1018,31 +1192,47 @@ void MinerWorker(int thread_id, MinerContext& ctx)
         // Search
         //
         int64_t nStart = GetTimeMillis();
-        int graphs_checked = 0;
-        int cycles_found = 0;
         arith_uint256 hashTarget = arith_uint256().SetCompact(pblock->nBits);
         uint256 hash;
         std::set<uint32_t> cycle;
 
+        // In pipelined mode the header of the next attempt is settled before
+        // the current graph is solved so that the solver can generate its
+        // edges meanwhile.
+        CBlockHeader next;
+        uint256 next_hash;
+        bool has_next = false;
+
         while (ctx.alive) {
-            // Check if something found
-            graphs_checked++;
+            if (ctx.pipeline) {
+                next = pblock->GetBlockHeader();
+                next.nNonce = NextNonce(next.nNonce, ctx);
+                has_next = UpdateTime(&next, ctx.chainparams.GetConsensus(), pindexPrev) >= 0;
+                next_hash = next.GetHash();
+            }
 
+            // Check if something found
             bool cycle_found = false;
-            if (cuckoo::FindProofOfWorkAdvanced(
+            bool pow_found = cuckoo::FindProofOfWorkAdvanced(
                         pblock->GetHash(),
                         pblock->nBits,
                         pblock->nEdgeBits,
                         cycle,
                         ctx.chainparams.GetConsensus(),
-                        ctx.pow_threads,
+                        solver,
                         cycle_found,
-                        ctx.pool)) {
+                        has_next ? &next_hash : nullptr);
+
+            // A cancelled graph was not fully searched
+            if (g_connman && !solver.Cancelled()) {
+                g_connman->AddCheckedGraphs(1);
+                g_connman->AddFoundCycles(cycle_found ? 1 : 0);
+            }
 
-                cycles_found++;
+            if (pow_found) {
 
                 // Found a solution
-                pblock->sCycle = cycle;
+                pblock->sCycle = CCycle{cycle};
 
                 auto cycleHash = SerializeHash(cycle);
 
@@ -1066,10 +1256,6 @@ void MinerWorker(int thread_id, MinerContext& ctx)
                 break;
             }
 
-            if(cycle_found) {
-                cycles_found++;
-            }
-
             // Check for stop or if block needs to be rebuilt
             if (!ctx.alive) {
                 break;
@@ -1085,14 +1271,24 @@ void MinerWorker(int thread_id, MinerContext& ctx)
                 break;
             }
 
-            if (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast &&
-                    (GetTimeMillis() - nStart) / 1e3 > ctx.chainparams.MininBlockStaleTime()) {
+            if (ctx.controller.IsAbandoned(thread_id)) {
+                LogPrintf("%d: Block template is stale. Breaking block lookup\n", thread_id);
                 break;
             }
 
-            if (pindexPrev != chainActive.Tip()) {
-                LogPrintf("%d: Active chain tip changed. Breaking block lookup\n", thread_id);
-                break;
+            if (ctx.pipeline) {
+                // The next header was updated before the edges of its graph
+                // were generated. Recreate the block if the clock has run
+                // backwards.
+                if (!has_next) {
+                    break;
+                }
+
+                pblock->nTime = next.nTime;
+                pblock->nBits = next.nBits;
+                pblock->nNonce = next.nNonce;
+                hashTarget.SetCompact(pblock->nBits);
+                continue;
             }
 
             // Update nTime every few seconds
@@ -1107,17 +1303,10 @@ void MinerWorker(int thread_id, MinerContext& ctx)
                 hashTarget.SetCompact(pblock->nBits);
             }
 
-            pblock->nNonce++;
-
-            if (pblock->nNonce % ctx.nonces_per_thread == 0) {
-                pblock->nNonce += ctx.nonces_per_thread * (ctx.threads_number - 1);
-            }
+            pblock->nNonce = NextNonce(pblock->nNonce, ctx);
         }
 
-        if (ctx.alive && g_connman) {
-            g_connman->AddCheckedGraphs(graphs_checked);
-            g_connman->AddFoundCycles(cycles_found);
-        }
+        ctx.controller.EndTemplate(thread_id);
     }
 
     LogPrintf("MeritMiner pool #%d terminated\n", thread_id);
@@ -1128,7 +1317,8 @@ void static MeritMiner(
         const CChainParams& chainparams,
         int pow_threads,
         int bucket_size,
-        int bucket_threads)
+        int bucket_threads,
+        bool pipeline)
 {
     assert(coinbase_script);
     RenameThread("merit-miner");
@@ -1141,8 +1331,13 @@ void static MeritMiner(
         bucket_size = MAX_NONCE / bucket_threads;
     }
 
-    ctpl::thread_pool pool(bucket_threads + bucket_threads * pow_threads);
+    // A pipelined bucket solves one graph while generating the next
+    ctpl::thread_pool pool(bucket_threads + bucket_threads * pow_threads * (pipeline ? 2 : 1));
     std::atomic<bool> alive{true};
+    MinerController controller{
+        static_cast<size_t>(bucket_threads),
+        chainparams.MininBlockStaleTime() * 1000LL};
+    MinerControllerRegistration registration{controller};
 
     try {
         // Throw an error if no script was provided.  This can happen
@@ -1154,14 +1349,16 @@ void static MeritMiner(
                     "(mining requires a wallet)");
         }
 
-        LogPrintf("Running MeritMiner with %d pow threads, %d nonces per bucket and %d buckets in parallel.\n", pow_threads, bucket_size, bucket_threads);
+        LogPrintf("Running MeritMiner with %d pow threads, %d nonces per bucket and %d buckets in parallel%s.\n", pow_threads, bucket_size, bucket_threads, pipeline ? " pipelined" : "");
 
         for (int t = 0; t < bucket_threads; t++) {
             MinerContext ctx{
                 alive,
+                controller,
                 pow_threads,
                 bucket_threads,
                 bucket_size,
+                pipeline,
                 chainparams,
                 coinbase_script,
                 pool
@@ -1170,18 +1367,18 @@ void static MeritMiner(
             pool.push(MinerWorker, ctx);
         }
 
-        while (true) {
-            boost::this_thread::interruption_point();
-        }
+        controller.Run();
     } catch (const boost::thread_interrupted&) {
         LogPrintf("MeritMiner terminated\n");
         alive = false;
+        controller.AbandonAll();
         pool.stop();
 
         throw;
     } catch (const std::runtime_error& e) {
         LogPrintf("MeritMiner runtime error: %s\n", e.what());
         gArgs.ForceSetArg("-mine", 0);
+        controller.AbandonAll();
         pool.stop();
 
         return;
@@ -1223,5 +1420,6 @@ void GenerateMerit(bool mine, int pow_threads, int bucket_size, int bucket_threa
             chainparams,
             pow_threads,
             bucket_size,
-            bucket_threads);
+            bucket_threads,
+            gArgs.GetBoolArg("-minepipeline", DEFAULT_MINING_PIPELINE));
 }
@@ -7,13 +7,18 @@
 #ifndef MERIT_MINER_H
 #define MERIT_MINER_H
 
+#include "cuckoo/mean_cuckoo.h"
 #include "primitives/block.h"
 #include "txmempool.h"
 #include "refmempool.h"
+#include "validationinterface.h"
 
+#include <atomic>
 #include <stdint.h>
 #include <memory>
 #include <thread>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
 #include <boost/multi_index_container.hpp>
 #include <boost/multi_index/ordered_index.hpp>
 
@@ -28,6 +33,7 @@ const bool DEFAULT_MINING = false;
 const int DEFAULT_MINING_BUCKET_SIZE = 10;
 const int DEFAULT_MINING_BUCKET_THREADS = std::thread::hardware_concurrency() / 2;
 const int DEFAULT_MINING_POW_THREADS = 2;
+const bool DEFAULT_MINING_PIPELINE = false;
 
 
 /** Run the miner threads */
@@ -242,6 +248,79 @@ private:
     bool GetCandidatePacakageReferrals(const SetRefEntries& package_referrals, referral::ReferralRefs& sorted_referrals);
 };
 
+/**
+ * Decides when the block templates of the miner buckets are stale so the
+ * buckets do not have to poll the chain and the mempool between graphs. It
+ * sleeps until a new tip, a mempool change, a template going stale or the
+ * miner being interrupted wakes it up.
+ *
+ * A new tip also cancels the graph a bucket is solving since no cycle in it
+ * can extend the chain anymore. A mempool change lets the graph finish.
+ */
+class MinerController final : public CValidationInterface
+{
+public:
+    MinerController(size_t buckets, int64_t stale_time_ms) :
+        slots(buckets), stale_time{stale_time_ms} {}
+
+    void UpdatedBlockTip(const CBlockIndex*, const CBlockIndex*, bool) override;
+    void TransactionAddedToMempool(const CTransactionRef&) override;
+    //! Fired by CMainSignals::ReferralAddedToMempool
+    void ReferralTransactionAddedToMempool(const referral::ReferralRef&) override;
+
+    /** Called by a bucket before it creates a new block template */
+    void BeginTemplate(size_t bucket);
+    void EndTemplate(size_t bucket);
+
+    /** True once the bucket's template must be rebuilt */
+    bool IsAbandoned(size_t bucket) const { return slots[bucket].abandon; }
+
+    /** Cancelled when the bucket's template no longer builds on the tip */
+    const CuckooCancelToken& CancelToken(size_t bucket) const { return slots[bucket].cancel; }
+
+    /** Abandons every template and cancels the graphs being solved */
+    void AbandonAll();
+
+    /** Marks every template stale. Runs until the thread is interrupted. */
+    void Run();
+
+private:
+    void MempoolChanged();
+
+    struct Slot {
+        bool active = false;
+        std::atomic<bool> abandon{false};
+        CuckooCancelToken cancel;
+        int64_t start = 0;
+        uint64_t tip_generation = 0;
+        uint64_t mempool_generation = 0;
+    };
+
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::vector<Slot> slots;
+    const int64_t stale_time;
+    uint64_t tip_generation = 0;
+    uint64_t mempool_generation = 0;
+};
+
+/**
+ * Keeps a miner controller registered for tip and mempool events while it
+ * is in scope, however the miner exits.
+ */
+class MinerControllerRegistration
+{
+public:
+    explicit MinerControllerRegistration(MinerController& controller);
+    ~MinerControllerRegistration();
+
+    MinerControllerRegistration(const MinerControllerRegistration&) = delete;
+    MinerControllerRegistration& operator=(const MinerControllerRegistration&) = delete;
+
+private:
+    MinerController& controller;
+};
+
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev);
@@ -377,6 +377,22 @@ namespace pog2
         return score;
     }
 
+    WeightedScores CachedWeightedScore(
+            CGSContext& context,
+            const CachedEntrant& entrant,
+            referral::ReferralsViewCache& db)
+    {
+        if (entrant.scored) {
+            return {entrant.score, entrant.sub_score, entrant.tree_size};
+        }
+
+        return WeightedScore(
+                context,
+                entrant.address_type,
+                entrant.address,
+                db);
+    }
+
     struct ExpectedValues
     {
         ContributionAmount value;
@@ -397,10 +413,9 @@ namespace pog2
         assert(context.tree_contribution.value > 0);
         assert(context.tree_contribution.sub > 0);
 
-        auto expected_value = WeightedScore(
+        auto expected_value = CachedWeightedScore(
                 context,
-                entrant.address_type,
-                entrant.address,
+                entrant,
                 db);
 
         assert(expected_value.value >= 0);
@@ -408,10 +423,9 @@ namespace pog2
 
         for (const auto& c:  entrant.children) {
             const auto& child_entrant = context.GetEntrant(c);
-            auto child_score = WeightedScore(
+            auto child_score = CachedWeightedScore(
                     context,
-                    child_entrant.address_type,
-                    c,
+                    child_entrant,
                     db);
 
             assert(child_score.value >= 0);
@@ -493,6 +507,9 @@ namespace pog2
             const referral::Address& address,
             referral::ReferralsViewCache& db) {
 
+        //One DB iterator is moved from parent to parent for the whole walk.
+        const auto it = db.IterateChildren(address);
+
         AddressQueue q;
         q.push_back(std::make_pair(address_type, address));
         while(!q.empty()) {
@@ -501,11 +518,16 @@ namespace pog2
 
             const auto height = GetReferralHeight(db, p.second);
 
+            Children children;
+            for (it->Seek(p.second); it->Valid(); it->Next()) {
+                children.push_back(it->GetAddress());
+            }
+
             const auto& entrant = context.AddEntrant(
                     p.first,
                     p.second, 
                     height,
-                    db.GetChildren(p.second));
+                    children);
 
             for(const auto& c : entrant.children) {
                 const auto maybe_ref = db.GetReferral(c);
@@ -541,6 +563,73 @@ namespace pog2
         }
     }
 
+    /**
+     * ExpectedValue subtracts the weighted scores of an entrant's children
+     * from its own, so each score would otherwise be computed twice, each
+     * time paying two decimal pows for the value and the sub score. The
+     * scores of the staked entrants and their children are cached here.
+     */
+    void ComputeWeightedScores(
+            CGSContext& context,
+            referral::ReferralsViewCache& db,
+            CAmount minimum_stake)
+    {
+        assert(context.cgs_pool != nullptr);
+
+        if (context.tree_contribution.value == 0) {
+            return;
+        }
+
+        std::vector<size_t> needed;
+        std::vector<bool> marked(context.entrants.size(), false);
+
+        const auto mark = [&needed, &marked](size_t i) {
+            if (!marked[i]) {
+                marked[i] = true;
+                needed.push_back(i);
+            }
+        };
+
+        for(size_t i = 1; i < context.entrants.size(); i++) {
+            const auto& e = context.entrants[i];
+            if(e.balances.second < minimum_stake) {
+                continue;
+            }
+
+            mark(i);
+            for (const auto& c : e.children) {
+                const auto ci = context.entrant_idx.find(c);
+                assert(ci != context.entrant_idx.end());
+                mark(ci->second);
+            }
+        }
+
+        std::vector<std::future<void>> jobs;
+        jobs.reserve(needed.size() / BATCH_SIZE + 1);
+
+        for(size_t b = 0; b < needed.size(); b+=BATCH_SIZE) {
+            jobs.push_back(
+                    context.cgs_pool->push([b, &needed, &context, &db](int id) {
+                        const auto end = std::min(needed.size(), b + BATCH_SIZE);
+                        for(size_t i = b; i < end; i++) {
+                            auto& e = context.entrants[needed[i]];
+                            const auto score = WeightedScore(
+                                    context,
+                                    e.address_type,
+                                    e.address,
+                                    db);
+                            e.score = score.value;
+                            e.sub_score = score.sub;
+                            e.tree_size = score.tree_size;
+                            e.scored = true;
+                        }
+                    }));
+        }
+        for(auto& j : jobs) {
+            j.wait();
+        }
+    }
+
     void ComputeAllScores(
             CGSContext& context,
             referral::ReferralsViewCache& db,
@@ -550,6 +639,8 @@ namespace pog2
         assert(context.cgs_pool != nullptr);
         const auto minimum_stake = GetAmbassadorMinumumStake(context.tip_height, params);
 
+        ComputeWeightedScores(context, db, minimum_stake);
+
         std::vector<std::future<Entrants>> jobs;
         jobs.reserve(context.entrants.size() / BATCH_SIZE);
 
@@ -573,7 +664,7 @@ namespace pog2
                     }));
         }
 
-        entrants.reserve(context.entrants.size()*BATCH_SIZE);
+        entrants.reserve(context.entrants.size());
 
         for(auto& j : jobs) {
             auto es = j.get();
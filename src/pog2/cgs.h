@@ -77,6 +77,13 @@ namespace pog2
         Contribution contribution;
         int height;
         Children children;
+
+        //Weighted scores of the subtree rooted at this entrant. Computed once
+        //since they are needed both by the entrant and by its parent.
+        bool scored = false;
+        ContributionAmount score = 0.0;
+        ContributionAmount sub_score = 0.0;
+        size_t tree_size = 0;
     };
 
     struct CGSContext
@@ -23,6 +23,7 @@ namespace pog3
         const size_t BATCH_SIZE = 100;
         const int NO_GENESIS = 13500;
         ctpl::thread_pool g_cgs_pool;
+        CGSState g_cgs_state;
     }
 
     CAmount GetAmbassadorMinumumStake(int height, const Consensus::Params& consensus_params)
@@ -42,6 +43,11 @@ namespace pog3
         return &g_cgs_pool;
     }
 
+    CGSState& GetCgsState()
+    {
+        return g_cgs_state;
+    }
+
     using UnspentPair = std::pair<CAddressUnspentKey, CAddressUnspentValue>;
 
     using BigInt = boost::multiprecision::cpp_int;
@@ -128,9 +134,48 @@ namespace pog3
         return cs;
     }
 
+    /**
+     * Lays out the coins found by each partition into the context's coin
+     * arena. Partitions are copied in order so the coins of each entrant are
+     * in the same order they were found.
+     */
+    void SetCoins(CGSContext& context, const std::vector<EntrantCoins>& partitions)
+    {
+        std::vector<size_t> offsets(context.entrants.size() + 1, 0);
+        for (const auto& p : partitions) {
+            for (const auto& c : p) {
+                offsets[c.first + 1]++;
+            }
+        }
+
+        for (size_t i = 1; i < offsets.size(); i++) {
+            offsets[i] += offsets[i - 1];
+        }
+
+        for (size_t i = 0; i < context.entrants.size(); i++) {
+            auto& e = context.entrants[i];
+            e.coins_begin = offsets[i];
+            e.coins_end = offsets[i + 1];
+        }
+
+        context.coins.assign(offsets.back(), Coin{0, 0});
+        for (const auto& p : partitions) {
+            for (const auto& c : p) {
+                context.coins[offsets[c.first]++] = c.second;
+            }
+        }
+    }
+
     bool GetAllCoins(CGSContext& context, int tip_height) {
-        std::vector<UnspentPair> unspent;
-        if (!GetAllUnspent(false, [&context, tip_height](const CAddressUnspentKey& key, const CAddressUnspentValue& value) {
+        assert(context.cgs_pool != nullptr);
+
+        const size_t partitions = std::max(1, context.cgs_pool->size());
+        std::vector<EntrantCoins> found(partitions);
+
+        if (!GetAllUnspent(*context.cgs_pool, partitions, [&context, &found, tip_height](
+                        size_t partition,
+                        const CAddressUnspentKey& key,
+                        const CAddressUnspentValue& value) {
                 if (key.type == 0 || key.isInvite || value.satoshis == 0 || value.blockHeight > tip_height) {
                     return;
                 }
@@ -138,11 +183,14 @@ namespace pog3
                 assert(!key.isInvite);
                 assert(value.satoshis > 0);
 
-                auto& entrant = context.GetEntrant(key.hashBytes);
-                entrant.coins.emplace_back(value.blockHeight, value.satoshis);
+                const auto e = context.entrant_idx.find(key.hashBytes);
+                assert(e != context.entrant_idx.end());
+                found[partition].emplace_back(e->second, Coin{value.blockHeight, value.satoshis});
            })) {
             return false;
         }
+
+        SetCoins(context, found);
         return true;
     }
 
@@ -165,11 +213,16 @@ namespace pog3
     }
 
     template <class AgeFunc>
-    BalancePair AgedBalance(int tip_height, const Coins& cs, int maturity, AgeFunc AgedBalanceFunc) {
+    BalancePair AgedBalance(
+            int tip_height,
+            Coins::const_iterator begin,
+            Coins::const_iterator end,
+            int maturity,
+            AgeFunc AgedBalanceFunc) {
         assert(tip_height >= 0);
 
-        BalancePairs balances(cs.size());
-        std::transform(cs.begin(), cs.end(), balances.begin(),
+        BalancePairs balances(std::distance(begin, end));
+        std::transform(begin, end, balances.begin(),
                 [tip_height, maturity, &AgedBalanceFunc](const Coin& c) {
                     return AgedBalanceFunc(tip_height, c, maturity);
                 });
@@ -249,9 +302,10 @@ namespace pog3
 
     struct Node 
     {
-        char address_type;
-        referral::Address address;
-        Children children;
+        EntrantId id;
+
+        //Children are visited from the last one back to children_begin.
+        size_t next_child;
         SubtreeContribution contribution;
     };
 
@@ -260,33 +314,27 @@ namespace pog3
     using AddressQueue = std::deque<AddressPair>;
 
     /**
-     * Computes the subtree contribution rooted at the address specified.
+     * Computes the subtree contribution rooted at the entrant specified.
      * This algorithm computes the subtree contribution by doing a post order
      * traversal of the ambassador tree.
      *
-     * TODO: Implement parallel version, maybe Coffman–Graham algorithm.
+     * ComputeAllSubtreeContributions computes all of them in parallel up
+     * front so this only walks subtrees that were not computed yet.
      */
     SubtreeContribution ContributionSubtreeIter(
             CGSContext& context,
-            char address_type,
-            const referral::Address& address,
-            referral::ReferralsViewCache& db)
+            EntrantId root)
     {
-        const auto c = context.subtree_contribution.find(address);
-
-        if (c != context.subtree_contribution.end()) {
-            return c->second;
+        if (context.has_subtree_contribution[root]) {
+            return context.subtree_contributions[root];
         }
 
-        const auto& root_entrant = context.GetEntrant(address);
-
         SubtreeContribution contribution;
 
         NodeStack ns;
         ns.push({
-                root_entrant.address_type,
-                address,
-                root_entrant.children,
+                root,
+                context.entrants[root].children_end,
                 {}});
 
         while (!ns.empty()) {
@@ -294,36 +342,115 @@ namespace pog3
             n.contribution.value += contribution.value;
             n.contribution.tree_size += contribution.tree_size;
 
-            if (n.children.empty()) {
-                const auto& c = context.GetEntrant(n.address).contribution;
+            if (n.next_child == context.entrants[n.id].children_begin) {
+                const auto& c = context.contributions[n.id];
                 n.contribution.value += c.value;
                 n.contribution.tree_size++;
 
                 assert(n.contribution.value >= 0);
 
                 contribution = n.contribution;
-                context.subtree_contribution[n.address] = n.contribution;
+                context.subtree_contributions[n.id] = n.contribution;
+                context.has_subtree_contribution[n.id] = true;
 
                 ns.pop();
 
             } else {
-                const auto child_address = n.children.back();
-                n.children.pop_back();
+                n.next_child--;
+                const auto child = context.children[n.next_child];
 
                 contribution.value = 0;
                 contribution.tree_size = 0;
 
-                const auto& child_entrant = context.GetEntrant(child_address);
-
                 ns.push({
-                        child_entrant.address_type,
-                        child_address,
-                        child_entrant.children,
+                        child,
+                        context.entrants[child].children_end,
                         {}});
             }
         }
 
-        return context.subtree_contribution[address];
+        return context.subtree_contributions[root];
+    }
+
+    void SubtreeContributionNode(CGSContext& context, EntrantId id)
+    {
+        const auto& e = context.entrants[id];
+
+        //Children are added from the last to the first and then the
+        //entrant's own contribution, the same order ContributionSubtreeIter
+        //adds them in.
+        SubtreeContribution contribution;
+        for (auto c = e.children_end; c > e.children_begin; c--) {
+            const auto& child = context.subtree_contributions[context.children[c - 1]];
+            contribution.value += child.value;
+            contribution.tree_size += child.tree_size;
+        }
+
+        contribution.value += context.contributions[id].value;
+        contribution.tree_size++;
+
+        assert(contribution.value >= 0);
+        context.subtree_contributions[id] = contribution;
+    }
+
+    void ComputeAllSubtreeContributions(CGSContext& context)
+    {
+        assert(context.cgs_pool != nullptr);
+
+        const auto size = context.entrants.size();
+        if (size == 0) {
+            return;
+        }
+
+        //Ids are in breadth first order so each depth is a contiguous range
+        //of ids and every child has a larger id than its parent.
+        std::vector<size_t> depth(size, 0);
+        std::vector<size_t> levels{0};
+        for (size_t i = 0; i < size; i++) {
+            if (i > 0 && depth[i] != depth[i - 1]) {
+                assert(depth[i] == depth[i - 1] + 1);
+                levels.push_back(i);
+            }
+
+            const auto& e = context.entrants[i];
+            for (auto c = e.children_begin; c < e.children_end; c++) {
+                assert(context.children[c] > i);
+                depth[context.children[c]] = depth[i] + 1;
+            }
+        }
+        levels.push_back(size);
+
+        context.subtree_contributions.resize(size);
+
+        //Deepest level first so the children of a level are done before it.
+        for (size_t l = levels.size() - 1; l > 0; l--) {
+            const auto begin = levels[l - 1];
+            const auto end = levels[l];
+
+            if (end - begin <= BATCH_SIZE) {
+                for (size_t i = begin; i < end; i++) {
+                    SubtreeContributionNode(context, i);
+                }
+                continue;
+            }
+
+            std::vector<std::future<void>> jobs;
+            jobs.reserve((end - begin) / BATCH_SIZE + 1);
+            for (size_t b = begin; b < end; b += BATCH_SIZE) {
+                jobs.push_back(
+                        context.cgs_pool->push([b, end, &context](int id) {
+                            const auto batch_end = std::min(end, b + BATCH_SIZE);
+                            for (size_t i = b; i < batch_end; i++) {
+                                SubtreeContributionNode(context, i);
+                            }
+                        }));
+            }
+            for (auto& j : jobs) {
+                j.wait();
+            }
+        }
+
+        context.has_subtree_contribution.assign(size, true);
     }
 
     ContributionAmount GetValue(const SubtreeContribution& t)
@@ -338,19 +465,9 @@ namespace pog3
     };
 
     WeightedScores WeightedScore(
-            CGSContext& context,
-            const char address_type,
-            const referral::Address& address,
-            referral::ReferralsViewCache& db)
+            const CGSContext& context,
+            const SubtreeContribution& subtree_contribution)
     {
-        assert(context.tree_contribution.value > 0);
-
-        const auto subtree_contribution =
-                ContributionSubtreeIter(
-                    context,
-                    address_type,
-                    address,
-                    db);
         assert(subtree_contribution.value >= 0);
         assert(subtree_contribution.value <= context.tree_contribution.value);
 
@@ -367,16 +484,49 @@ namespace pog3
         return score;
     }
 
+    WeightedScores WeightedScore(
+            CGSContext& context,
+            EntrantId id)
+    {
+        assert(context.tree_contribution.value > 0);
+        return WeightedScore(context, ContributionSubtreeIter(context, id));
+    }
+
+    /**
+     * Only reads the context, so the subtree contribution of the entrant
+     * must be computed already.
+     */
+    WeightedScores WeightedScore(
+            const CGSContext& context,
+            EntrantId id)
+    {
+        assert(context.tree_contribution.value > 0);
+        assert(context.has_subtree_contribution[id]);
+        return WeightedScore(context, context.subtree_contributions[id]);
+    }
+
+    template <class Context>
+    WeightedScores CachedWeightedScore(
+            Context& context,
+            const CachedEntrant& entrant)
+    {
+        if (entrant.scored) {
+            return {entrant.score, entrant.tree_size};
+        }
+
+        return WeightedScore(context, entrant.id);
+    }
+
     struct ExpectedValues
     {
         ContributionAmount value;
         size_t tree_size;
     };
 
+    template <class Context>
     ExpectedValues ExpectedValue(
-            CGSContext& context,
-            const CachedEntrant& entrant,
-            referral::ReferralsViewCache& db)
+            Context& context,
+            const CachedEntrant& entrant)
     {
         //this case can occur on regtest if there is not enough data.
         if (context.tree_contribution.value == 0) {
@@ -385,21 +535,17 @@ namespace pog3
 
         assert(context.tree_contribution.value > 0);
 
-        auto expected_value = WeightedScore(
+        auto expected_value = CachedWeightedScore(
                 context,
-                entrant.address_type,
-                entrant.address,
-                db);
+                entrant);
 
         assert(expected_value.value >= 0);
 
-        for (const auto& c:  entrant.children) {
-            const auto& child_entrant = context.GetEntrant(c);
-            auto child_score = WeightedScore(
+        for (auto c = entrant.children_begin; c < entrant.children_end; c++) {
+            const auto& child_entrant = context.entrants[context.children[c]];
+            auto child_score = CachedWeightedScore(
                     context,
-                    child_entrant.address_type,
-                    c,
-                    db);
+                    child_entrant);
 
             assert(child_score.value >= 0);
             expected_value.value -= child_score.value;
@@ -409,15 +555,14 @@ namespace pog3
         return { expected_value.value, expected_value.tree_size };
     }
 
-    Entrant ComputeCGS(
-            CGSContext& context,
-            const CachedEntrant& entrant,
-            referral::ReferralsViewCache& db)
+    template <class Context>
+    Entrant EntrantCGS(
+            Context& context,
+            const CachedEntrant& entrant)
     {
         auto expected_value = ExpectedValue(
                 context,
-                entrant,
-                db);
+                entrant);
 
         const ContributionAmount cgs = context.tree_contribution.value * expected_value.value;
 
@@ -434,11 +579,26 @@ namespace pog3
                 balance.first,
                 floored_cgs,
                 entrant.height,
-                entrant.children.size(),
+                entrant.children_end - entrant.children_begin,
                 expected_value.tree_size
         };
     }
 
+    Entrant ComputeCGS(
+            CGSContext& context,
+            const CachedEntrant& entrant,
+            referral::ReferralsViewCache& db)
+    {
+        return EntrantCGS(context, entrant);
+    }
+
+    Entrant ComputeCGS(
+            const CGSContext& context,
+            const CachedEntrant& entrant)
+    {
+        return EntrantCGS(context, entrant);
+    }
+
     void ComputeAges(CGSContext& context) {
         assert(context.cgs_pool != nullptr);
 
@@ -453,7 +613,8 @@ namespace pog3
                             auto& e = context.entrants[i];
                             e.balances = AgedBalance(
                                     context.tip_height,
-                                    e.coins,
+                                    context.coins.begin() + e.coins_begin,
+                                    context.coins.begin() + e.coins_end,
                                     context.coin_maturity,
                                     BalanceDecay);
                         }
@@ -470,6 +631,14 @@ namespace pog3
             const referral::Address& address,
             referral::ReferralsViewCache& db) {
 
+        //Entrants are given ids in the order they are queued, which is the
+        //order they are added in.
+        EntrantId next_id = context.entrants.size() + 1;
+
+        //Children are read with one DB iterator seeked to each parent
+        //rather than a new iterator per entrant.
+        const auto it = db.IterateChildren(address);
+
         AddressQueue q;
         q.push_back(std::make_pair(address_type, address));
         while(!q.empty()) {
@@ -478,18 +647,18 @@ namespace pog3
 
             const auto height = GetReferralHeight(db, p.second);
 
-            const auto& entrant = context.AddEntrant(
+            context.AddEntrant(
                     p.first,
                     p.second, 
-                    height,
-                    db.GetChildren(p.second));
+                    height);
 
-            for(const auto& c : entrant.children) {
-                const auto maybe_ref = db.GetReferral(c);
+            for(it->Seek(p.second); it->Valid(); it->Next()) {
+                const auto maybe_ref = db.GetReferral(it->GetAddress());
                 if (!maybe_ref) {
                     continue;
                 }
 
+                context.AddChild(next_id++);
                 q.push_back(std::make_pair(maybe_ref->addressType, maybe_ref->GetAddress()));
             }
 
@@ -509,7 +678,68 @@ namespace pog3
                         const auto end = std::min(context.entrants.size(), b + BATCH_SIZE);
                         for(size_t i = b; i < end; i++) {
                             auto& e = context.entrants[i];
-                            e.contribution = ContributionNode(context, e, db);
+                            context.contributions[i] = ContributionNode(context, e, db);
+                        }
+                    }));
+        }
+        for(auto& j : jobs) {
+            j.wait();
+        }
+    }
+
+    /**
+     * Caches the weighted score of every staked entrant and of its children
+     * since each is read by both the entrant and its parent. The subtree
+     * contributions are all computed by now so the workers only read the
+     * context.
+     */
+    void ComputeWeightedScores(
+            CGSContext& context,
+            referral::ReferralsViewCache& db,
+            CAmount minimum_stake)
+    {
+        assert(context.cgs_pool != nullptr);
+
+        if (context.tree_contribution.value == 0) {
+            return;
+        }
+
+        std::vector<size_t> needed;
+        std::vector<bool> marked(context.entrants.size(), false);
+
+        const auto mark = [&needed, &marked](size_t i) {
+            if (!marked[i]) {
+                marked[i] = true;
+                needed.push_back(i);
+            }
+        };
+
+        for(size_t i = 1; i < context.entrants.size(); i++) {
+            const auto& e = context.entrants[i];
+            if(e.balances.second < minimum_stake) {
+                continue;
+            }
+
+            mark(i);
+            for (auto c = e.children_begin; c < e.children_end; c++) {
+                mark(context.children[c]);
+            }
+        }
+
+        std::vector<std::future<void>> jobs;
+        jobs.reserve(needed.size() / BATCH_SIZE + 1);
+
+        for(size_t b = 0; b < needed.size(); b+=BATCH_SIZE) {
+            jobs.push_back(
+                    context.cgs_pool->push([b, &needed, &context](int id) {
+                        const auto end = std::min(needed.size(), b + BATCH_SIZE);
+                        for(size_t i = b; i < end; i++) {
+                            auto& e = context.entrants[needed[i]];
+                            const auto score = WeightedScore(
+                                    static_cast<const CGSContext&>(context), e.id);
+                            e.score = score.value;
+                            e.tree_size = score.tree_size;
+                            e.scored = true;
                         }
                     }));
         }
@@ -528,6 +758,8 @@ namespace pog3
 
         const auto minimum_stake = GetAmbassadorMinumumStake(context.tip_height, params);
 
+        ComputeWeightedScores(context, db, minimum_stake);
+
         std::vector<std::future<Entrants>> jobs;
         jobs.reserve(context.entrants.size() / BATCH_SIZE);
 
@@ -537,21 +769,21 @@ namespace pog3
         //Important, 1 here to skip the genesis address
         for(size_t b = 1; b < context.entrants.size(); b+=BATCH_SIZE) {
             jobs.push_back(
-                    context.cgs_pool->push([b, minimum_stake , &context, &db](int id) {
+                    context.cgs_pool->push([b, minimum_stake , &context](int id) {
                         const auto end = std::min(context.entrants.size(), b + BATCH_SIZE);
                         Entrants es;
                         es.reserve(end - b);
                         for(size_t i = b; i < end; i++) {
                             const auto& e = context.entrants[i];
                             if(e.balances.second >= minimum_stake) {
-                                es.emplace_back(ComputeCGS(context, e, db));
+                                es.emplace_back(ComputeCGS(static_cast<const CGSContext&>(context), e));
                             }
                         }
                         return es;
                     }));
         }
 
-        entrants.reserve(context.entrants.size()*BATCH_SIZE);
+        entrants.reserve(context.entrants.size());
 
         for(auto& j : jobs) {
             auto es = j.get();
@@ -559,6 +791,30 @@ namespace pog3
         }
     }
 
+    void ComputeRewardableEntrants(
+            CGSContext& context,
+            referral::ReferralsViewCache& db,
+            const Consensus::Params& params,
+            Entrants& entrants)
+    {
+        const auto size = context.entrants.size();
+        context.contributions.assign(size, Contribution{});
+        context.subtree_contributions.assign(size, SubtreeContribution{});
+        context.has_subtree_contribution.assign(size, false);
+
+        ComputeAges(context);
+
+        ComputeAllContributions(context, db);
+
+        ComputeAllSubtreeContributions(context);
+
+        const auto genesis = context.entrant_idx.find(params.genesis_address);
+        assert(genesis != context.entrant_idx.end());
+        context.tree_contribution = ContributionSubtreeIter(context, genesis->second);
+
+        ComputeAllScores(context, db, params, entrants);
+    }
+
     void GetAllRewardableEntrants(
             CGSContext& context,
             referral::ReferralsViewCache& db,
@@ -579,31 +835,293 @@ namespace pog3
                 params.genesis_address,
                 db);
         GetAllCoins(context, height);
-        ComputeAges(context);
 
-        ComputeAllContributions(context, db);
-        context.tree_contribution = ContributionSubtreeIter(context, 2, params.genesis_address, db);
+        ComputeRewardableEntrants(context, db, params, entrants);
+    }
 
-        ComputeAllScores(context, db, params, entrants);
+    void GetAllRewardableEntrants(
+            CGSContext& context,
+            const CGSState& state,
+            referral::ReferralsViewCache& db,
+            const Consensus::Params& params,
+            int height,
+            Entrants& entrants)
+    {
+        assert(height >= 0);
+
+        context.tip_height = height;
+        context.coin_maturity = params.pog3_coin_maturity;
+        context.new_coin_maturity = params.pog3_new_coin_maturity;
+        context.B = params.pog3_convex_b;
+        context.S = params.pog3_convex_s;
+        state.FillContext(context, params, height);
+
+        ComputeRewardableEntrants(context, db, params, entrants);
+    }
+
+    bool CGSState::IsSynced(const uint256& block_hash) const
+    {
+        LOCK(cs);
+        return !best_block.IsNull() && best_block == block_hash;
+    }
+
+    bool CGSState::Rebuild(
+            referral::ReferralsViewCache& db,
+            const Consensus::Params& params,
+            const uint256& block_hash)
+    {
+        LOCK(cs);
+        best_block.SetNull();
+        tree.clear();
+        coins.clear();
+
+        CGSContext context;
+        PrefillContributionsAndHeights(context, 2, params.genesis_address, db);
+
+        for (const auto& e : context.entrants) {
+            Children children;
+            children.reserve(e.children_end - e.children_begin);
+            for (auto c = e.children_begin; c < e.children_end; c++) {
+                children.push_back(context.entrants[context.children[c]].address);
+            }
+
+            tree.emplace(e.address, TreeNode{e.address_type, e.height, std::move(children)});
+        }
+
+        if (!GetAllUnspent(false, [this](const CAddressUnspentKey& key, const CAddressUnspentValue& value) {
+                if (key.type == 0 || key.isInvite || value.satoshis == 0) {
+                    return;
+                }
+
+                coins[key.hashBytes].emplace(
+                        CoinOutPoint{key.txhash, key.index},
+                        Coin{value.blockHeight, value.satoshis});
+           })) {
+            tree.clear();
+            coins.clear();
+            return false;
+        }
+
+        best_block = block_hash;
+        LogPrint(BCLog::POG, "%s: rebuilt CGS state at %s with %d entrants and %d funded addresses\n",
+                __func__, block_hash.GetHex(), tree.size(), coins.size());
+        return true;
+    }
+
+    void CGSState::ApplyUnspent(const UnspentUpdates& unspent)
+    {
+        AssertLockHeld(cs);
+        for (const auto& u : unspent) {
+            const auto& key = u.first;
+            const auto& value = u.second;
+
+            if (key.type == 0 || key.isInvite) {
+                continue;
+            }
+
+            const CoinOutPoint out{key.txhash, key.index};
+            if (value.IsNull()) {
+                auto a = coins.find(key.hashBytes);
+                if (a == coins.end()) {
+                    continue;
+                }
+
+                a->second.erase(out);
+                if (a->second.empty()) {
+                    coins.erase(a);
+                }
+            } else if (value.satoshis != 0) {
+                auto& address_coins = coins[key.hashBytes];
+                address_coins.erase(out);
+                address_coins.emplace(out, Coin{value.blockHeight, value.satoshis});
+            }
+        }
+    }
+
+    void CGSState::ConnectBlock(
+            const uint256& prev_hash,
+            const uint256& block_hash,
+            int height,
+            const referral::ReferralRefs& ordered_referrals,
+            const UnspentUpdates& unspent)
+    {
+        LOCK(cs);
+        if (best_block.IsNull() || best_block != prev_hash) {
+            return;
+        }
+
+        //Mirrors ReferralsViewDB::InsertReferral which skips existing
+        //referrals and appends new ones to the children of their parent.
+        for (const auto& ref : ordered_referrals) {
+            const auto& address = ref->GetAddress();
+            if (tree.count(address)) {
+                continue;
+            }
+
+            tree.emplace(address, TreeNode{ref->addressType, height, {}});
+
+            auto parent = tree.find(ref->parentAddress);
+            if (parent != tree.end()) {
+                parent->second.children.push_back(address);
+            }
+        }
+
+        ApplyUnspent(unspent);
+        best_block = block_hash;
+    }
+
+    void CGSState::DisconnectBlock(
+            const uint256& block_hash,
+            const uint256& prev_hash,
+            const referral::ReferralRefs& referrals,
+            const UnspentUpdates& unspent)
+    {
+        LOCK(cs);
+        if (best_block.IsNull() || best_block != block_hash) {
+            return;
+        }
+
+        //Children must be removed before their parents so undo the
+        //referrals in reverse. A block need not list a parent before its
+        //child so referrals which still have children are retried after
+        //the rest.
+        referral::ReferralRefs pending(referrals.rbegin(), referrals.rend());
+        while (!pending.empty()) {
+            referral::ReferralRefs retry;
+            for (const auto& ref : pending) {
+                const auto& address = ref->GetAddress();
+                auto node = tree.find(address);
+                if (node == tree.end()) {
+                    continue;
+                }
+
+                if (!node->second.children.empty()) {
+                    retry.push_back(ref);
+                    continue;
+                }
+
+                tree.erase(node);
+
+                auto parent = tree.find(ref->parentAddress);
+                if (parent != tree.end()) {
+                    auto& children = parent->second.children;
+                    children.erase(
+                            std::remove(children.begin(), children.end(), address),
+                            children.end());
+                }
+            }
+
+            //Children from outside the block means the tree no longer
+            //mirrors the DB so start over.
+            if (retry.size() == pending.size()) {
+                best_block.SetNull();
+                tree.clear();
+                coins.clear();
+                return;
+            }
+            pending.swap(retry);
+        }
+
+        ApplyUnspent(unspent);
+        best_block = prev_hash;
+    }
+
+    void CGSState::Invalidate()
+    {
+        LOCK(cs);
+        best_block.SetNull();
+        tree.clear();
+        coins.clear();
+    }
+
+    void CGSState::FillContext(
+            CGSContext& context,
+            const Consensus::Params& params,
+            int tip_height) const
+    {
+        LOCK(cs);
+        assert(!best_block.IsNull());
+
+        //Same breadth first order as PrefillContributionsAndHeights.
+        EntrantId next_id = context.entrants.size() + 1;
+
+        AddressQueue q;
+        q.push_back(std::make_pair(2, params.genesis_address));
+        while(!q.empty()) {
+            const auto p = q.front();
+            q.pop_front();
+
+            const auto node = tree.find(p.second);
+            assert(node != tree.end());
+
+            context.AddEntrant(
+                    p.first,
+                    p.second,
+                    node->second.height);
+
+            for(const auto& c : node->second.children) {
+                const auto child = tree.find(c);
+                if (child == tree.end()) {
+                    continue;
+                }
+
+                context.AddChild(next_id++);
+                q.push_back(std::make_pair(child->second.address_type, c));
+            }
+        }
+
+        std::vector<EntrantCoins> found(1);
+        for (const auto& a : coins) {
+            size_t entrant = 0;
+            bool found_entrant = false;
+            for (const auto& c : a.second) {
+                if (c.second.height > tip_height) {
+                    continue;
+                }
+
+                assert(c.second.amount > 0);
+
+                if (!found_entrant) {
+                    const auto e = context.entrant_idx.find(a.first);
+                    assert(e != context.entrant_idx.end());
+                    entrant = e->second;
+                    found_entrant = true;
+                }
+                found[0].emplace_back(entrant, c.second);
+            }
+        }
+
+        SetCoins(context, found);
     }
 
-    CachedEntrant& CGSContext::AddEntrant(
+    EntrantId CGSContext::AddEntrant(
             char address_type,
             const referral::Address& address,
-            int height,
-            const Children& children)
+            int height)
     {
+        assert(entrants.size() < std::numeric_limits<EntrantId>::max());
 
         CachedEntrant e;
+        e.id = entrants.size();
         e.address = address;
         e.address_type = address_type;
         e.height = height;
-        e.children = children;
+        e.children_begin = children.size();
+        e.children_end = children.size();
 
         entrants.emplace_back(e);
-        auto ei = entrant_idx.insert(std::make_pair(address, entrants.size() - 1));
+        auto ei = entrant_idx.insert(std::make_pair(address, e.id));
         assert(ei.second);
-        return entrants.back();
+        return e.id;
+    }
+
+    void CGSContext::AddChild(EntrantId child)
+    {
+        assert(!entrants.empty());
+        assert(entrants.back().children_end == children.size());
+
+        children.push_back(child);
+        entrants.back().children_end++;
     }
 
     CachedEntrant& CGSContext::GetEntrant(const referral::Address& a)
@@ -620,4 +1138,10 @@ namespace pog3
         return entrants[p->second];
     }
 
+    const CachedEntrant* CGSContext::FindEntrant(const referral::Address& a) const
+    {
+        const auto p = entrant_idx.find(a);
+        return p == entrant_idx.end() ? nullptr : &entrants[p->second];
+    }
+
 } // namespace pog3
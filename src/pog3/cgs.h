@@ -11,6 +11,9 @@
 #include "referrals.h"
 #include "pog/wrs.h"
 #include "coins.h"
+#include "addressindex.h"
+#include "sync.h"
+#include "uint256.h"
 
 #include <vector>
 #include <boost/optional.hpp>
@@ -65,15 +68,32 @@ namespace pog3
     using Addresses = std::vector<referral::Address>;
     using Children = Addresses;
 
+    //Dense id of an entrant in a CGSContext. Ids are given in the breadth
+    //first order of the walk from the genesis address, which is id 0.
+    using EntrantId = uint32_t;
+    using EntrantIds = std::vector<EntrantId>;
+
     struct CachedEntrant
     {
+        EntrantId id;
         referral::Address address;
         char address_type;
-        Coins coins;
+
+        //Range of the entrant's coins in CGSContext::coins
+        size_t coins_begin = 0;
+        size_t coins_end = 0;
         BalancePair balances;
-        Contribution contribution;
         int height;
-        Children children;
+
+        //Range of the entrant's children in CGSContext::children
+        size_t children_begin = 0;
+        size_t children_end = 0;
+
+        //Weighted score of the subtree rooted at this entrant. Computed once
+        //since it is needed both by the entrant and by its parent.
+        bool scored = false;
+        ContributionAmount score = 0.0;
+        size_t tree_size = 0;
     };
 
     struct CGSContext
@@ -84,26 +104,126 @@ namespace pog3
         SubtreeContribution tree_contribution; 
 
         std::vector<CachedEntrant> entrants;
-        std::map<referral::Address, size_t> entrant_idx;
+        std::map<referral::Address, EntrantId> entrant_idx;
+
+        //Children of all entrants stored contiguously grouped by parent.
+        EntrantIds children;
+
+        //Coins of all entrants stored contiguously grouped by entrant.
+        Coins coins;
+
+        //Indexed by entrant id.
+        std::vector<Contribution> contributions;
+        std::vector<SubtreeContribution> subtree_contributions;
+        std::vector<bool> has_subtree_contribution;
 
-        std::map<referral::Address, SubtreeContribution> subtree_contribution;
         double B;
         double S;
 
-        CachedEntrant& AddEntrant(
+        /**
+         * Entrants must be added in id order. The children of an entrant are
+         * added with AddChild right after the entrant itself.
+         */
+        EntrantId AddEntrant(
                 char address_type,
                 const referral::Address& address,
-                int height,
-                const Children& children);
+                int height);
+
+        void AddChild(EntrantId child);
 
         CachedEntrant& GetEntrant(const referral::Address&);
         const CachedEntrant& GetEntrant(const referral::Address&) const;
 
+        /** Null if the address is not in the context */
+        const CachedEntrant* FindEntrant(const referral::Address&) const;
+
         ctpl::thread_pool* cgs_pool = nullptr;
     };
 
     using Entrants = std::vector<Entrant>;
 
+    //Coin along with the index of the entrant that owns it.
+    using EntrantCoin = std::pair<size_t, Coin>;
+    using EntrantCoins = std::vector<EntrantCoin>;
+
+    using UnspentUpdate = std::pair<CAddressUnspentKey, CAddressUnspentValue>;
+    using UnspentUpdates = std::vector<UnspentUpdate>;
+
+    /**
+     * Coins of an address keyed by outpoint so that spends can be removed
+     * without scanning.
+     */
+    using CoinOutPoint = std::pair<uint256, uint32_t>;
+    using AddressCoins = std::map<CoinOutPoint, Coin>;
+
+    struct TreeNode
+    {
+        char address_type;
+        int height;
+        Children children;
+    };
+
+    /**
+     * CGSState keeps the inputs of the CGS computation, the referral tree and
+     * the coins of every address, in memory and applies the changes of each
+     * connected or disconnected block to them. This avoids walking the
+     * referral DB and scanning all address unspent outputs for every block.
+     *
+     * Because every coin and beacon ages each block, contributions and scores
+     * are still recomputed from these inputs in the exact same order as the
+     * full computation which keeps the results identical.
+     *
+     * The state is only valid for the block it was last synced to. If it is
+     * asked for a different block it must be rebuilt from the databases.
+     */
+    class CGSState
+    {
+    public:
+        /** Returns true if the state reflects the chain ending in block_hash */
+        bool IsSynced(const uint256& block_hash) const;
+
+        /** Rebuild the state from the referral DB and address unspent index */
+        bool Rebuild(
+                referral::ReferralsViewCache&,
+                const Consensus::Params&,
+                const uint256& block_hash);
+
+        /** Apply a block on top of prev_hash. No-op if not synced to it */
+        void ConnectBlock(
+                const uint256& prev_hash,
+                const uint256& block_hash,
+                int height,
+                const referral::ReferralRefs& ordered_referrals,
+                const UnspentUpdates& unspent);
+
+        /** Revert block_hash back to prev_hash. No-op if not synced to it */
+        void DisconnectBlock(
+                const uint256& block_hash,
+                const uint256& prev_hash,
+                const referral::ReferralRefs& referrals,
+                const UnspentUpdates& unspent);
+
+        /** Forget everything. The next use will rebuild. */
+        void Invalidate();
+
+        /**
+         * Fills the context with the entrants in the same order a walk of
+         * the referral DB would produce along with their coins.
+         */
+        void FillContext(
+                CGSContext& context,
+                const Consensus::Params&,
+                int tip_height) const;
+
+    private:
+        void ApplyUnspent(const UnspentUpdates&);
+
+        mutable CCriticalSection cs;
+        uint256 best_block;
+        std::map<referral::Address, TreeNode> tree;
+        std::map<referral::Address, AddressCoins> coins;
+    };
+
     void GetAllRewardableEntrants(
             CGSContext& context,
             referral::ReferralsViewCache&,
@@ -111,15 +231,43 @@ namespace pog3
             int height,
             Entrants&);
 
+    /**
+     * Same as above except the entrants and coins come from the incrementally
+     * maintained state instead of the databases.
+     */
+    void GetAllRewardableEntrants(
+            CGSContext& context,
+            const CGSState&,
+            referral::ReferralsViewCache&,
+            const Consensus::Params&,
+            int height,
+            Entrants&);
+
 
     Entrant ComputeCGS(
             CGSContext& context,
             const CachedEntrant& entrant,
             referral::ReferralsViewCache& db);
 
+    /**
+     * Same as above for a context whose subtree contributions are all
+     * computed. The context is only read so threads can share it.
+     */
+    Entrant ComputeCGS(
+            const CGSContext& context,
+            const CachedEntrant& entrant);
+
+    /**
+     * Computes the subtree contribution of every entrant once, bottom up one
+     * depth at a time with the entrants of a depth split over the CGS thread
+     * pool. The result does not depend on the number of threads.
+     */
+    void ComputeAllSubtreeContributions(CGSContext& context);
+
     void TestChain();
     void SetupCgsThreadPool(size_t threads);
     ctpl::thread_pool* GetCgsThreadPool();
+    CGSState& GetCgsState();
 
     CAmount GetAmbassadorMinumumStake(int height, const Consensus::Params& consensus_params);
 
@@ -11,12 +11,108 @@
 #include "primitives/referral.h"
 #include "serialize.h"
 #include "uint256.h"
+#include <algorithm>
+#include <initializer_list>
 #include <set>
+#include <stdexcept>
 
 #include <iostream>
 
 const uint32_t DAEDALUS_BIT = static_cast<uint32_t>(1) << 27;
 
+/**
+ * The nonces of a cuckoo cycle in ascending order. They are stored inline
+ * so block headers and block index entries do not allocate for them. It
+ * serializes exactly like the std::set<uint32_t> it replaced: unordered and
+ * duplicate nonces read from a stream are sorted and merged the same way.
+ */
+class CCycle
+{
+public:
+    /** Proof size of every network */
+    static const size_t CAPACITY = 42;
+
+    typedef const uint32_t* const_iterator;
+
+    CCycle() : count(0) {}
+
+    CCycle(std::initializer_list<uint32_t> nonces) : count(0)
+    {
+        for (const auto nonce : nonces) {
+            insert(nonce);
+        }
+    }
+
+    explicit CCycle(const std::set<uint32_t>& nonces) : count(0)
+    {
+        if (nonces.size() > CAPACITY) {
+            throw std::length_error("cuckoo cycle too long");
+        }
+        std::copy(nonces.begin(), nonces.end(), this->nonces);
+        count = nonces.size();
+    }
+
+    const_iterator begin() const { return nonces; }
+    const_iterator end() const { return nonces + count; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    void clear() { count = 0; }
+
+    /** Adds a nonce unless the cycle already has it. Throws when full. */
+    void insert(uint32_t nonce)
+    {
+        uint32_t* pos = std::lower_bound(nonces, nonces + count, nonce);
+        if (pos != nonces + count && *pos == nonce) {
+            return;
+        }
+        if (count == CAPACITY) {
+            throw std::length_error("cuckoo cycle too long");
+        }
+        std::copy_backward(pos, nonces + count, nonces + count + 1);
+        *pos = nonce;
+        count++;
+    }
+
+    friend bool operator==(const CCycle& a, const CCycle& b)
+    {
+        return a.count == b.count && std::equal(a.begin(), a.end(), b.begin());
+    }
+
+    friend bool operator!=(const CCycle& a, const CCycle& b)
+    {
+        return !(a == b);
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s) const
+    {
+        WriteCompactSize(s, count);
+        for (const auto nonce : *this) {
+            ::Serialize(s, nonce);
+        }
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s)
+    {
+        clear();
+        const uint64_t size = ReadCompactSize(s);
+        for (uint64_t i = 0; i < size; i++) {
+            uint32_t nonce;
+            ::Unserialize(s, nonce);
+            try {
+                insert(nonce);
+            } catch (const std::length_error&) {
+                throw std::ios_base::failure("cuckoo cycle too long");
+            }
+        }
+    }
+
+private:
+    uint32_t nonces[CAPACITY];
+    uint8_t count;
+};
+
 /** Nodes collect new transactions into a block, hash them into a hash tree,
  * and scan through nonce values to make the block's hash satisfy proof-of-work
  * requirements.  When they solve the proof-of-work, they broadcast the block
@@ -35,7 +131,7 @@ public:
     uint32_t nBits;
     uint32_t nNonce;
     uint8_t nEdgeBits;
-    std::set<uint32_t> sCycle;
+    CCycle sCycle;
 
     CBlockHeader()
     {
@@ -5,6 +5,7 @@
 #include "refdb.h"
 
 #include "base58.h"
+#include "util.h"
 #include <boost/rational.hpp>
 #include <boost/multiprecision/cpp_int.hpp>
 #include <limits>
@@ -18,7 +19,11 @@ namespace referral
 {
     namespace
     {
+        //legacy, children stored as one vector per parent. See Upgrade.
         const char DB_CHILDREN = 'c';
+        const char DB_CHILD = 'E';
+        const char DB_CHILD_SEQ = 'Q';
+        const char DB_CHILD_META = 'C';
         const char DB_REFERRALS = 'r';
         const char DB_HASH = 'h';
         const char DB_PARENT_ADDRESS = 'p';
@@ -40,6 +45,37 @@ namespace referral
         bool comp(const LotteryEntrant& a, const LotteryEntrant& b) {
             return std::get<0>(a) < std::get<0>(b);
         }
+
+        /**
+         * Key of a single child record. The sequence number is serialized
+         * big endian so that the children of a parent are iterated in the
+         * order they were inserted.
+         */
+        struct ChildKey
+        {
+            Address parent;
+            uint64_t seq;
+
+            ChildKey() : seq{0} {}
+            ChildKey(const Address& p, uint64_t s) : parent{p}, seq{s} {}
+
+            template<typename Stream>
+            void Serialize(Stream& s) const {
+                s << parent;
+                ser_writedata32be(s, static_cast<uint32_t>(seq >> 32));
+                ser_writedata32be(s, static_cast<uint32_t>(seq));
+            }
+
+            template<typename Stream>
+            void Unserialize(Stream& s) {
+                s >> parent;
+                seq = static_cast<uint64_t>(ser_readdata32be(s)) << 32;
+                seq |= ser_readdata32be(s);
+            }
+        };
+
+        //Next sequence number and number of children of a parent.
+        using ChildMeta = std::pair<uint64_t, uint64_t>;
     }
 
     //stores ANV internally as a rational number with numerator/denominator
@@ -145,13 +181,154 @@ namespace referral
             MaybeAddressPair{};
     }
 
+    ChildIterator::ChildIterator(CDBIterator* iter, const Address& parent) :
+        m_iter{iter}
+    {
+        Seek(parent);
+    }
+
+    void ChildIterator::Seek(const Address& parent)
+    {
+        m_parent = parent;
+        m_iter->Seek(std::make_pair(DB_CHILD, ChildKey{m_parent, 0}));
+        Load();
+    }
+
+    void ChildIterator::Next()
+    {
+        m_iter->Next();
+        Load();
+    }
+
+    void ChildIterator::Load()
+    {
+        std::pair<char, ChildKey> key;
+        m_valid = m_iter->Valid() &&
+            m_iter->GetKey(key) &&
+            key.first == DB_CHILD &&
+            key.second.parent == m_parent &&
+            m_iter->GetValue(m_child);
+    }
+
     ChildAddresses ReferralsViewDB::GetChildren(const Address& address) const
     {
         ChildAddresses children;
-        m_db.Read(std::make_pair(DB_CHILDREN, address), children);
+        for (auto it = IterateChildren(address); it->Valid(); it->Next()) {
+            children.push_back(it->GetAddress());
+        }
         return children;
     }
 
+    std::unique_ptr<ChildIterator> ReferralsViewDB::IterateChildren(const Address& address) const
+    {
+        return std::unique_ptr<ChildIterator>{
+            new ChildIterator{m_db.NewIterator(), address}};
+    }
+
+    uint64_t ReferralsViewDB::GetChildCount(const Address& address) const
+    {
+        ChildMeta meta{0, 0};
+        m_db.Read(std::make_pair(DB_CHILD_META, address), meta);
+        return meta.second;
+    }
+
+    bool ReferralsViewDB::InsertChild(const Address& parent, const Address& child)
+    {
+        ChildMeta meta{0, 0};
+        m_db.Read(std::make_pair(DB_CHILD_META, parent), meta);
+
+        const auto seq = meta.first;
+        meta.first++;
+        meta.second++;
+
+        CDBBatch batch(m_db);
+        batch.Write(std::make_pair(DB_CHILD, ChildKey{parent, seq}), child);
+        batch.Write(std::make_pair(DB_CHILD_SEQ, child), seq);
+        batch.Write(std::make_pair(DB_CHILD_META, parent), meta);
+        return m_db.WriteBatch(batch);
+    }
+
+    bool ReferralsViewDB::RemoveChild(const Address& parent, const Address& child)
+    {
+        uint64_t seq;
+        if (!m_db.Read(std::make_pair(DB_CHILD_SEQ, child), seq)) {
+            return true;
+        }
+
+        ChildMeta meta{0, 0};
+        m_db.Read(std::make_pair(DB_CHILD_META, parent), meta);
+        if (meta.second > 0) {
+            meta.second--;
+        }
+
+        CDBBatch batch(m_db);
+        batch.Erase(std::make_pair(DB_CHILD, ChildKey{parent, seq}));
+        batch.Erase(std::make_pair(DB_CHILD_SEQ, child));
+        batch.Write(std::make_pair(DB_CHILD_META, parent), meta);
+        return m_db.WriteBatch(batch);
+    }
+
+    bool ReferralsViewDB::Upgrade()
+    {
+        std::unique_ptr<CDBIterator> iter{m_db.NewIterator()};
+        iter->Seek(std::make_pair(DB_CHILDREN, Address{}));
+        if (!iter->Valid()) {
+            return true;
+        }
+
+        std::pair<char, Address> key;
+        if (!iter->GetKey(key) || key.first != DB_CHILDREN) {
+            return true;
+        }
+
+        LogPrintf("Upgrading referral children database...\n");
+
+        const size_t batch_size = (size_t)gArgs.GetArg("-dbbatchsize", nDefaultDbBatchSize);
+        CDBBatch batch(m_db);
+        size_t parents = 0;
+
+        while (iter->Valid()) {
+            if (!iter->GetKey(key) || key.first != DB_CHILDREN) {
+                break;
+            }
+
+            ChildAddresses children;
+            if (!iter->GetValue(children)) {
+                return error("%s: cannot parse children record", __func__);
+            }
+
+            uint64_t seq = 0;
+            for (const auto& child : children) {
+                batch.Write(std::make_pair(DB_CHILD, ChildKey{key.second, seq}), child);
+                batch.Write(std::make_pair(DB_CHILD_SEQ, child), seq);
+                seq++;
+            }
+
+            if (!children.empty()) {
+                batch.Write(std::make_pair(DB_CHILD_META, key.second), ChildMeta{seq, seq});
+            }
+
+            batch.Erase(key);
+            parents++;
+
+            if (batch.SizeEstimate() > batch_size) {
+                if (!m_db.WriteBatch(batch)) {
+                    return false;
+                }
+                batch.Clear();
+            }
+
+            iter->Next();
+        }
+
+        if (!m_db.WriteBatch(batch)) {
+            return false;
+        }
+
+        LogPrintf("Upgraded children of %d referrals\n", parents);
+        return true;
+    }
+
     bool ReferralsViewDB::InsertReferral(
             int height,
             const Referral& referral,
@@ -219,14 +396,9 @@ namespace referral
             if (!m_db.Write(std::make_pair(DB_PARENT_ADDRESS, referral.GetAddress()), parent_addr_pair))
                 return false;
 
-            // Now we update the children of the parent address by inserting into the
-            // child address array for the parent.
-            ChildAddresses children;
-            m_db.Read(std::make_pair(DB_CHILDREN, referral.parentAddress), children);
-
-            children.push_back(referral.GetAddress());
-
-            if (!m_db.Write(std::make_pair(DB_CHILDREN, referral.parentAddress), children))
+            // Now we update the children of the parent address by appending
+            // a child record for the parent.
+            if (!InsertChild(referral.parentAddress, referral.GetAddress()))
                 return false;
 
             LogPrint(BCLog::BEACONS, "Inserted referral %s parent %s\n",
@@ -269,14 +441,7 @@ namespace referral
             return false;
         }
 
-        ChildAddresses children;
-        m_db.Read(std::make_pair(DB_CHILDREN, referral.parentAddress), children);
-
-        children.erase(std::remove(std::begin(children), std::end(children),
-                    referral.GetAddress()),
-                std::end(children));
-
-        if (!m_db.Write(std::make_pair(DB_CHILDREN, referral.parentAddress), children)) {
+        if (!RemoveChild(referral.parentAddress, referral.GetAddress())) {
             return false;
         }
 
@@ -377,6 +542,102 @@ namespace referral
         return true;
     }
 
+    namespace {
+        /**
+         * The ANV as it is read back once written. Parts past 64 bits do not
+         * survive serialization, so values are passed through it to match
+         * what reading the DB after every update gives.
+         */
+        AnvInternal StoredANV(const AnvRat& anv)
+        {
+            CDataStream ss(SER_DISK, CLIENT_VERSION);
+            ss << AnvInternal{anv.numerator(), anv.denominator()};
+
+            AnvInternal stored;
+            ss >> stored;
+            return stored;
+        }
+    }
+
+    /**
+     * Applies all the ANV changes of a block at once. The changes walk the
+     * ancestor paths in order like UpdateANV does, but each ANV touched is
+     * read once and the results are written in a single batch. Values are
+     * kept as they would be stored after each change so the result is the
+     * same as calling UpdateANV for every change, even once an ANV no longer
+     * fits the stored form.
+     */
+    bool ReferralsViewDB::UpdateANV(const ANVChanges& changes)
+    {
+        std::map<Address, ANVTuple> anvs;
+        std::map<Address, MaybeAddressPair> parents;
+
+        for (const auto& c : changes) {
+            const auto change = std::get<2>(c);
+            if (change == 0) {
+                continue;
+            }
+
+            LogPrint(BCLog::BEACONS, "\tUpdateANV: %s + %d\n",
+                    CMeritAddress(std::get<0>(c), std::get<1>(c)).ToString(), change);
+
+            AnvRat change_rat = int128_t{change};
+            MaybeAddress address = std::get<1>(c);
+            size_t level = 0;
+
+            //MAX_LEVELS guards against cycles in DB
+            while (address && level < MAX_LEVELS) {
+                auto anv = anvs.find(*address);
+                if (anv == anvs.end()) {
+                    //it's possible address didn't exist yet so an ANV of 0 is assumed.
+                    ANVTuple read;
+                    if (!m_db.Read(std::make_pair(DB_ANV, *address), read)) {
+                        LogPrint(BCLog::BEACONS, "\tFailed to read ANV for %s\n", address->GetHex());
+                        return false;
+                    }
+
+                    assert(std::get<0>(read) != 0);
+                    assert(!std::get<1>(read).IsNull());
+                    anv = anvs.emplace(*address, read).first;
+                }
+
+                auto& anv_in = std::get<2>(anv->second);
+
+                AnvRat anv_rat{anv_in.first, anv_in.second};
+                anv_rat += change_rat;
+
+                assert(anv_rat.numerator() >= 0);
+                assert(anv_rat.denominator() > 0);
+
+                anv_in = StoredANV(anv_rat);
+
+                auto parent = parents.find(*address);
+                if (parent == parents.end()) {
+                    parent = parents.emplace(*address, GetParentAddress(*address)).first;
+                }
+
+                if (parent->second) {
+                    address = parent->second->second;
+                } else {
+                    address.reset();
+                }
+                level++;
+                change_rat /= 2;
+            }
+
+            // We should never have cycles in the DB.
+            // Hacked? Bug?
+            assert(level < MAX_LEVELS && "reached max levels. Referral DB cycle detected");
+        }
+
+        CDBBatch batch(m_db);
+        for (const auto& anv : anvs) {
+            batch.Write(std::make_pair(DB_ANV, anv.first), anv.second);
+        }
+
+        return m_db.WriteBatch(batch);
+    }
+
     CAmount AnvInToAnvPub(const AnvInternal& in)
     {
         AnvRat anv_rat{in.first, in.second};
@@ -442,7 +703,7 @@ namespace referral
         bool found_genesis = false;
         for (uint64_t i = 0; i < heap_size; i++) {
             LotteryEntrant v;
-            if (!m_db.Read(std::make_pair(DB_LOT_VAL, i), v)) {
+            if (!ReadLotteryEntrant(i, v)) {
                 break;
             }
 
@@ -470,22 +731,20 @@ namespace referral
 
     bool ReferralsViewDB::FindLotteryPos(const Address& address, uint64_t& pos) const
     {
-        if (m_db.Read(std::make_pair(DB_LOT_INV, address), pos)) {
+        if (ReadLotteryPos(address, pos)) {
             return true;
         }
 
         const auto heap_size = GetLotteryHeapSize();
         for (uint64_t i = 0; i < heap_size; i++) {
             LotteryEntrant v;
-            if (!m_db.Read(std::make_pair(DB_LOT_VAL, i), v)) {
+            if (!ReadLotteryEntrant(i, v)) {
                 return false;
             }
 
             if (std::get<2>(v) == address) {
                 pos = i;
-                if (!m_db.Write(std::make_tuple(DB_LOT_INV, address), pos)) {
-                    return false;
-                }
+                WriteLotteryPos(address, pos);
                 return true;
             }
         }
@@ -669,19 +928,157 @@ namespace referral
         return true;
     }
 
+    void ReferralsViewDB::LoadLottery() const
+    {
+        if (m_lottery.loaded) {
+            return;
+        }
+
+        m_lottery.size = 0;
+        m_db.Read(DB_LOT_SIZE, m_lottery.size);
+
+        std::unique_ptr<CDBIterator> iter{m_db.NewIterator()};
+
+        //Stale slots past the end of the heap and stale inverse entries are
+        //loaded too so the image matches the DB records exactly.
+        iter->Seek(std::make_pair(DB_LOT_VAL, uint64_t{0}));
+        while (iter->Valid()) {
+            std::pair<char, uint64_t> key;
+            if (!iter->GetKey(key) || key.first != DB_LOT_VAL) {
+                break;
+            }
+
+            LotteryEntrant v;
+            if (iter->GetValue(v)) {
+                m_lottery.entrants.emplace(key.second, v);
+            }
+            iter->Next();
+        }
+
+        iter->Seek(std::make_pair(DB_LOT_INV, Address{}));
+        while (iter->Valid()) {
+            std::pair<char, Address> key;
+            if (!iter->GetKey(key) || key.first != DB_LOT_INV) {
+                break;
+            }
+
+            uint64_t pos;
+            if (iter->GetValue(pos)) {
+                m_lottery.positions.emplace(key.second, pos);
+            }
+            iter->Next();
+        }
+
+        m_lottery.loaded = true;
+        LogPrint(BCLog::BEACONS, "Loaded lottery heap of size %d with %d slots and %d positions\n",
+                m_lottery.size, m_lottery.entrants.size(), m_lottery.positions.size());
+    }
+
+    bool ReferralsViewDB::FlushLottery()
+    {
+        if (!m_lottery.loaded) {
+            return true;
+        }
+
+        if (!m_lottery.size_dirty &&
+                m_lottery.dirty_entrants.empty() &&
+                m_lottery.dirty_positions.empty()) {
+            return true;
+        }
+
+        CDBBatch batch(m_db);
+        if (m_lottery.size_dirty) {
+            batch.Write(DB_LOT_SIZE, m_lottery.size);
+        }
+
+        for (const auto pos : m_lottery.dirty_entrants) {
+            const auto e = m_lottery.entrants.find(pos);
+            assert(e != m_lottery.entrants.end());
+            batch.Write(std::make_pair(DB_LOT_VAL, pos), e->second);
+        }
+
+        for (const auto& address : m_lottery.dirty_positions) {
+            const auto p = m_lottery.positions.find(address);
+            if (p != m_lottery.positions.end()) {
+                batch.Write(std::make_pair(DB_LOT_INV, address), p->second);
+            } else {
+                batch.Erase(std::make_pair(DB_LOT_INV, address));
+            }
+        }
+
+        LogPrint(BCLog::BEACONS, "Flushing lottery heap: %d slots and %d positions changed\n",
+                m_lottery.dirty_entrants.size(), m_lottery.dirty_positions.size());
+
+        if (!m_db.WriteBatch(batch)) {
+            return false;
+        }
+
+        m_lottery.size_dirty = false;
+        m_lottery.dirty_entrants.clear();
+        m_lottery.dirty_positions.clear();
+        return true;
+    }
+
+    bool ReferralsViewDB::ReadLotteryEntrant(uint64_t pos, LotteryEntrant& v) const
+    {
+        LoadLottery();
+        const auto e = m_lottery.entrants.find(pos);
+        if (e == m_lottery.entrants.end()) {
+            return false;
+        }
+        v = e->second;
+        return true;
+    }
+
+    void ReferralsViewDB::WriteLotteryEntrant(uint64_t pos, const LotteryEntrant& v)
+    {
+        LoadLottery();
+        m_lottery.entrants[pos] = v;
+        m_lottery.dirty_entrants.insert(pos);
+    }
+
+    bool ReferralsViewDB::ReadLotteryPos(const Address& address, uint64_t& pos) const
+    {
+        LoadLottery();
+        const auto p = m_lottery.positions.find(address);
+        if (p == m_lottery.positions.end()) {
+            return false;
+        }
+        pos = p->second;
+        return true;
+    }
+
+    void ReferralsViewDB::WriteLotteryPos(const Address& address, uint64_t pos) const
+    {
+        LoadLottery();
+        m_lottery.positions[address] = pos;
+        m_lottery.dirty_positions.insert(address);
+    }
+
+    void ReferralsViewDB::EraseLotteryPos(const Address& address)
+    {
+        LoadLottery();
+        m_lottery.positions.erase(address);
+        m_lottery.dirty_positions.insert(address);
+    }
+
+    void ReferralsViewDB::SetLotteryHeapSize(uint64_t size)
+    {
+        LoadLottery();
+        m_lottery.size = size;
+        m_lottery.size_dirty = true;
+    }
+
     uint64_t ReferralsViewDB::GetLotteryHeapSize() const
     {
-        uint64_t size = 0;
-        m_db.Read(DB_LOT_SIZE, size);
-        return size;
+        LoadLottery();
+        return m_lottery.size;
     }
 
     MaybeLotteryEntrant ReferralsViewDB::GetMinLotteryEntrant() const
     {
         LotteryEntrant v;
-
-        const uint64_t first = 0;
-        return m_db.Read(std::make_pair(DB_LOT_VAL, first), v) ?
+        return ReadLotteryEntrant(0, v) ?
             MaybeLotteryEntrant{v} :
             MaybeLotteryEntrant{};
     }
@@ -709,7 +1106,7 @@ namespace referral
             const auto parent_pos = (pos - 1) / 2;
 
             LotteryEntrant parent_value;
-            if (!m_db.Read(std::make_pair(DB_LOT_VAL, parent_pos), parent_value)) {
+            if (!ReadLotteryEntrant(parent_pos, parent_value)) {
                 return false;
             }
 
@@ -719,30 +1116,19 @@ namespace referral
             }
 
             //Push our parent down since we are moving up.
-            if (!m_db.Write(std::make_tuple(DB_LOT_VAL, pos), parent_value)) {
-                return false;
-            }
-
-            if (!m_db.Write(std::make_tuple(DB_LOT_INV, std::get<2>(parent_value)), pos)) {
-                return false;
-            }
+            WriteLotteryEntrant(pos, parent_value);
+            WriteLotteryPos(std::get<2>(parent_value), pos);
 
             pos = parent_pos;
         }
 
         //write final value
         LogPrint(BCLog::BEACONS, "\tAdding to Reservoir %s at pos %d\n", CMeritAddress(address_type, address).ToString(), pos);
-        if (!m_db.Write(std::make_pair(DB_LOT_VAL, pos), new_entry)) {
-            return false;
-        }
-
-        if (!m_db.Write(std::make_tuple(DB_LOT_INV, address), pos)) {
-            return false;
-        }
+        WriteLotteryEntrant(pos, new_entry);
+        WriteLotteryPos(address, pos);
 
         uint64_t new_size = heap_size + 1;
-        if (!m_db.Write(DB_LOT_SIZE, new_size))
-            return false;
+        SetLotteryHeapSize(new_size);
 
         assert(new_size <= max_reservoir_size);
         return true;
@@ -769,18 +1155,16 @@ namespace referral
         if (heap_size == 0) return false;
 
         LotteryEntrant last;
-        if (!m_db.Read(std::make_pair(DB_LOT_VAL, heap_size - 1), last)) {
+        if (!ReadLotteryEntrant(heap_size - 1, last)) {
             return false;
         }
 
         LotteryEntrant current_val;
-        if (!m_db.Read(std::make_pair(DB_LOT_VAL, current), current_val)) {
+        if (!ReadLotteryEntrant(current, current_val)) {
             return false;
         }
 
-        if (!m_db.Erase(std::make_tuple(DB_LOT_INV, std::get<2>(current_val)))) {
-            return false;
-        }
+        EraseLotteryPos(std::get<2>(current_val));
 
         LotteryEntrant smallest_val = last;
 
@@ -792,7 +1176,7 @@ namespace referral
 
             if (left < heap_size) {
                 LotteryEntrant left_val;
-                if (!m_db.Read(std::make_pair(DB_LOT_VAL, left), left_val)) {
+                if (!ReadLotteryEntrant(left, left_val)) {
                     return false;
                 }
 
@@ -804,7 +1188,7 @@ namespace referral
 
             if (right < heap_size) {
                 LotteryEntrant right_val;
-                if (!m_db.Read(std::make_pair(DB_LOT_VAL, right), right_val)) {
+                if (!ReadLotteryEntrant(right, right_val)) {
                     return false;
                 }
 
@@ -816,13 +1200,8 @@ namespace referral
 
             if (smallest != current) {
                 //write the current element with the smallest
-                if (!m_db.Write(std::make_pair(DB_LOT_VAL, current), smallest_val)) {
-                    return false;
-                }
-
-                if (!m_db.Write(std::make_tuple(DB_LOT_INV, std::get<2>(smallest_val)), current)) {
-                        return false;
-                }
+                WriteLotteryEntrant(current, smallest_val);
+                WriteLotteryPos(std::get<2>(smallest_val), current);
 
                 //now go down the smallest path
                 current = smallest;
@@ -833,18 +1212,11 @@ namespace referral
 
         //finally write the value in the correct spot and reduce the heap
         //size by 1
-        if (!m_db.Write(std::make_pair(DB_LOT_VAL, current), last)) {
-            return false;
-        }
-
-        if (!m_db.Write(std::make_tuple(DB_LOT_INV, std::get<2>(last)), current)) {
-            return false;
-        }
+        WriteLotteryEntrant(current, last);
+        WriteLotteryPos(std::get<2>(last), current);
 
         uint64_t new_size = heap_size - 1;
-        if (!m_db.Write(DB_LOT_SIZE, new_size)) {
-            return false;
-        }
+        SetLotteryHeapSize(new_size);
 
         LogPrint(BCLog::BEACONS, "\tPopped from lottery reservoir, last ended up at %d\n", current);
         return true;
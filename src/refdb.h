@@ -14,6 +14,9 @@
 #include "pog/wrs.h"
 
 #include <boost/optional.hpp>
+#include <map>
+#include <memory>
+#include <set>
 #include <vector>
 
 namespace referral
@@ -30,6 +33,8 @@ using MaybeLotteryEntrant = boost::optional<LotteryEntrant>;
 using AddressPair = std::pair<char, Address>;
 using MaybeAddressPair = boost::optional<AddressPair>;
 using TransactionHash = uint256;
+using ANVChange = std::tuple<char, Address, CAmount>;
+using ANVChanges = std::vector<ANVChange>;
 
 struct AddressANV
 {
@@ -74,10 +79,62 @@ struct LotteryUndo
 
 using LotteryUndos = std::vector<LotteryUndo>;
 
+/**
+ * In memory image of the lottery heap records in the referral DB. Every
+ * sift step of the heap used to be a DB read and write. The image is loaded
+ * once, mutated in memory and the changed records are written back in a
+ * single batch when the chainstate is flushed.
+ */
+struct LotteryHeap
+{
+    bool loaded = false;
+    uint64_t size = 0;
+    std::map<uint64_t, LotteryEntrant> entrants;
+    std::map<Address, uint64_t> positions;
+
+    bool size_dirty = false;
+    std::set<uint64_t> dirty_entrants;
+    std::set<Address> dirty_positions;
+};
+
+/**
+ * Walks the children of an address in the order they were inserted. Each
+ * child is its own record in the DB so large families are streamed instead
+ * of being deserialized as one vector.
+ */
+class ChildIterator
+{
+public:
+    ChildIterator(CDBIterator* iter, const Address& parent);
+
+    bool Valid() const { return m_valid; }
+    void Next();
+
+    /**
+     * Moves to the first child of another parent. Walks of the tree reuse
+     * one iterator this way instead of opening one per address.
+     */
+    void Seek(const Address& parent);
+    const Address& GetAddress() const { return m_child; }
+
+private:
+    void Load();
+
+    std::unique_ptr<CDBIterator> m_iter;
+    Address m_parent;
+    Address m_child;
+    bool m_valid = false;
+};
+
 class ReferralsViewDB
 {
 protected:
     mutable CDBWrapper m_db;
+    mutable LotteryHeap m_lottery;
+
+    /** Loads the lottery heap image from the DB if it is not loaded yet */
+    void LoadLottery() const;
+
 public:
     explicit ReferralsViewDB(
             size_t cache_size,
@@ -99,8 +156,14 @@ public:
     MaybeAddressPair GetParentAddress(const Address&) const;
     MaybeAddress GetAddressByPubKey(const CPubKey&) const;
     ChildAddresses GetChildren(const Address&) const;
+    std::unique_ptr<ChildIterator> IterateChildren(const Address&) const;
+    uint64_t GetChildCount(const Address&) const;
+
+    /** Convert children stored as a single vector per address to one record per child */
+    bool Upgrade();
 
     bool UpdateANV(char address_type, const Address&, CAmount);
+    bool UpdateANV(const ANVChanges&);
     MaybeAddressANV GetANV(const Address&) const;
     AddressANVs GetAllANVs() const;
     bool OrderReferrals(referral::ReferralRefs& refs);
@@ -133,6 +196,9 @@ public:
             const LotteryUndo&,
             const uint64_t max_reservoir_size);
 
+    /** Write changes to the lottery heap to disk */
+    bool FlushLottery();
+
     //Daedalus code.
     bool Exists(const Address&) const;
 
@@ -155,6 +221,16 @@ public:
     int GetNewInviteRewardedHeight(const Address&) const;
 
 private:
+    bool InsertChild(const Address& parent, const Address& child);
+    bool RemoveChild(const Address& parent, const Address& child);
+
+    bool ReadLotteryEntrant(uint64_t pos, LotteryEntrant&) const;
+    void WriteLotteryEntrant(uint64_t pos, const LotteryEntrant&);
+    bool ReadLotteryPos(const Address&, uint64_t& pos) const;
+    void WriteLotteryPos(const Address&, uint64_t pos) const;
+    void EraseLotteryPos(const Address&);
+    void SetLotteryHeapSize(uint64_t size);
+
     uint64_t GetLotteryHeapSize() const;
     MaybeLotteryEntrant GetMinLotteryEntrant() const;
     bool FindLotteryPos(const Address& address, uint64_t& pos) const;
@@ -312,6 +312,18 @@ namespace referral
         return m_db->GetChildren(address);
     }
 
+    std::unique_ptr<ChildIterator> ReferralsViewCache::IterateChildren(const Address& address) const
+    {
+        assert(m_db);
+        return m_db->IterateChildren(address);
+    }
+
+    uint64_t ReferralsViewCache::GetChildCount(const Address& address) const
+    {
+        assert(m_db);
+        return m_db->GetChildCount(address);
+    }
+
     uint64_t ReferralsViewCache::GetTotalConfirmations() const
     {
         assert(m_db);
@@ -139,6 +139,8 @@ public:
             bool cached = false) const;
 
     ChildAddresses GetChildren(const Address&) const;
+    std::unique_ptr<ChildIterator> IterateChildren(const Address&) const;
+    uint64_t GetChildCount(const Address&) const;
 
     bool SetNewInviteRewardedHeight(const Address&, int height);
     int GetNewInviteRewardedHeight(const Address&) const;
@@ -81,7 +81,7 @@ double GetDifficulty(const CBlockIndex* blockindex)
     return dDiff;
 }
 
-std::string GetCycleStr(std::set<uint32_t> cycle)
+std::string GetCycleStr(const CCycle& cycle)
 {
     std::stringstream cycleStr;
     auto it = cycle.begin();
@@ -113,7 +113,7 @@ UniValue blockheaderToJSON(const CBlockIndex* blockindex)
     result.push_back(Pair("time", (int64_t)blockindex->nTime));
     result.push_back(Pair("mediantime", (int64_t)blockindex->GetMedianTimePast()));
     result.push_back(Pair("nonce", (uint64_t)blockindex->nNonce));
-    result.push_back(Pair("cycle", GetCycleStr(blockindex->sCycle)));
+    result.push_back(Pair("cycle", GetCycleStr(blockindex->GetCycle())));
     result.push_back(Pair("bits", strprintf("%08x", blockindex->nBits)));
     result.push_back(Pair("edgebits", strprintf("%u", blockindex->nEdgeBits)));
     result.push_back(Pair("difficulty", GetDifficulty(blockindex)));
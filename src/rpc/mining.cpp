@@ -133,6 +133,7 @@ UniValue generateBlocks(
     auto consensusParams = Params().GetConsensus();
 
     ctpl::thread_pool pool{nThreads};
+    CuckooSolver solver{nThreads, pool};
 
     do {
         const auto pblocktemplate =
@@ -157,9 +158,8 @@ UniValue generateBlocks(
                     pblock->nEdgeBits,
                     cycle,
                     consensusParams,
-                    nThreads,
-                    cycle_found,
-                    pool)) {
+                    solver,
+                    cycle_found)) {
 
             ++pblock->nNonce;
             --nMaxTries;
@@ -175,7 +175,7 @@ UniValue generateBlocks(
 
         assert(cycle.size() == consensusParams.nCuckooProofSize);
 
-        pblock->sCycle = cycle;
+        pblock->sCycle = CCycle{cycle};
 
         auto shared_pblock = std::make_shared<const CBlock>(*pblock);
 
@@ -253,6 +253,9 @@ UniValue getmininginfo(const JSONRPCRequest& request)
             "  \"errors\": \"...\"          (string) Current errors\n"
             "  \"mining\": true|false       (boolean) If the mining is on or off (see getmining or setmining calls)\n"
             "  \"mineproclimit\": n         (numeric) The processor limit for mining. -1 if no generation. (see getmining or setmining calls)\n"
+            "  \"minepipeline\": true|false (boolean) If the next graph is generated while the current one is trimmed\n"
+            "  \"graphsps\": nnn,           (numeric) Local graphs checked per second\n"
+            "  \"cyclesps\": nnn,           (numeric) Local cycles found per second\n"
             "  \"networkhashps\": nnn,      (numeric) The network hashes per second\n"
             "  \"nodehashps\": nnn,         (numeric) Local node hashes per second\n"
             "  \"pooledtx\": n              (numeric) The size of the mempool\n"
@@ -281,6 +284,7 @@ UniValue getmininginfo(const JSONRPCRequest& request)
     obj.push_back(Pair("minepowthreads",     gArgs.GetArg("-minepowthreads", DEFAULT_MINING_POW_THREADS)));
     obj.push_back(Pair("minebucketsize",     gArgs.GetArg("-minebucketsize", DEFAULT_MINING_BUCKET_SIZE)));
     obj.push_back(Pair("minebucketthreads",  gArgs.GetArg("-minebucketthreads", DEFAULT_MINING_BUCKET_THREADS)));
+    obj.push_back(Pair("minepipeline",       gArgs.GetBoolArg("-minepipeline", DEFAULT_MINING_PIPELINE)));
     obj.push_back(Pair("errors",             GetWarnings("statusbar")));
     obj.push_back(Pair("networkcyclesps",    getnetworkcyclesps(request)));
     obj.push_back(Pair("graphsps",           g_connman->GetGraphPower()));
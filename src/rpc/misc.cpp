@@ -14,6 +14,7 @@
 #include "rpc/misc.h"
 #include "rpc/server.h"
 #include "timedata.h"
+#include "txdb.h"
 #include "txmempool.h"
 #include "util.h"
 #include "utilstrencodings.h"
@@ -595,6 +596,17 @@ static UniValue RPCLockedMemoryInfo()
     return obj;
 }
 
+static UniValue RPCUnspentCacheInfo()
+{
+    UniValue obj(UniValue::VOBJ);
+    if (pblocktree) {
+        const auto& cache = pblocktree->GetUnspentCache();
+        obj.push_back(Pair("entries", uint64_t(cache.Size())));
+        obj.push_back(Pair("usage", uint64_t(cache.DynamicMemoryUsage())));
+    }
+    return obj;
+}
+
 #ifdef HAVE_MALLOC_INFO
 static std::string RPCMallocInfo()
 {
@@ -636,6 +648,10 @@ UniValue getmemoryinfo(const JSONRPCRequest& request)
             "    \"locked\": xxxxxx,       (numeric) Amount of bytes that succeeded locking. If this number is smaller than total, locking pages failed at some point and key data could be swapped to disk.\n"
             "    \"chunks_used\": xxxxx,   (numeric) Number allocated chunks\n"
             "    \"chunks_free\": xxxxx,   (numeric) Number unused chunks\n"
+            "  },\n"
+            "  \"unspentcache\": {         (json object) Information about the address unspent outputs cache\n"
+            "    \"entries\": xxxxx,       (numeric) Number of cached unspent outputs\n"
+            "    \"usage\": xxxxx,         (numeric) Estimated memory usage of the cache in bytes\n"
             "  }\n"
             "}\n"
             "\nResult (mode \"mallocinfo\"):\n"
@@ -647,6 +663,7 @@ UniValue getmemoryinfo(const JSONRPCRequest& request)
     if (mode == "stats") {
         UniValue obj(UniValue::VOBJ);
         obj.push_back(Pair("locked", RPCLockedMemoryInfo()));
+        obj.push_back(Pair("unspentcache", RPCUnspentCacheInfo()));
         return obj;
     } else if (mode == "mallocinfo") {
 #ifdef HAVE_MALLOC_INFO
@@ -788,6 +805,16 @@ bool getAddressesFromParams(const UniValue& params, std::vector<AddressPair>& ad
     return true;
 }
 
+AddressQueries getAddressQueries(const std::vector<AddressPair>& addresses, bool invite)
+{
+    AddressQueries queries;
+    queries.reserve(addresses.size());
+    for (const auto& address : addresses) {
+        queries.push_back(AddressQuery{address.first, static_cast<unsigned int>(address.second), invite});
+    }
+    return queries;
+}
+
 bool heightSort(std::pair<CAddressUnspentKey, CAddressUnspentValue> a,
     std::pair<CAddressUnspentKey, CAddressUnspentValue> b)
 {
@@ -1107,16 +1134,8 @@ UniValue getaddressdeltas(const JSONRPCRequest& request)
 
     std::vector<std::pair<CAddressIndexKey, CAmount>> addressIndex;
 
-    for (std::vector<AddressPair>::iterator it = addresses.begin(); it != addresses.end(); it++) {
-        if (start > 0 && end > 0) {
-            if (!GetAddressIndex((*it).first, (*it).second, false, addressIndex, start, end)) {
-                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
-            }
-        } else {
-            if (!GetAddressIndex((*it).first, (*it).second, false, addressIndex)) {
-                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
-            }
-        }
+    if (!GetAddressIndex(getAddressQueries(addresses, false), addressIndex, start, end)) {
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
     }
 
     UniValue deltas(UniValue::VARR);
@@ -1228,10 +1247,8 @@ UniValue getaddressbalance(const JSONRPCRequest& request)
         std::map<std::string, CAmount> by_address;
 
         std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue>> unspentOutputs;
-        for (std::vector<AddressPair>::iterator it = addresses.begin(); it != addresses.end(); it++) {
-            if (!GetAddressUnspent((*it).first, (*it).second, request_invites, unspentOutputs)) {
-                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
-            }
+        if (!GetAddressUnspent(getAddressQueries(addresses, request_invites), unspentOutputs)) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
         }
 
         CAmount total_amount = 0;
@@ -1290,22 +1307,37 @@ UniValue getaddressbalance(const JSONRPCRequest& request)
         result.push_back(Pair("byAddress", by_address_val));
 
     } else {
-        std::vector<std::pair<CAddressIndexKey, CAmount>> addressIndex;
+        CAmount balance = 0;
+        CAmount received = 0;
 
-        for (std::vector<AddressPair>::iterator it = addresses.begin(); it != addresses.end(); it++) {
-            if (!GetAddressIndex((*it).first, (*it).second, request_invites, addressIndex)) {
-                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+        // The balance index has the totals, otherwise scan the address index
+        bool indexed = true;
+        for (const auto& address : addresses) {
+            CAddressBalanceValue value;
+            if (!GetAddressBalance(address.first, address.second, request_invites, value)) {
+                indexed = false;
+                break;
             }
+            balance += value.balance;
+            received += value.received;
         }
 
-        CAmount balance = 0;
-        CAmount received = 0;
+        if (!indexed) {
+            balance = 0;
+            received = 0;
 
-        for (std::vector<std::pair<CAddressIndexKey, CAmount>>::const_iterator it = addressIndex.begin(); it != addressIndex.end(); it++) {
-            if (it->second > 0) {
-                received += it->second;
+            std::vector<std::pair<CAddressIndexKey, CAmount>> addressIndex;
+
+            if (!GetAddressIndex(getAddressQueries(addresses, request_invites), addressIndex)) {
+                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+            }
+
+            for (std::vector<std::pair<CAddressIndexKey, CAmount>>::const_iterator it = addressIndex.begin(); it != addressIndex.end(); it++) {
+                if (it->second > 0) {
+                    received += it->second;
+                }
+                balance += it->second;
             }
-            balance += it->second;
         }
 
         result.push_back(Pair("balance", balance));
@@ -1400,29 +1432,21 @@ UniValue getaddressrank(const JSONRPCRequest& request)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid or unconfirmed addresses were passed");
     }
 
-    LOCK(cs_main);
-
     const auto params = Params().GetConsensus();
 
-    pog3::Entrants all_entrants;
-    pog3::CGSContext context;
-    context.cgs_pool = pog3::GetCgsThreadPool();
-
-    pog3::GetAllRewardableEntrants(context, *prefviewcache, params, chainActive.Height(), all_entrants);
+    auto snapshot = GetCGSSnapshot(params);
+    if (!snapshot) {
+        return RankComputationsNotReady();
+    }
 
     std::vector<CAmount> cgs;
+    cgs.reserve(validAddresses.size());
     for (const auto& a : validAddresses) {
-     const auto& e = context.GetEntrant(a.first);
-     auto node = pog3::ComputeCGS(context, e, *prefviewcache);
-     cgs.push_back(node.cgs);
+        cgs.push_back(GetSnapshotCGS(*snapshot, a.first));
     }
 
-    CAmount lottery_cgs = 0;
-    auto cgs_ranks = CGSRanks(
-            cgs,
-            chainActive.Height(),
-            Params().GetConsensus(),
-            lottery_cgs);
+    const CAmount lottery_cgs = snapshot->lottery_cgs;
+    auto cgs_ranks = CGSRanks(*snapshot, cgs);
 
     //Hack to keep ANVRanks  (2nlog(n)) vs (nlogn + n) we rewrite the address
     //because among addresses of equal rank, ANVRAnks may return an entry with a different address.
@@ -1469,13 +1493,13 @@ UniValue getaddressleaderboard(const JSONRPCRequest& request)
         total = std::max(1, request.params[0].get_int());
     }
 
-    LOCK(cs_main);
-    CAmount lottery_cgs = 0;
-    auto cgs_ranks = TopCGSRanks(
-            total,
-            chainActive.Height(),
-            Params().GetConsensus(),
-            lottery_cgs);
+    const auto snapshot = GetCGSSnapshot(Params().GetConsensus());
+    if (!snapshot) {
+        return RankComputationsNotReady();
+    }
+
+    const CAmount lottery_cgs = snapshot->lottery_cgs;
+    auto cgs_ranks = TopCGSRanks(*snapshot, total);
 
     UniValue result(UniValue::VOBJ);
     UniValue cgs_rankarr = RanksToUniValue(lottery_cgs, cgs_ranks.first, cgs_ranks.second, true);
@@ -1516,7 +1540,10 @@ UniValue simulatelottery(const JSONRPCRequest& request)
             "   ]\n"
             "}\n"
             "\nExamples:\n" +
-            HelpExampleCli("simulatelottery", "4") + HelpExampleRpc("getaddressleaderboard", "100"));
+            HelpExampleCli("simulatelottery", "4") + HelpExampleRpc("simulatelottery", "4"));
+
+    // The lottery reads the chain and the CGS state which change with the tip
+    LOCK(cs_main);
 
     auto seed = chainActive.Tip()->GetBlockHash();
     auto height = chainActive.Tip()->nHeight;
@@ -1548,7 +1575,16 @@ UniValue simulatelottery(const JSONRPCRequest& request)
     const auto subsidy = GetSplitSubsidy(params.pog3_blockheight, params);
     const bool FORCE_POG3 = true;
 
-    auto rewards = Pog3RewardAmbassadors(
+    // The entrants of the tip are already computed in the CGS snapshot.
+    const auto snapshot = GetCGSSnapshot(params);
+    auto rewards = snapshot && snapshot->height == height ?
+        Pog3RewardAmbassadors(
+            height,
+            seed,
+            subsidy.ambassador,
+            params,
+            snapshot->entrants) :
+        Pog3RewardAmbassadors(
             height,
             seed,
             subsidy.ambassador,
@@ -1679,18 +1715,12 @@ UniValue getaddresstxids(const JSONRPCRequest& request)
 
     std::vector<std::pair<CAddressIndexKey, CAmount>> addressIndex;
 
-    for (const auto& it : addresses) {
-        if (start > 0) {
-            if (!GetAddressIndex(it.first, it.second, true, addressIndex, start, end) ||
-                !GetAddressIndex(it.first, it.second, false, addressIndex, start, end)) {
-                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
-            }
-        } else {
-            if (!GetAddressIndex(it.first, it.second, true, addressIndex) ||
-                !GetAddressIndex(it.first, it.second, false, addressIndex)) {
-                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
-            }
-        }
+    auto queries = getAddressQueries(addresses, true);
+    const auto txs = getAddressQueries(addresses, false);
+    queries.insert(queries.end(), txs.begin(), txs.end());
+
+    if (!GetAddressIndex(queries, addressIndex, start, end)) {
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
     }
 
     for (const auto& it : addressIndex) {
@@ -2032,8 +2062,11 @@ UniValue getaddresshistory(const JSONRPCRequest& request)
 
     std::vector<std::pair<CAddressIndexKey, CAmount>> addressIndex;
 
-    if (!GetAddressIndex(addressPair.first, addressPair.second, true, addressIndex, start, end) ||
-        !GetAddressIndex(addressPair.first, addressPair.second, false, addressIndex, start, end)) {
+    const AddressQueries queries = {
+        {addressPair.first, static_cast<unsigned int>(addressPair.second), true},
+        {addressPair.first, static_cast<unsigned int>(addressPair.second), false},
+    };
+    if (!GetAddressIndex(queries, addressIndex, start, end)) {
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
     }
 
@@ -2088,7 +2121,6 @@ UniValue getaddressreferrals(const JSONRPCRequest& request)
 
     for (const auto& address : addresses) {
         const auto referral = prefviewcache->GetReferral(address.first);
-        const auto children = prefviewdb->GetChildren(address.first);
 
         if (!referral) {
             continue;
@@ -2099,8 +2131,8 @@ UniValue getaddressreferrals(const JSONRPCRequest& request)
         item.push_back(Pair("raw", EncodeHexRef(*referral)));
         result.push_back(item);
 
-        for (const auto& child_address : children) {
-            const auto child_referral = prefviewcache->GetReferral(child_address);
+        for (auto it = prefviewdb->IterateChildren(address.first); it->Valid(); it->Next()) {
+            const auto child_referral = prefviewcache->GetReferral(it->GetAddress());
 
             if (child_referral) {
                 UniValue item(UniValue::VOBJ);
@@ -0,0 +1,128 @@
+// Copyright (c) 2018 The Merit Foundation developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "addressindex.h"
+#include "clientversion.h"
+#include "streams.h"
+#include "txdb.h"
+#include "validation.h"
+#include "test/test_merit.h"
+
+#include <boost/test/unit_test.hpp>
+
+namespace
+{
+    using AddressIndex = std::vector<std::pair<CAddressIndexKey, CAmount>>;
+
+    uint160 RandomAddress()
+    {
+        const auto hash = InsecureRand256();
+        return uint160{std::vector<unsigned char>(hash.begin(), hash.begin() + 20)};
+    }
+
+    /** Rows of the address at the height, several at some heights */
+    void AddRows(AddressIndex& rows, const AddressQuery& q, int height)
+    {
+        const int count = height % 1000 <= 1 ? 3 : 1 + InsecureRandRange(2);
+        for (int i = 0; i < count; i++) {
+            rows.emplace_back(
+                    CAddressIndexKey{
+                        q.type,
+                        q.addressHash,
+                        height,
+                        i,
+                        InsecureRand256(),
+                        InsecureRandRange(4),
+                        InsecureRandBool(),
+                        q.invite},
+                    InsecureRandRange(1000) + 1);
+        }
+    }
+
+    /** The rows of the queries scanned one after the other */
+    AddressIndex Sequential(const AddressQueries& queries, int start, int end)
+    {
+        AddressIndex rows;
+        for (const auto& q : queries) {
+            BOOST_REQUIRE(pblocktree->ReadAddressIndex(q.addressHash, q.type, q.invite, rows, start, end));
+        }
+        return rows;
+    }
+
+    std::string Serialized(const AddressIndex& rows)
+    {
+        CDataStream stream(SER_DISK, CLIENT_VERSION);
+        for (const auto& r : rows) {
+            stream << r.first << r.second;
+        }
+        return stream.str();
+    }
+}
+
+BOOST_FIXTURE_TEST_SUITE(addressindex_tests, TestingSetup)
+
+BOOST_AUTO_TEST_CASE(batched_scan_matches_sequential_scan)
+{
+    const AddressQuery a{RandomAddress(), 1, false};
+    const AddressQuery a_invites{a.addressHash, 1, true};
+    const AddressQuery b{RandomAddress(), 2, false};
+    const AddressQuery missing{RandomAddress(), 1, false};
+
+    //A row at every height, and more at the heights split ranges start
+    //and end at, for a. Fewer rows for the others.
+    AddressIndex rows;
+    for (int height = 1; height <= 6000; height++) {
+        AddRows(rows, a, height);
+        if (height % 7 == 0) {
+            AddRows(rows, a_invites, height);
+        }
+        if (height % 500 <= 1) {
+            AddRows(rows, b, height);
+        }
+    }
+    BOOST_REQUIRE(pblocktree->WriteAddressIndex(rows));
+
+    const std::vector<AddressQueries> batches = {
+        {a},
+        {a_invites, a},
+        {a, b},
+        {b, missing, a, a_invites},
+        {missing},
+    };
+
+    //Ranges which split into several jobs, an end without a start and
+    //open ends, which are not split since the chain has no blocks.
+    const std::vector<std::pair<int, int>> ranges = {
+        {1, 5000},
+        {0, 4000},
+        {1234, 4321},
+        {2000, 2000},
+        {1, 999},
+        {0, 0},
+        {3000, 0},
+    };
+
+    for (const size_t threads : {0, 1, 4, 16}) {
+        SetupAddressIndexThreadPool(threads);
+        for (const auto& queries : batches) {
+            for (const auto& range : ranges) {
+                const auto expected = Sequential(queries, range.first, range.second);
+
+                AddressIndex batched;
+                BOOST_REQUIRE(GetAddressIndex(queries, batched, range.first, range.second));
+                BOOST_CHECK_EQUAL(batched.size(), expected.size());
+                BOOST_CHECK(Serialized(batched) == Serialized(expected));
+            }
+        }
+    }
+    SetupAddressIndexThreadPool(0);
+
+    //The end height holds without a start height.
+    const auto to_end = Sequential({a}, 0, 4000);
+    BOOST_REQUIRE(!to_end.empty());
+    BOOST_CHECK_EQUAL(to_end.front().first.blockHeight, 1);
+    BOOST_CHECK_EQUAL(to_end.back().first.blockHeight, 4000);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
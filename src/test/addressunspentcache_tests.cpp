@@ -0,0 +1,330 @@
+// Copyright (c) 2018 The Merit Foundation developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "addressunspentcache.h"
+#include "clientversion.h"
+#include "streams.h"
+#include "txdb.h"
+#include "validation.h"
+#include "test/test_merit.h"
+
+#include <algorithm>
+#include <limits>
+#include <map>
+
+#include <boost/test/unit_test.hpp>
+
+namespace
+{
+    UnspentPair RandomUnspent()
+    {
+        const auto address = InsecureRand256();
+        const CAddressUnspentKey key{
+            1,
+            uint160{std::vector<unsigned char>(address.begin(), address.begin() + 20)},
+            InsecureRand256(),
+            InsecureRandRange(4),
+            false,
+            false};
+        const CAddressUnspentValue value{
+            static_cast<CAmount>(InsecureRandRange(1000) + 1),
+            CScript() << OP_TRUE,
+            static_cast<int>(InsecureRandRange(100))};
+        return {key, value};
+    }
+
+    /** The outputs of a snapshot serialized in scan order */
+    std::string Serialized(const CAddressUnspentCache::Snapshot& snapshot)
+    {
+        CDataStream stream(SER_DISK, CLIENT_VERSION);
+        for (const auto& entries : snapshot) {
+            for (const auto& e : *entries) {
+                stream << e.first << e.second;
+            }
+        }
+        return stream.str();
+    }
+
+    /** The outputs of a snapshot serialized in key order */
+    std::string Sorted(const CAddressUnspentCache::Snapshot& snapshot)
+    {
+        std::vector<UnspentPair> sorted;
+        for (const auto& entries : snapshot) {
+            sorted.insert(sorted.end(), entries->begin(), entries->end());
+        }
+        std::sort(sorted.begin(), sorted.end(), [](const UnspentPair& a, const UnspentPair& b) {
+            return a.first < b.first;
+        });
+
+        CDataStream stream(SER_DISK, CLIENT_VERSION);
+        for (const auto& e : sorted) {
+            stream << e.first << e.second;
+        }
+        return stream.str();
+    }
+
+    using UnspentMap = std::map<CAddressUnspentKey, CAddressUnspentValue>;
+
+    /** The outputs of a model of the cache serialized in key order */
+    std::string Sorted(const UnspentMap& unspent)
+    {
+        CDataStream stream(SER_DISK, CLIENT_VERSION);
+        for (const auto& e : unspent) {
+            stream << e.first << e.second;
+        }
+        return stream.str();
+    }
+
+    /** Another output of the address of key */
+    CAddressUnspentKey SameAddress(const CAddressUnspentKey& key)
+    {
+        auto other = key;
+        other.txhash = InsecureRand256();
+        return other;
+    }
+
+    /** Overwrites the 64 bit field at offset of the file */
+    void OverwriteField(const fs::path& path, long offset, uint64_t value)
+    {
+        FILE* file = fsbridge::fopen(path, "r+b");
+        BOOST_REQUIRE(file);
+        BOOST_REQUIRE_EQUAL(fseek(file, offset, SEEK_SET), 0);
+        BOOST_REQUIRE_EQUAL(fwrite(&value, sizeof(value), 1, file), 1u);
+        fclose(file);
+    }
+
+    //Offsets of the output count and blob size of the first shard
+    const long FIRST_COUNT_OFFSET = 4 + 4 + 32 + 4;
+    const long FIRST_SIZE_OFFSET = FIRST_COUNT_OFFSET + 8;
+}
+
+BOOST_FIXTURE_TEST_SUITE(addressunspentcache_tests, TestingSetup)
+
+BOOST_AUTO_TEST_CASE(add_and_erase)
+{
+    CAddressUnspentCache cache;
+    UnspentMap model;
+
+    //Outputs of one address share a shard so erasing one moves another.
+    const auto first = RandomUnspent();
+    std::vector<CAddressUnspentKey> keys{first.first};
+    for (int i = 0; i < 4; i++) {
+        keys.push_back(SameAddress(first.first));
+    }
+    for (const auto& key : keys) {
+        cache.Add(key, first.second);
+        model[key] = first.second;
+    }
+
+    //The last output took the place of the first and is still found by key.
+    cache.Erase(keys[0]);
+    model.erase(keys[0]);
+    BOOST_CHECK(Sorted(cache.GetSnapshot()) == Sorted(model));
+
+    const auto replaced = RandomUnspent().second;
+    cache.Add(keys[4], replaced);
+    model[keys[4]] = replaced;
+    BOOST_CHECK(Sorted(cache.GetSnapshot()) == Sorted(model));
+
+    cache.Erase(keys[4]);
+    model.erase(keys[4]);
+    cache.Erase(keys[1]);
+    model.erase(keys[1]);
+    BOOST_CHECK(Sorted(cache.GetSnapshot()) == Sorted(model));
+    BOOST_CHECK_EQUAL(cache.Size(), model.size());
+
+    //Erasing a missing output changes nothing.
+    cache.Erase(keys[0]);
+    cache.Erase(RandomUnspent().first);
+    BOOST_CHECK(Sorted(cache.GetSnapshot()) == Sorted(model));
+    BOOST_CHECK_EQUAL(cache.Size(), model.size());
+
+    //Random adds, replacements and erasures keep matching the model.
+    std::vector<CAddressUnspentKey> added(keys.begin(), keys.end());
+    for (int i = 0; i < 5000; i++) {
+        const auto action = InsecureRandRange(4);
+        if (action == 0 && !added.empty()) {
+            const auto& key = added[InsecureRandRange(added.size())];
+            cache.Erase(key);
+            model.erase(key);
+        } else if (action == 1 && !added.empty()) {
+            const auto key = added[InsecureRandRange(added.size())];
+            const auto value = RandomUnspent().second;
+            cache.Add(key, value);
+            model[key] = value;
+        } else {
+            const auto e = RandomUnspent();
+            const auto key = !added.empty() && InsecureRandBool() ?
+                SameAddress(added[InsecureRandRange(added.size())]) : e.first;
+            cache.Add(key, e.second);
+            model[key] = e.second;
+            added.push_back(key);
+        }
+    }
+    BOOST_CHECK_EQUAL(cache.Size(), model.size());
+    BOOST_CHECK(Sorted(cache.GetSnapshot()) == Sorted(model));
+
+    //All outputs of an address are in one shard.
+    std::map<uint160, size_t> shard_of;
+    const auto snapshot = cache.GetSnapshot();
+    BOOST_REQUIRE(snapshot.size() == CAddressUnspentCache::SHARDS);
+    for (size_t shard = 0; shard < snapshot.size(); shard++) {
+        for (const auto& e : *snapshot[shard]) {
+            const auto it = shard_of.emplace(e.first.hashBytes, shard).first;
+            BOOST_CHECK_EQUAL(it->second, shard);
+        }
+    }
+
+    cache.Clear();
+    BOOST_CHECK_EQUAL(cache.Size(), 0u);
+    BOOST_CHECK(Sorted(cache.GetSnapshot()).empty());
+}
+
+BOOST_AUTO_TEST_CASE(snapshot_isolation)
+{
+    CAddressUnspentCache cache;
+    UnspentMap model;
+    std::vector<CAddressUnspentKey> keys;
+    for (int i = 0; i < 1000; i++) {
+        const auto e = RandomUnspent();
+        cache.Add(e.first, e.second);
+        model[e.first] = e.second;
+        keys.push_back(e.first);
+    }
+
+    const auto before = cache.GetSnapshot();
+    const auto before_scan = Serialized(before);
+    BOOST_CHECK(Sorted(before) == Sorted(model));
+
+    //Changing the cache copies the shards the snapshot holds.
+    for (size_t i = 0; i < keys.size(); i += 3) {
+        cache.Erase(keys[i]);
+        model.erase(keys[i]);
+    }
+    for (size_t i = 1; i < keys.size(); i += 3) {
+        const auto value = RandomUnspent().second;
+        cache.Add(keys[i], value);
+        model[keys[i]] = value;
+    }
+    for (int i = 0; i < 100; i++) {
+        const auto e = RandomUnspent();
+        cache.Add(e.first, e.second);
+        model[e.first] = e.second;
+    }
+
+    BOOST_CHECK(Serialized(before) == before_scan);
+    const auto after = cache.GetSnapshot();
+    BOOST_CHECK(Sorted(after) == Sorted(model));
+
+    //Neither snapshot changes once the cache is cleared or reloaded.
+    const auto after_scan = Serialized(after);
+    cache.Clear();
+    BOOST_CHECK(Serialized(before) == before_scan);
+    BOOST_CHECK(Serialized(after) == after_scan);
+
+    std::vector<CAddressUnspentCache::Entries> shards;
+    for (const auto& entries : before) {
+        shards.push_back(*entries);
+    }
+    BOOST_REQUIRE(cache.Load(std::move(shards)));
+    BOOST_CHECK(Serialized(cache.GetSnapshot()) == before_scan);
+
+    cache.Erase(keys[0]);
+    BOOST_CHECK(Serialized(before) == before_scan);
+    BOOST_CHECK(Serialized(after) == after_scan);
+}
+
+BOOST_AUTO_TEST_CASE(snapshot_round_trip)
+{
+    CAddressUnspentCache cache;
+    for (int i = 0; i < 1000; i++) {
+        const auto e = RandomUnspent();
+        cache.Add(e.first, e.second);
+    }
+
+    const auto path = pathTemp / "unspent.dat";
+    const auto block = InsecureRand256();
+    BOOST_REQUIRE(WriteUnspentSnapshot(path, block, cache.GetSnapshot()));
+
+    CAddressUnspentCache loaded;
+    BOOST_CHECK(ReadUnspentSnapshot(path, block, loaded));
+    BOOST_CHECK_EQUAL(loaded.Size(), cache.Size());
+    BOOST_CHECK(Serialized(loaded.GetSnapshot()) == Serialized(cache.GetSnapshot()));
+
+    //A snapshot of another block is not used.
+    BOOST_CHECK(!ReadUnspentSnapshot(path, InsecureRand256(), loaded));
+    BOOST_CHECK_EQUAL(loaded.Size(), 0u);
+
+    //Nor is a missing file.
+    BOOST_CHECK(!ReadUnspentSnapshot(pathTemp / "missing.dat", block, loaded));
+    BOOST_CHECK_EQUAL(loaded.Size(), 0u);
+}
+
+BOOST_AUTO_TEST_CASE(snapshot_corrupt)
+{
+    CAddressUnspentCache cache;
+    for (int i = 0; i < 100; i++) {
+        const auto e = RandomUnspent();
+        cache.Add(e.first, e.second);
+    }
+
+    const auto path = pathTemp / "unspent.dat";
+    const auto block = InsecureRand256();
+    CAddressUnspentCache loaded;
+
+    //Sizes larger than the file are rejected before anything is allocated.
+    BOOST_REQUIRE(WriteUnspentSnapshot(path, block, cache.GetSnapshot()));
+    OverwriteField(path, FIRST_SIZE_OFFSET, std::numeric_limits<uint64_t>::max());
+    BOOST_CHECK(!ReadUnspentSnapshot(path, block, loaded));
+    BOOST_CHECK_EQUAL(loaded.Size(), 0u);
+
+    //So are counts of more outputs than fit in the shard.
+    BOOST_REQUIRE(WriteUnspentSnapshot(path, block, cache.GetSnapshot()));
+    OverwriteField(path, FIRST_COUNT_OFFSET, std::numeric_limits<uint64_t>::max());
+    BOOST_CHECK(!ReadUnspentSnapshot(path, block, loaded));
+    BOOST_CHECK_EQUAL(loaded.Size(), 0u);
+
+    //Any other change fails the checksum.
+    BOOST_REQUIRE(WriteUnspentSnapshot(path, block, cache.GetSnapshot()));
+    const auto size = fs::file_size(path);
+    {
+        FILE* file = fsbridge::fopen(path, "r+b");
+        BOOST_REQUIRE(file);
+        BOOST_REQUIRE_EQUAL(fseek(file, size / 2, SEEK_SET), 0);
+        const int c = fgetc(file);
+        BOOST_REQUIRE_EQUAL(fseek(file, size / 2, SEEK_SET), 0);
+        fputc(c ^ 0xff, file);
+        fclose(file);
+    }
+    BOOST_CHECK(!ReadUnspentSnapshot(path, block, loaded));
+    BOOST_CHECK_EQUAL(loaded.Size(), 0u);
+
+    //And so does a truncated file.
+    BOOST_REQUIRE(WriteUnspentSnapshot(path, block, cache.GetSnapshot()));
+    fs::resize_file(path, size - 1);
+    BOOST_CHECK(!ReadUnspentSnapshot(path, block, loaded));
+    BOOST_CHECK_EQUAL(loaded.Size(), 0u);
+}
+
+BOOST_AUTO_TEST_CASE(corrupt_snapshot_falls_back_to_the_index)
+{
+    std::vector<UnspentPair> unspent;
+    for (int i = 0; i < 100; i++) {
+        unspent.push_back(RandomUnspent());
+    }
+    BOOST_REQUIRE(pblocktree->UpdateAddressUnspentIndex(unspent));
+
+    const auto path = GetDataDir() / UNSPENT_SNAPSHOT_FILENAME;
+    const auto block = InsecureRand256();
+    const auto expected = Sorted(pblocktree->GetUnspentCache().GetSnapshot());
+    BOOST_REQUIRE(WriteUnspentSnapshot(path, block, pblocktree->GetUnspentCache().GetSnapshot()));
+    OverwriteField(path, FIRST_SIZE_OFFSET, std::numeric_limits<uint64_t>::max());
+
+    //The cache is rebuilt from the address unspent index instead.
+    BOOST_CHECK(pblocktree->CacheAllUnspent(block));
+    BOOST_CHECK_EQUAL(pblocktree->GetUnspentCache().Size(), unspent.size());
+    BOOST_CHECK(Sorted(pblocktree->GetUnspentCache().GetSnapshot()) == expected);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
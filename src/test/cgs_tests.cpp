@@ -0,0 +1,349 @@
+// Copyright (c) 2018 The Merit Foundation developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "key.h"
+#include "pog2/cgs.h"
+#include "pog3/cgs.h"
+#include "primitives/referral.h"
+#include "refdb.h"
+#include "referrals.h"
+#include "txdb.h"
+#include "validation.h"
+#include "test/test_merit.h"
+
+#include <boost/test/unit_test.hpp>
+
+namespace
+{
+    struct CGSTestingSetup : public BasicTestingSetup
+    {
+        CGSTestingSetup() : BasicTestingSetup(CBaseChainParams::REGTEST)
+        {
+            pblocktree = new CBlockTreeDB(1 << 20, true);
+            prefviewdb = new referral::ReferralsViewDB{0, true, true, "testcgs"};
+            prefviewcache = new referral::ReferralsViewCache{prefviewdb};
+            pog3::SetupCgsThreadPool(2);
+        }
+
+        ~CGSTestingSetup()
+        {
+            delete prefviewcache;
+            delete prefviewdb;
+            delete pblocktree;
+            prefviewcache = nullptr;
+            prefviewdb = nullptr;
+            pblocktree = nullptr;
+        }
+    };
+
+    referral::ReferralRef NewReferral(const referral::Address& parent)
+    {
+        CKey key;
+        key.MakeNewKey(true);
+        const auto pubkey = key.GetPubKey();
+        return referral::MakeReferralRef(
+                referral::MutableReferral{1, pubkey.GetID(), pubkey, parent});
+    }
+
+    pog3::UnspentUpdate NewCoin(
+            const referral::Address& address,
+            CAmount amount,
+            int height)
+    {
+        return {
+            CAddressUnspentKey{1, address, GetRandHash(), 0, false, false},
+            CAddressUnspentValue{amount, CScript{}, height}};
+    }
+
+    pog3::UnspentUpdate Spent(const pog3::UnspentUpdate& coin)
+    {
+        return {coin.first, CAddressUnspentValue{}};
+    }
+
+    void ApplyUnspent(const pog3::UnspentUpdates& updates)
+    {
+        BOOST_REQUIRE(pblocktree->UpdateAddressUnspentIndex(updates));
+    }
+
+    /**
+     * The incrementally maintained state must produce exactly what a full
+     * walk of the referral DB and the address unspent index produces.
+     */
+    void CheckMatchesDB(const pog3::CGSState& state, int height)
+    {
+        const auto& params = Params().GetConsensus();
+
+        pog3::CGSContext full;
+        pog3::CGSContext incremental;
+        full.cgs_pool = pog3::GetCgsThreadPool();
+        incremental.cgs_pool = pog3::GetCgsThreadPool();
+
+        pog3::Entrants full_entrants;
+        pog3::Entrants incremental_entrants;
+        pog3::GetAllRewardableEntrants(
+                full, *prefviewcache, params, height, full_entrants);
+        pog3::GetAllRewardableEntrants(
+                incremental, state, *prefviewcache, params, height, incremental_entrants);
+
+        BOOST_REQUIRE_EQUAL(full.entrants.size(), incremental.entrants.size());
+        for (size_t i = 0; i < full.entrants.size(); i++) {
+            const auto& a = full.entrants[i];
+            const auto& b = incremental.entrants[i];
+            BOOST_CHECK(a.address == b.address);
+            BOOST_CHECK_EQUAL(a.height, b.height);
+            BOOST_CHECK_EQUAL(a.children_end - a.children_begin,
+                    b.children_end - b.children_begin);
+        }
+        BOOST_CHECK(full.children == incremental.children);
+
+        BOOST_REQUIRE_EQUAL(full_entrants.size(), incremental_entrants.size());
+        for (size_t i = 0; i < full_entrants.size(); i++) {
+            const auto& a = full_entrants[i];
+            const auto& b = incremental_entrants[i];
+            BOOST_CHECK(a.address == b.address);
+            BOOST_CHECK_EQUAL(a.balance, b.balance);
+            BOOST_CHECK_EQUAL(a.aged_balance, b.aged_balance);
+            BOOST_CHECK_EQUAL(a.cgs, b.cgs);
+            BOOST_CHECK_EQUAL(a.beacon_height, b.beacon_height);
+            BOOST_CHECK_EQUAL(a.children, b.children);
+            BOOST_CHECK_EQUAL(a.network_size, b.network_size);
+        }
+    }
+
+    struct TestBlock
+    {
+        uint256 hash;
+        int height;
+        referral::ReferralRefs referrals;
+        pog3::UnspentUpdates connect;
+        pog3::UnspentUpdates disconnect;
+    };
+
+    /** Connects the block to the DBs and the state the way validation does */
+    void ConnectTestBlock(
+            pog3::CGSState& state,
+            const uint256& prev_hash,
+            const TestBlock& block)
+    {
+        auto ordered = block.referrals;
+        BOOST_REQUIRE(prefviewdb->OrderReferrals(ordered));
+        for (const auto& ref : ordered) {
+            BOOST_REQUIRE(prefviewdb->InsertReferral(block.height, *ref, false, false));
+        }
+        ApplyUnspent(block.connect);
+
+        state.ConnectBlock(prev_hash, block.hash, block.height, ordered, block.connect);
+        BOOST_CHECK(state.IsSynced(block.hash));
+        CheckMatchesDB(state, block.height);
+    }
+
+    /** Disconnects the block from the DBs and the state the way validation does */
+    void DisconnectTestBlock(
+            pog3::CGSState& state,
+            const TestBlock& block,
+            const uint256& prev_hash,
+            int prev_height)
+    {
+        for (const auto& ref : block.referrals) {
+            BOOST_REQUIRE(prefviewcache->RemoveReferral(*ref));
+        }
+        ApplyUnspent(block.disconnect);
+
+        state.DisconnectBlock(block.hash, prev_hash, block.referrals, block.disconnect);
+
+        //The state must be reverted in place instead of being thrown away.
+        BOOST_CHECK(state.IsSynced(prev_hash));
+        CheckMatchesDB(state, prev_height);
+    }
+
+    /**
+     * Inserts a random tree under the genesis address with coins on both
+     * sides of the minimum stake, up to the given height.
+     */
+    void InsertRandomTree(size_t size, int height)
+    {
+        const auto& params = Params().GetConsensus();
+
+        CKey root_key;
+        root_key.MakeNewKey(true);
+        const auto root = referral::MakeReferralRef(referral::MutableReferral{
+                1, params.genesis_address, root_key.GetPubKey(), referral::Address{}});
+        BOOST_REQUIRE(prefviewdb->InsertReferral(0, *root, true, false));
+
+        std::vector<referral::Address> addresses{root->GetAddress()};
+        pog3::UnspentUpdates coins{NewCoin(root->GetAddress(), 100 * COIN, 0)};
+        for (size_t i = 0; i < size; i++) {
+            const auto parent = addresses[InsecureRandRange(addresses.size())];
+            const auto ref = NewReferral(parent);
+            const int beacon_height = InsecureRandRange(height);
+            BOOST_REQUIRE(prefviewdb->InsertReferral(beacon_height, *ref, false, false));
+            addresses.push_back(ref->GetAddress());
+
+            for (int c = InsecureRandRange(3); c > 0; c--) {
+                coins.push_back(NewCoin(
+                            ref->GetAddress(),
+                            (InsecureRandRange(30) + 1) * COIN,
+                            beacon_height + InsecureRandRange(height - beacon_height)));
+            }
+        }
+        ApplyUnspent(coins);
+    }
+}
+
+BOOST_FIXTURE_TEST_SUITE(cgs_tests, CGSTestingSetup)
+
+BOOST_AUTO_TEST_CASE(state_matches_db_across_connect_and_disconnect)
+{
+    const auto& params = Params().GetConsensus();
+
+    //Tree as of block A.
+    CKey root_key;
+    root_key.MakeNewKey(true);
+    const auto root = referral::MakeReferralRef(referral::MutableReferral{
+            1, params.genesis_address, root_key.GetPubKey(), referral::Address{}});
+    const auto r1 = NewReferral(root->GetAddress());
+    const auto r2 = NewReferral(root->GetAddress());
+    const auto r3 = NewReferral(r1->GetAddress());
+
+    BOOST_REQUIRE(prefviewdb->InsertReferral(0, *root, true, false));
+    BOOST_REQUIRE(prefviewdb->InsertReferral(20, *r1, false, false));
+    BOOST_REQUIRE(prefviewdb->InsertReferral(30, *r2, false, false));
+    BOOST_REQUIRE(prefviewdb->InsertReferral(50, *r3, false, false));
+
+    const auto r1_coin = NewCoin(r1->GetAddress(), 20 * COIN, 20);
+    ApplyUnspent({
+        NewCoin(root->GetAddress(), 100 * COIN, 0),
+        r1_coin,
+        NewCoin(r1->GetAddress(), 5 * COIN, 40),
+        NewCoin(r2->GetAddress(), 7 * COIN, 30),
+        NewCoin(r3->GetAddress(), 3 * COIN, 50)});
+
+    const auto hash_a = GetRandHash();
+    const int height_a = 100;
+
+    pog3::CGSState state;
+    BOOST_REQUIRE(state.Rebuild(*prefviewcache, params, hash_a));
+    BOOST_CHECK(state.IsSynced(hash_a));
+    CheckMatchesDB(state, height_a);
+
+    //Block B lists the parent b1 before its child b2 as blocks usually do.
+    const auto b1 = NewReferral(r2->GetAddress());
+    const auto b2 = NewReferral(b1->GetAddress());
+    const auto b3 = NewReferral(r3->GetAddress());
+    const auto b1_coin = NewCoin(b1->GetAddress(), 4 * COIN, height_a + 1);
+    const auto b2_coin = NewCoin(b2->GetAddress(), 2 * COIN, height_a + 1);
+    const TestBlock block_b{
+        GetRandHash(),
+        height_a + 1,
+        {b1, b2, b3},
+        {b1_coin, b2_coin, Spent(r1_coin)},
+        {Spent(b1_coin), Spent(b2_coin), r1_coin}};
+
+    //Block C lists the child c2 before its parent c1.
+    const auto c1 = NewReferral(b3->GetAddress());
+    const auto c2 = NewReferral(c1->GetAddress());
+    const auto c1_coin = NewCoin(c1->GetAddress(), 6 * COIN, height_a + 2);
+    const TestBlock block_c{
+        GetRandHash(),
+        height_a + 2,
+        {c2, c1},
+        {c1_coin},
+        {Spent(c1_coin)}};
+
+    ConnectTestBlock(state, hash_a, block_b);
+    ConnectTestBlock(state, block_b.hash, block_c);
+
+    DisconnectTestBlock(state, block_c, block_b.hash, block_b.height);
+    DisconnectTestBlock(state, block_b, hash_a, height_a);
+
+    //And the blocks can be connected again on top of the reverted state.
+    ConnectTestBlock(state, hash_a, block_b);
+    ConnectTestBlock(state, block_b.hash, block_c);
+}
+
+/** Scores cached up front give the same entrants as scoring on every use */
+BOOST_AUTO_TEST_CASE(pog2_cached_scores_match_uncached)
+{
+    const auto& params = Params().GetConsensus();
+    const int height = 1000;
+    InsertRandomTree(200, height);
+
+    pog2::CGSContext context;
+    context.cgs_pool = pog3::GetCgsThreadPool();
+    pog2::Entrants entrants;
+    pog2::GetAllRewardableEntrants(context, *prefviewcache, params, height, entrants);
+    BOOST_REQUIRE(!entrants.empty());
+
+    pog2::CGSContext uncached = context;
+    uncached.subtree_contribution.clear();
+    for (auto& e : uncached.entrants) {
+        e.scored = false;
+    }
+
+    const auto minimum_stake = pog2::GetAmbassadorMinumumStake(height, params);
+    size_t n = 0;
+    for (size_t i = 1; i < uncached.entrants.size(); i++) {
+        const auto& e = uncached.entrants[i];
+        if (e.balances.second < minimum_stake) {
+            continue;
+        }
+        BOOST_REQUIRE(n < entrants.size());
+        BOOST_CHECK(context.entrants[i].scored);
+
+        const auto expected = pog2::ComputeCGS(uncached, e, *prefviewcache);
+        const auto& actual = entrants[n++];
+        BOOST_CHECK(actual.address == expected.address);
+        BOOST_CHECK_EQUAL(actual.balance, expected.balance);
+        BOOST_CHECK_EQUAL(actual.aged_balance, expected.aged_balance);
+        BOOST_CHECK_EQUAL(actual.cgs, expected.cgs);
+        BOOST_CHECK_EQUAL(actual.sub_cgs, expected.sub_cgs);
+        BOOST_CHECK_EQUAL(actual.children, expected.children);
+        BOOST_CHECK_EQUAL(actual.network_size, expected.network_size);
+    }
+    BOOST_CHECK_EQUAL(n, entrants.size());
+}
+
+/** Scores cached up front give the same entrants as scoring on every use */
+BOOST_AUTO_TEST_CASE(pog3_cached_scores_match_uncached)
+{
+    const auto& params = Params().GetConsensus();
+    const int height = 1000;
+    InsertRandomTree(200, height);
+
+    pog3::CGSContext context;
+    context.cgs_pool = pog3::GetCgsThreadPool();
+    pog3::Entrants entrants;
+    pog3::GetAllRewardableEntrants(context, *prefviewcache, params, height, entrants);
+    BOOST_REQUIRE(!entrants.empty());
+
+    pog3::CGSContext uncached = context;
+    uncached.has_subtree_contribution.assign(uncached.entrants.size(), false);
+    for (auto& e : uncached.entrants) {
+        e.scored = false;
+    }
+
+    const auto minimum_stake = pog3::GetAmbassadorMinumumStake(height, params);
+    size_t n = 0;
+    for (size_t i = 1; i < uncached.entrants.size(); i++) {
+        const auto& e = uncached.entrants[i];
+        if (e.balances.second < minimum_stake) {
+            continue;
+        }
+        BOOST_REQUIRE(n < entrants.size());
+        BOOST_CHECK(context.entrants[i].scored);
+
+        const auto expected = pog3::ComputeCGS(uncached, e, *prefviewcache);
+        const auto& actual = entrants[n++];
+        BOOST_CHECK(actual.address == expected.address);
+        BOOST_CHECK_EQUAL(actual.balance, expected.balance);
+        BOOST_CHECK_EQUAL(actual.aged_balance, expected.aged_balance);
+        BOOST_CHECK_EQUAL(actual.cgs, expected.cgs);
+        BOOST_CHECK_EQUAL(actual.children, expected.children);
+        BOOST_CHECK_EQUAL(actual.network_size, expected.network_size);
+    }
+    BOOST_CHECK_EQUAL(n, entrants.size());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
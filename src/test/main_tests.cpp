@@ -6,9 +6,14 @@
 #include "chainparams.h"
 #include "validation.h"
 #include "net.h"
+#include "txdb.h"
 
 #include "test/test_merit.h"
 
+#include <algorithm>
+#include <map>
+#include <memory>
+
 #include <boost/signals2/signal.hpp>
 #include <boost/test/unit_test.hpp>
 
@@ -75,4 +80,185 @@ BOOST_AUTO_TEST_CASE(test_combiner_all)
     Test.disconnect(&ReturnTrue);
     BOOST_CHECK(Test());
 }
+/* Pruned cycles are read back from the block tree DB through the cache */
+BOOST_AUTO_TEST_CASE(pruned_cycle_read_back)
+{
+    // Fewer entries than headers so reading them all evicts some
+    const size_t cache_size = 4;
+    pblocktree->SetCycleCacheSize(cache_size);
+
+    const size_t count = 12;
+    std::vector<CBlockHeader> headers(count);
+    std::vector<uint256> hashes(count);
+    std::vector<std::unique_ptr<CBlockIndex>> indexes;
+    std::vector<const CBlockIndex*> written;
+    for (size_t i = 0; i < count; i++) {
+        auto& header = headers[i];
+        header.nVersion = 1;
+        header.nTime = i;
+        header.nNonce = i;
+        header.nEdgeBits = 16;
+
+        std::set<uint32_t> nonces;
+        while (nonces.size() < 42) {
+            nonces.insert(InsecureRand32());
+        }
+        header.sCycle = CCycle{nonces};
+
+        hashes[i] = header.GetHash();
+        indexes.emplace_back(new CBlockIndex{header});
+        indexes.back()->phashBlock = &hashes[i];
+        written.push_back(indexes.back().get());
+    }
+    BOOST_REQUIRE(pblocktree->WriteBatchSync({}, 0, written));
+
+    for (auto& pindex : indexes) {
+        pindex->PruneCycle();
+    }
+
+    // Twice over and then backwards so the cache both misses and hits
+    for (int round = 0; round < 3; round++) {
+        for (size_t n = 0; n < count; n++) {
+            const size_t i = round < 2 ? n : count - n - 1;
+            BOOST_CHECK(indexes[i]->GetCycle() == headers[i].sCycle);
+
+            const CBlockHeader header = indexes[i]->GetBlockHeader();
+            BOOST_CHECK(header.sCycle == headers[i].sCycle);
+            BOOST_CHECK(header.GetHash() == hashes[i]);
+        }
+    }
+
+    // A cycle that was never written cannot be read back once pruned
+    CBlockHeader unwritten = headers[0];
+    unwritten.nNonce = count;
+    const uint256 unwritten_hash = unwritten.GetHash();
+    CBlockIndex unwritten_index{unwritten};
+    unwritten_index.phashBlock = &unwritten_hash;
+    unwritten_index.PruneCycle();
+    BOOST_CHECK_THROW(unwritten_index.GetCycle(), std::runtime_error);
+
+    // Cycles read in bulk come from memory or the DB, in any order
+    for (size_t i = 0; i < count; i += 2) {
+        indexes[i]->SetCycle(headers[i].sCycle);
+    }
+    std::vector<CBlockIndex*> bulk;
+    for (auto& pindex : indexes) {
+        bulk.push_back(pindex.get());
+    }
+    std::sort(bulk.begin(), bulk.end(), [](const CBlockIndex* a, const CBlockIndex* b) {
+        return a->GetBlockHash() < b->GetBlockHash();
+    });
+    for (int round = 0; round < 2; round++) {
+        std::vector<CCycle> cycles;
+        BOOST_REQUIRE(pblocktree->ReadBlockCycles(bulk, cycles));
+        BOOST_REQUIRE_EQUAL(cycles.size(), count);
+        for (size_t i = 0; i < count; i++) {
+            BOOST_CHECK(cycles[i] == bulk[i]->GetCycle());
+        }
+        std::reverse(bulk.begin(), bulk.end());
+    }
+
+    pblocktree->SetCycleCacheSize(DEFAULT_CYCLE_CACHE_SIZE);
+}
+
+/* Each block index entry has its own cycle slot */
+BOOST_AUTO_TEST_CASE(cycle_slots)
+{
+    const CCycle first{1, 2, 3};
+    const CCycle second{4, 5, 6};
+
+    CBlockIndex index;
+    CCycle cycle;
+    BOOST_CHECK(!index.cycle.Get(cycle));
+
+    index.SetCycle(first);
+    BOOST_CHECK(index.GetCycle() == first);
+
+    // A copy does not share the slot
+    CBlockIndex copy{index};
+    copy.SetCycle(second);
+    BOOST_CHECK(index.GetCycle() == first);
+    BOOST_CHECK(copy.GetCycle() == second);
+
+    // A freed slot is reused by the next cycle without touching the others
+    index.PruneCycle();
+    BOOST_CHECK(!index.cycle.Get(cycle));
+    CBlockIndex other;
+    other.SetCycle(first);
+    BOOST_CHECK(other.GetCycle() == first);
+    BOOST_CHECK(copy.GetCycle() == second);
+
+    copy = index;
+    BOOST_CHECK(!copy.cycle.Get(cycle));
+}
+
+/* Sealed headers are trusted on later loads and verified again otherwise */
+BOOST_AUTO_TEST_CASE(block_index_seals)
+{
+    FlushStateToDisk();
+    const CBlockIndex* genesis = chainActive.Genesis();
+    BOOST_REQUIRE(genesis && genesis->IsValid(BLOCK_VALID_TREE));
+
+    std::map<uint256, std::unique_ptr<CBlockIndex>> loaded;
+    auto insert = [&loaded](const uint256& hash) -> CBlockIndex* {
+        if (hash.IsNull()) {
+            return nullptr;
+        }
+        auto& pindex = loaded[hash];
+        if (!pindex) {
+            pindex.reset(new CBlockIndex);
+            pindex->phashBlock = &loaded.find(hash)->first;
+        }
+        return pindex.get();
+    };
+    std::vector<CBlockIndex*> trusted;
+    auto load = [&](const uint256& key) {
+        trusted.clear();
+        loaded.clear();
+        return pblocktree->LoadBlockIndexGuts(Params().GetConsensus(), insert, &key, &trusted);
+    };
+
+    // Headers are sealed once verified and trusted from then on
+    const uint256 key = InsecureRand256();
+    BOOST_REQUIRE(load(key));
+    BOOST_CHECK(trusted.empty());
+    BOOST_REQUIRE(load(key));
+    BOOST_REQUIRE_EQUAL(trusted.size(), 1u);
+    BOOST_CHECK(trusted[0]->GetBlockHash() == genesis->GetBlockHash());
+
+    // Seals of another key do not match so the headers are verified again
+    // and sealed with the new key
+    const uint256 other_key = InsecureRand256();
+    BOOST_REQUIRE(load(other_key));
+    BOOST_CHECK(trusted.empty());
+    BOOST_REQUIRE(load(other_key));
+    BOOST_REQUIRE_EQUAL(trusted.size(), 1u);
+
+    const CBlockIndex* invalid = nullptr;
+    BOOST_CHECK(ReverifyBlockIndex(trusted, invalid));
+    BOOST_CHECK(!invalid);
+
+    // A cycle changed after the header was trusted fails reverification
+    const CCycle cycle = genesis->GetCycle();
+    CCycle broken;
+    for (auto it = cycle.begin(); it + 1 != cycle.end(); ++it) {
+        broken.insert(*it);
+    }
+    broken.insert(*(cycle.end() - 1) + 1);
+    trusted[0]->SetCycle(broken);
+    BOOST_CHECK(!ReverifyBlockIndex(trusted, invalid));
+    BOOST_CHECK(invalid == trusted[0]);
+
+    // Changed on disk it breaks the seal and fails verification on load
+    CBlockIndex tampered{*genesis};
+    tampered.SetCycle(broken);
+    BOOST_REQUIRE(pblocktree->WriteBatchSync({}, 0, {&tampered}));
+    BOOST_CHECK(!load(other_key));
+
+    // The seal of the original header was kept
+    BOOST_REQUIRE(pblocktree->WriteBatchSync({}, 0, {genesis}));
+    BOOST_REQUIRE(load(other_key));
+    BOOST_CHECK_EQUAL(trusted.size(), 1u);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
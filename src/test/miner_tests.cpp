@@ -9,8 +9,11 @@
 #include "consensus/merkle.h"
 #include "consensus/tx_verify.h"
 #include "consensus/validation.h"
+#include "cuckoo/miner.h"
+#include "key.h"
 #include "validation.h"
 #include "miner.h"
+#include "pog3/cgs.h"
 #include "policy/policy.h"
 #include "pubkey.h"
 #include "script/standard.h"
@@ -19,10 +22,14 @@
 #include "util.h"
 #include "utilstrencodings.h"
 #include "refdb.h"
+#include "refmempool.h"
 
 #include "test/test_merit.h"
 
+#include <atomic>
 #include <memory>
+#include <mutex>
+#include <thread>
 
 #include <boost/test/unit_test.hpp>
 
@@ -514,4 +521,267 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     fCheckpointsEnabled = true;
 }
 
+
+struct RegTestingSetup : public TestingSetup
+{
+    RegTestingSetup() : TestingSetup(CBaseChainParams::REGTEST) {}
+};
+
+/** Mines a template on the tip with a real cuckoo cycle and connects it */
+static void MineBlock(const CScript& script, CuckooSolver& solver)
+{
+    const auto& params = Params();
+    const auto& consensus = params.GetConsensus();
+
+    //Blocks far enough apart get the minimum edge bits so they are quick to solve.
+    SetMockTime(chainActive.Tip()->GetBlockTime() + 3 * consensus.nPowTargetSpacing);
+
+    auto pblocktemplate = BlockAssembler(params).CreateNewBlock(script);
+    BOOST_REQUIRE(pblocktemplate);
+    CBlock& block = pblocktemplate->block;
+
+    unsigned int extra_nonce = 0;
+    IncrementExtraNonce(&block, chainActive.Tip(), extra_nonce);
+
+    bool cycle_found = false;
+    std::set<uint32_t> cycle;
+    while (!cuckoo::FindProofOfWorkAdvanced(
+                block.GetHash(),
+                block.nBits,
+                block.nEdgeBits,
+                cycle,
+                consensus,
+                solver,
+                cycle_found)) {
+        ++block.nNonce;
+    }
+    block.sCycle = CCycle{cycle};
+
+    const auto tip = chainActive.Tip();
+    BOOST_REQUIRE(ProcessNewBlock(params, std::make_shared<const CBlock>(block), true, nullptr, true));
+    BOOST_REQUIRE(chainActive.Tip()->pprev == tip);
+}
+
+/** Adds the referral of a new address to the referral mempool */
+static CKeyID BeaconNewAddress(const referral::Address& parent)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    const auto pubkey = key.GetPubKey();
+    referral::MutableReferral ref{1, pubkey.GetID(), pubkey, parent};
+    BOOST_REQUIRE(key.Sign(
+                (CHashWriter(SER_GETHASH, 0) << ref.parentAddress << ref.GetAddress()).GetHash(),
+                ref.signature));
+
+    LOCK(cs_main);
+    CValidationState state;
+    bool missing_referrer = false;
+    BOOST_REQUIRE(AcceptReferralToMemoryPool(
+                mempoolReferral, state, referral::MakeReferralRef(ref), missing_referrer));
+    return pubkey.GetID();
+}
+
+BOOST_FIXTURE_TEST_CASE(CreateNewBlock_same_tip_lottery, RegTestingSetup)
+{
+    const auto& params = Params();
+    const auto& consensus = params.GetConsensus();
+
+    //Beacon a few addresses and pay each of them a coinbase so there are
+    //several ambassadors for the lotteries to choose from.
+    std::vector<CScript> scripts;
+    for (int i = 0; i < 6; i++) {
+        scripts.push_back(GetScriptForDestination(BeaconNewAddress(consensus.genesis_address)));
+    }
+
+    ctpl::thread_pool pool{2};
+    CuckooSolver solver{2, pool};
+    while (chainActive.Height() < consensus.pog3_blockheight) {
+        MineBlock(scripts[chainActive.Height() % scripts.size()], solver);
+    }
+
+    //Every template built on the same tip must draw the same winners.
+    for (int i = 0; i < 8; i++) {
+        const auto& script = scripts[i % scripts.size()];
+        {
+            LOCK(cs_main);
+            const auto first = BlockAssembler(params).CreateNewBlock(script);
+            const auto second = BlockAssembler(params).CreateNewBlock(script);
+            BOOST_REQUIRE(first);
+            BOOST_REQUIRE(second);
+
+            for (const auto* t : {first.get(), second.get()}) {
+                CValidationState state;
+                BOOST_CHECK(TestBlockValidity(state, params, t->block, chainActive.Tip(), false, false));
+            }
+
+            BOOST_CHECK(first->block.vtx[0]->vout == second->block.vtx[0]->vout);
+            BOOST_REQUIRE_EQUAL(first->block.invites.size(), second->block.invites.size());
+            for (size_t n = 0; n < first->block.invites.size(); n++) {
+                BOOST_CHECK(first->block.invites[n]->vout == second->block.invites[n]->vout);
+            }
+        }
+        MineBlock(script, solver);
+    }
+
+    SetMockTime(0);
+}
+
+BOOST_FIXTURE_TEST_CASE(CGSSnapshot_ranks_while_connecting, RegTestingSetup)
+{
+    const auto& params = Params();
+    const auto& consensus = params.GetConsensus();
+
+    std::vector<referral::Address> addresses;
+    for (int i = 0; i < 4; i++) {
+        addresses.push_back(BeaconNewAddress(consensus.genesis_address));
+    }
+
+    ctpl::thread_pool pool{2};
+    CuckooSolver solver{2, pool};
+    while (chainActive.Height() < consensus.pog3_blockheight) {
+        const auto& address = addresses[chainActive.Height() % addresses.size()];
+        MineBlock(GetScriptForDestination(CKeyID{address}), solver);
+    }
+
+    const auto before = GetCGSSnapshot(consensus);
+    BOOST_REQUIRE(before);
+
+    //Ranks are asked for while blocks beaconing new addresses connect, so
+    //the snapshot may belong to the previous tip.
+    std::mutex cs_addresses;
+    std::atomic<bool> done{false};
+    std::atomic<bool> bad_ranks{false};
+    std::atomic<int> queries{0};
+    {
+        std::thread ranks{[&] {
+            while (!done) {
+                const auto snapshot = GetCGSSnapshot(consensus);
+                std::vector<CAmount> cgs;
+                {
+                    std::lock_guard<std::mutex> lock{cs_addresses};
+                    for (const auto& address : addresses) {
+                        cgs.push_back(GetSnapshotCGS(*snapshot, address));
+                    }
+                }
+                if (CGSRanks(*snapshot, cgs).first.size() != cgs.size()) {
+                    bad_ranks = true;
+                }
+                queries++;
+            }
+        }};
+        //Join the reader even if mining below fails a requirement.
+        struct StopReader {
+            std::atomic<bool>& done;
+            std::thread& reader;
+            ~StopReader() { done = true; reader.join(); }
+        } stop_ranks{done, ranks};
+
+        for (int i = 0; i < 4; i++) {
+            const auto address = BeaconNewAddress(addresses[i]);
+            {
+                std::lock_guard<std::mutex> lock{cs_addresses};
+                addresses.push_back(address);
+            }
+            MineBlock(GetScriptForDestination(CKeyID{addresses[i]}), solver);
+        }
+    }
+    BOOST_CHECK(!bad_ranks);
+    BOOST_CHECK(queries > 0);
+
+    //Addresses beaconed after the tip of a snapshot have no cgs in it.
+    BOOST_CHECK(!before->context.FindEntrant(addresses.back()));
+    BOOST_CHECK_EQUAL(GetSnapshotCGS(*before, addresses.back()), 0);
+    for (const auto& e : before->entrants) {
+        BOOST_CHECK_EQUAL(GetSnapshotCGS(*before, e.address), e.cgs);
+        BOOST_CHECK_EQUAL(pog3::ComputeCGS(before->context, *before->context.FindEntrant(e.address)).cgs, e.cgs);
+    }
+
+    SetMockTime(0);
+}
+
+
+/** Waits up to a few seconds for the controller thread to flag the bucket */
+static bool WaitAbandoned(const MinerController& controller, size_t bucket)
+{
+    for (int i = 0; i < 5000 && !controller.IsAbandoned(bucket); i++) {
+        MilliSleep(1);
+    }
+    return controller.IsAbandoned(bucket);
+}
+
+BOOST_AUTO_TEST_CASE(MinerController_abandons_templates)
+{
+    //Templates never go stale from mempool changes alone in this controller.
+    MinerController controller{2, 60 * 60 * 1000};
+    boost::thread run{[&controller] {
+        try {
+            controller.Run();
+        } catch (const boost::thread_interrupted&) {
+        }
+    }};
+
+    {
+        MinerControllerRegistration registration{controller};
+
+        controller.BeginTemplate(0);
+        controller.BeginTemplate(1);
+        GetMainSignals().TransactionAddedToMempool(MakeTransactionRef());
+        MilliSleep(50);
+        BOOST_CHECK(!controller.IsAbandoned(0));
+        BOOST_CHECK(!controller.IsAbandoned(1));
+
+        //A new tip abandons every template and cancels its graph.
+        GetMainSignals().UpdatedBlockTip(chainActive.Tip(), nullptr, false);
+        BOOST_CHECK(WaitAbandoned(controller, 0));
+        BOOST_CHECK(WaitAbandoned(controller, 1));
+        BOOST_CHECK(controller.CancelToken(0).IsCancelled());
+        BOOST_CHECK(controller.CancelToken(1).IsCancelled());
+
+        //A template built after the tip changed is current again.
+        controller.BeginTemplate(0);
+        BOOST_CHECK(!controller.IsAbandoned(0));
+        BOOST_CHECK(!controller.CancelToken(0).IsCancelled());
+    }
+
+    //Once the registration is gone the controller gets no more events.
+    GetMainSignals().UpdatedBlockTip(chainActive.Tip(), nullptr, false);
+    MilliSleep(50);
+    BOOST_CHECK(!controller.IsAbandoned(0));
+
+    run.interrupt();
+    run.join();
+}
+
+BOOST_AUTO_TEST_CASE(MinerController_stale_templates)
+{
+    //Any mempool change makes a template stale right away.
+    MinerController controller{1, 0};
+    boost::thread run{[&controller] {
+        try {
+            controller.Run();
+        } catch (const boost::thread_interrupted&) {
+        }
+    }};
+
+    {
+        MinerControllerRegistration registration{controller};
+
+        controller.BeginTemplate(0);
+        MilliSleep(50);
+        BOOST_CHECK(!controller.IsAbandoned(0));
+
+        //The graph being solved is left to finish.
+        GetMainSignals().ReferralAddedToMempool(referral::ReferralRef{});
+        BOOST_CHECK(WaitAbandoned(controller, 0));
+        BOOST_CHECK(!controller.CancelToken(0).IsCancelled());
+
+        controller.BeginTemplate(0);
+        GetMainSignals().TransactionAddedToMempool(MakeTransactionRef());
+        BOOST_CHECK(WaitAbandoned(controller, 0));
+    }
+
+    run.interrupt();
+    run.join();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
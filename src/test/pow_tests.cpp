@@ -5,11 +5,19 @@
 
 #include "chain.h"
 #include "chainparams.h"
+#include "cuckoo/cuckoo.h"
+#include "cuckoo/mean_cuckoo.h"
+#include "cuckoo/miner.h"
+#include "cuckoo/sipnodes.h"
+#include "hash.h"
 #include "pow.h"
 #include "random.h"
 #include "util.h"
 #include "test/test_merit.h"
 
+#include <chrono>
+#include <thread>
+
 #include <boost/test/unit_test.hpp>
 
 BOOST_FIXTURE_TEST_SUITE(pow_tests, BasicTestingSetup)
@@ -88,4 +96,182 @@ BOOST_AUTO_TEST_CASE(GetBlockProofEquivalentTime_test)
     }
 }
 
+/* Every siphash implementation the CPU supports must find the same cycles */
+BOOST_AUTO_TEST_CASE(cuckoo_sipnodes_same_cycles)
+{
+    const auto impls = cuckoo::SupportedSipNodes();
+    const auto saved = cuckoo::SipNodes;
+    ctpl::thread_pool pool{2};
+
+    std::vector<std::set<uint32_t>> expected;
+    for (const auto& impl : impls) {
+        BOOST_CHECK(cuckoo::SipNodesSelfTest(impl.fn));
+        cuckoo::UseSipNodes(impl);
+
+        size_t i = 0;
+        for (uint8_t proofSize : {4, 6, 8}) {
+            for (int h = 0; h < 8; h++, i++) {
+                const uint256 hash = SerializeHash(h * 1000 + 160 + proofSize);
+                std::set<uint32_t> cycle;
+                if (FindCycleAdvanced(hash, 16, proofSize, cycle, 2, pool)) {
+                    std::vector<uint32_t> v{cycle.begin(), cycle.end()};
+                    BOOST_CHECK_EQUAL(VerifyCycle(hash, 16, proofSize, v), POW_OK);
+                }
+
+                if (expected.size() == i) {
+                    expected.push_back(cycle);
+                } else {
+                    BOOST_CHECK_MESSAGE(cycle == expected[i], impl.name);
+                }
+            }
+        }
+    }
+
+    cuckoo::SipNodes = saved;
+}
+
+/* A solver reused for many graphs must find what a fresh solver finds for each */
+BOOST_AUTO_TEST_CASE(cuckoo_solver_reuse_same_cycles)
+{
+    ctpl::thread_pool pool{2};
+    CuckooSolver solver{2, pool};
+
+    size_t found = 0;
+    for (int h = 0; h < 48; h++) {
+        const uint256 hash = SerializeHash(h);
+
+        // Switching the graph size in between reallocates the arenas
+        const uint8_t edgeBits = h % 16 < 12 ? 16 : 17;
+
+        std::set<uint32_t> expected;
+        const bool fresh = FindCycleAdvanced(hash, edgeBits, 6, expected, 2, pool);
+
+        std::set<uint32_t> cycle;
+        BOOST_CHECK_EQUAL(solver.FindCycle(hash, edgeBits, 6, cycle), fresh);
+        BOOST_CHECK(cycle == expected);
+        BOOST_CHECK(!solver.Cancelled());
+
+        found += fresh;
+    }
+    BOOST_CHECK(found > 0);
+}
+
+/* A pipelined solver must find what a serial one finds for every hash */
+BOOST_AUTO_TEST_CASE(cuckoo_solver_pipelined_same_cycles)
+{
+    ctpl::thread_pool pool{4};
+    CuckooSolver serial{2, pool};
+    CuckooSolver pipelined{2, pool, true};
+
+    std::vector<uint256> hashes;
+    for (int h = 0; h < 32; h++) {
+        hashes.push_back(SerializeHash(h + 5000));
+    }
+
+    const auto check = [&](const uint256& hash, const uint256* next) {
+        std::set<uint32_t> expected;
+        const bool found = serial.FindCycle(hash, 16, 6, expected);
+
+        std::set<uint32_t> cycle;
+        BOOST_CHECK_EQUAL(pipelined.FindCycle(hash, 16, 6, cycle, next), found);
+        BOOST_CHECK(cycle == expected);
+        BOOST_CHECK(!pipelined.Cancelled());
+    };
+
+    for (size_t i = 0; i < hashes.size(); i++) {
+        check(hashes[i], i + 1 < hashes.size() ? &hashes[i + 1] : nullptr);
+    }
+
+    // The graph prepared for a hash that is not asked for next is thrown
+    // away and the asked one generated instead.
+    const uint256 prepared = SerializeHash(6000);
+    for (int h = 0; h < 8; h++) {
+        check(SerializeHash(6100 + h), &prepared);
+    }
+    check(SerializeHash(6200), nullptr);
+}
+
+/* Cancelling from another thread stops a solve which is correct after a reset */
+BOOST_AUTO_TEST_CASE(cuckoo_solver_cancel)
+{
+    ctpl::thread_pool pool{4};
+
+    for (const bool pipeline : {false, true}) {
+        CuckooCancelToken cancel;
+        CuckooSolver solver{2, pool, pipeline, &cancel};
+
+        // Large enough that the solve is still running when it is cancelled
+        const uint256 hash = SerializeHash(7000);
+        const uint256 next = SerializeHash(7001);
+
+        std::thread canceller{[&cancel] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            cancel.Cancel();
+        }};
+
+        std::set<uint32_t> cycle;
+        const auto start = std::chrono::steady_clock::now();
+        BOOST_CHECK(!solver.FindCycle(hash, 24, 42, cycle, &next));
+        canceller.join();
+
+        BOOST_CHECK(solver.Cancelled());
+        BOOST_CHECK(std::chrono::steady_clock::now() - start < std::chrono::seconds(10));
+
+        // It stays cancelled until reset
+        BOOST_CHECK(!solver.FindCycle(next, 24, 42, cycle));
+        BOOST_CHECK(solver.Cancelled());
+
+        cancel.Reset();
+        for (int h = 0; h < 8; h++) {
+            const uint256 small = SerializeHash(h + 7100);
+            std::set<uint32_t> expected;
+            const bool found = FindCycleAdvanced(small, 16, 6, expected, 2, pool);
+
+            std::set<uint32_t> after;
+            BOOST_CHECK_EQUAL(solver.FindCycle(small, 16, 6, after), found);
+            BOOST_CHECK(after == expected);
+            BOOST_CHECK(!solver.Cancelled());
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(cuckoo_verify_proofs_of_work_batch)
+{
+    auto params = CreateChainParams(CBaseChainParams::MAIN)->GetConsensus();
+    params.nCuckooProofSize = 6;
+    params.sEdgeBitsAllowed = {16};
+    params.powLimit.uHashLimit = uint256S("ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff");
+    const unsigned int nBits = 0x2100ffff;
+
+    ctpl::thread_pool pool{2};
+    std::vector<std::pair<uint256, CCycle>> solved;
+    for (int h = 0; solved.size() < 4 && h < 200; h++) {
+        const uint256 hash = SerializeHash(h);
+        std::set<uint32_t> cycle;
+        if (FindCycleAdvanced(hash, 16, params.nCuckooProofSize, cycle, 2, pool) &&
+                cuckoo::VerifyProofOfWork(hash, nBits, 16, CCycle{cycle}, params)) {
+            solved.emplace_back(hash, CCycle{cycle});
+        }
+    }
+    BOOST_REQUIRE(!solved.empty());
+
+    cuckoo::PowChecks checks;
+    for (size_t i = 0; i < 1000; i++) {
+        const auto& s = solved[i % solved.size()];
+        checks.push_back(cuckoo::PowCheck{s.first, nBits, 16, &s.second});
+    }
+    BOOST_CHECK_EQUAL(cuckoo::VerifyProofsOfWork(checks, params, nullptr), checks.size());
+    BOOST_CHECK_EQUAL(cuckoo::VerifyProofsOfWork(checks, params, &pool), checks.size());
+
+    // The first failure is reported wherever the batches are split
+    std::set<uint32_t> bad_nonces{solved[0].second.begin(), solved[0].second.end()};
+    bad_nonces.erase(bad_nonces.begin());
+    bad_nonces.insert(0xffff);
+    const CCycle bad{bad_nonces};
+    checks[700].cycle = &bad;
+    checks[333].cycle = &bad;
+    BOOST_CHECK_EQUAL(cuckoo::VerifyProofsOfWork(checks, params, nullptr), 333u);
+    BOOST_CHECK_EQUAL(cuckoo::VerifyProofsOfWork(checks, params, &pool), 333u);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
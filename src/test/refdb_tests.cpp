@@ -0,0 +1,424 @@
+// Copyright (c) 2018 The Merit Foundation developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "key.h"
+#include "primitives/referral.h"
+#include "random.h"
+#include "refdb.h"
+#include "txdb.h"
+#include "util.h"
+#include "test/test_merit.h"
+
+#include <boost/test/unit_test.hpp>
+
+namespace
+{
+    const uint64_t MAX_RESERVOIR_SIZE = 8;
+
+    /** Exposes the lottery heap image and the records it was loaded from */
+    class TestReferralsViewDB : public referral::ReferralsViewDB
+    {
+    public:
+        TestReferralsViewDB() : referral::ReferralsViewDB{0, true, true, "testrefdb"} {}
+
+        /** The heap as currently held in memory */
+        referral::LotteryHeap Image() const
+        {
+            LoadLottery();
+            return m_lottery;
+        }
+
+        /** The heap as stored in the DB, ignoring changes not flushed yet */
+        referral::LotteryHeap Disk() const
+        {
+            const auto image = m_lottery;
+            Reload();
+            const auto disk = Image();
+            m_lottery = image;
+            return disk;
+        }
+
+        /** Drops the image so the next use loads it from the DB again */
+        void Reload() const
+        {
+            m_lottery = referral::LotteryHeap{};
+        }
+
+        using ExactANV = std::pair<
+            boost::multiprecision::int128_t,
+            boost::multiprecision::int128_t>;
+
+        /** The ANV of the address as the exact rational stored */
+        ExactANV ReadExactANV(const referral::Address& address) const
+        {
+            //DB_ANV
+            std::tuple<char, referral::Address, ExactANV> anv;
+            BOOST_REQUIRE(m_db.Read(std::make_pair('a', address), anv));
+            return std::get<2>(anv);
+        }
+
+        /** Writes children the way they were stored before Upgrade */
+        void WriteLegacyChildren(
+                const referral::Address& parent,
+                const referral::ChildAddresses& children)
+        {
+            //DB_CHILDREN
+            BOOST_REQUIRE(m_db.Write(std::make_pair('c', parent), children));
+        }
+    };
+
+    referral::Address RandomAddress()
+    {
+        referral::Address address;
+        GetRandBytes(address.begin(), address.size());
+        return address;
+    }
+
+    referral::ReferralRef NewReferral(const referral::Address& parent)
+    {
+        CKey key;
+        key.MakeNewKey(true);
+        const auto pubkey = key.GetPubKey();
+        return referral::MakeReferralRef(
+                referral::MutableReferral{1, pubkey.GetID(), pubkey, parent});
+    }
+
+    /**
+     * Heaps are equal when they hold the same entrants in the same slots and
+     * the same position records. Slots past the end of the heap are
+     * left over from removals and are never read.
+     */
+    void CheckSameHeap(const referral::LotteryHeap& a, const referral::LotteryHeap& b)
+    {
+        BOOST_REQUIRE_EQUAL(a.size, b.size);
+        for (uint64_t pos = 0; pos < a.size; pos++) {
+            const auto ea = a.entrants.find(pos);
+            const auto eb = b.entrants.find(pos);
+            BOOST_REQUIRE(ea != a.entrants.end());
+            BOOST_REQUIRE(eb != b.entrants.end());
+            BOOST_CHECK(std::get<0>(ea->second) == std::get<0>(eb->second));
+            BOOST_CHECK_EQUAL(std::get<1>(ea->second), std::get<1>(eb->second));
+            BOOST_CHECK(std::get<2>(ea->second) == std::get<2>(eb->second));
+        }
+        BOOST_CHECK(a.positions == b.positions);
+    }
+
+    /** Same entrants and keys regardless of which slots they are in */
+    void CheckSameEntrants(const referral::LotteryHeap& a, const referral::LotteryHeap& b)
+    {
+        const auto live = [](const referral::LotteryHeap& h) {
+            std::map<referral::Address, pog::WeightedKey> keys;
+            for (uint64_t pos = 0; pos < h.size; pos++) {
+                const auto& e = h.entrants.at(pos);
+                keys.emplace(std::get<2>(e), std::get<0>(e));
+            }
+            return keys;
+        };
+
+        BOOST_REQUIRE_EQUAL(a.size, b.size);
+        BOOST_CHECK(live(a) == live(b));
+    }
+
+    /**
+     * Applies every lottery change to two DBs. The first keeps the heap in
+     * memory until it is flushed like the chainstate does. The second writes
+     * each change through to the DB and reads the heap back from it for the
+     * next one, which is how the heap used to be maintained.
+     */
+    struct Lotteries
+    {
+        TestReferralsViewDB image;
+        TestReferralsViewDB disk;
+
+        void InsertReferral(int height, const referral::Referral& ref, CAmount anv)
+        {
+            for (auto db : {&image, &disk}) {
+                BOOST_REQUIRE(db->InsertReferral(height, ref, height == 0, false));
+                BOOST_REQUIRE(db->UpdateANV(ref.addressType, ref.GetAddress(), anv));
+            }
+        }
+
+        void Add(
+                int height,
+                const referral::ReferralRef& ref,
+                const uint256& rand_value,
+                referral::LotteryUndos& undos)
+        {
+            referral::LotteryUndos disk_undos;
+            BOOST_REQUIRE(image.AddAddressToLottery(
+                        height, rand_value, ref->addressType, ref->GetAddress(),
+                        MAX_RESERVOIR_SIZE, undos));
+            BOOST_REQUIRE(disk.AddAddressToLottery(
+                        height, rand_value, ref->addressType, ref->GetAddress(),
+                        MAX_RESERVOIR_SIZE, disk_undos));
+            WriteThrough();
+        }
+
+        void Undo(const referral::LotteryUndos& undos)
+        {
+            for (auto undo = undos.rbegin(); undo != undos.rend(); ++undo) {
+                BOOST_REQUIRE(image.UndoLotteryEntrant(*undo, MAX_RESERVOIR_SIZE));
+                BOOST_REQUIRE(disk.UndoLotteryEntrant(*undo, MAX_RESERVOIR_SIZE));
+                WriteThrough();
+            }
+        }
+
+        void WriteThrough()
+        {
+            BOOST_REQUIRE(disk.FlushLottery());
+            disk.Reload();
+        }
+
+        void Check() const
+        {
+            CheckSameHeap(image.Image(), disk.Image());
+        }
+    };
+
+    using Block = std::vector<std::pair<referral::ReferralRef, uint256>>;
+
+    Block NewBlock(
+            referral::ReferralRefs::const_iterator begin,
+            referral::ReferralRefs::const_iterator end)
+    {
+        Block block;
+        for (auto ref = begin; ref != end; ++ref) {
+            block.emplace_back(*ref, GetRandHash());
+        }
+        return block;
+    }
+
+    referral::LotteryUndos AddBlock(Lotteries& lotteries, int height, const Block& block)
+    {
+        referral::LotteryUndos undos;
+        for (const auto& e : block) {
+            lotteries.Add(height, e.first, e.second, undos);
+        }
+        return undos;
+    }
+}
+
+BOOST_FIXTURE_TEST_SUITE(refdb_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(lottery_image_matches_db)
+{
+    Lotteries lotteries;
+
+    //A tree of referrals so adding one address also tries its ancestors.
+    referral::ReferralRefs refs;
+    referral::Address parent;
+    for (int i = 0; i < 24; i++) {
+        const auto ref = NewReferral(parent);
+        lotteries.InsertReferral(i, *ref, (i + 1) * COIN);
+        refs.push_back(ref);
+        parent = i % 3 == 0 ? ref->GetAddress() : parent;
+    }
+
+    //Fill the reservoir and write it to the DB.
+    const auto first = NewBlock(refs.begin(), refs.begin() + 12);
+    BOOST_CHECK(!AddBlock(lotteries, 20000, first).empty());
+    lotteries.Check();
+    BOOST_REQUIRE(lotteries.image.FlushLottery());
+
+    const auto before = lotteries.image.Disk();
+    BOOST_CHECK_EQUAL(before.size, MAX_RESERVOIR_SIZE);
+    CheckSameHeap(lotteries.image.Image(), before);
+
+    //Entrants replacing the smallest keys stay in memory until flushed.
+    auto second = NewBlock(refs.begin() + 12, refs.end());
+    const auto again = NewBlock(refs.begin(), refs.begin() + 12);
+    second.insert(second.end(), again.begin(), again.end());
+
+    auto undos = AddBlock(lotteries, 20001, second);
+    BOOST_CHECK(!undos.empty());
+    lotteries.Check();
+    CheckSameHeap(lotteries.image.Disk(), before);
+
+    //Undoing the block gives back the entrants the DB had.
+    lotteries.Undo(undos);
+    lotteries.Check();
+    CheckSameEntrants(lotteries.image.Image(), before);
+
+    //The image survives a flush and reload in the middle of a reorg.
+    undos = AddBlock(lotteries, 20001, second);
+    lotteries.Check();
+    BOOST_REQUIRE(lotteries.image.FlushLottery());
+    lotteries.image.Reload();
+    lotteries.Check();
+
+    lotteries.Undo(undos);
+    lotteries.Check();
+    BOOST_REQUIRE(lotteries.image.FlushLottery());
+    lotteries.image.Reload();
+    lotteries.Check();
+    CheckSameEntrants(lotteries.image.Image(), before);
+}
+
+BOOST_AUTO_TEST_CASE(upgrade_legacy_children)
+{
+    TestReferralsViewDB db;
+
+    //Parents with no parent of their own so inserting them does not write
+    //any child records.
+    referral::ReferralRefs parents;
+    for (int i = 0; i < 4; i++) {
+        parents.push_back(NewReferral(RandomAddress()));
+        BOOST_REQUIRE(db.InsertReferral(i, *parents.back(), true, false));
+    }
+
+    std::map<referral::Address, referral::ChildAddresses> legacy;
+    for (size_t i = 0; i < parents.size(); i++) {
+        auto& children = legacy[parents[i]->GetAddress()];
+        for (size_t c = 0; c < i * 50; c++) {
+            children.push_back(RandomAddress());
+        }
+        db.WriteLegacyChildren(parents[i]->GetAddress(), children);
+    }
+
+    //A tiny batch size makes the upgrade write many batches.
+    gArgs.ForceSetArg("-dbbatchsize", "1024");
+    BOOST_CHECK(db.Upgrade());
+    gArgs.ForceSetArg("-dbbatchsize", std::to_string(nDefaultDbBatchSize));
+
+    for (const auto& p : legacy) {
+        BOOST_CHECK(db.GetChildren(p.first) == p.second);
+        BOOST_CHECK_EQUAL(db.GetChildCount(p.first), p.second.size());
+
+        referral::ChildAddresses iterated;
+        for (auto it = db.IterateChildren(p.first); it->Valid(); it->Next()) {
+            iterated.push_back(it->GetAddress());
+        }
+        BOOST_CHECK(iterated == p.second);
+    }
+
+    //One iterator sought from parent to parent, in any order, reads the
+    //same children as a new iterator per parent.
+    auto it = db.IterateChildren(parents.back()->GetAddress());
+    for (auto p = legacy.rbegin(); p != legacy.rend(); p++) {
+        referral::ChildAddresses iterated;
+        for (it->Seek(p->first); it->Valid(); it->Next()) {
+            iterated.push_back(it->GetAddress());
+        }
+        BOOST_CHECK(iterated == p->second);
+    }
+
+    //Upgrading again finds nothing to do.
+    BOOST_CHECK(db.Upgrade());
+    for (const auto& p : legacy) {
+        BOOST_CHECK(db.GetChildren(p.first) == p.second);
+    }
+
+    //New children are appended after the upgraded ones.
+    const auto& parent = parents.back()->GetAddress();
+    const auto child = NewReferral(parent);
+    BOOST_REQUIRE(db.InsertReferral(10, *child, false, false));
+
+    auto expected = legacy[parent];
+    expected.push_back(child->GetAddress());
+    BOOST_CHECK(db.GetChildren(parent) == expected);
+    BOOST_CHECK_EQUAL(db.GetChildCount(parent), expected.size());
+}
+
+BOOST_AUTO_TEST_CASE(batched_anv_matches_single_updates)
+{
+    TestReferralsViewDB batched;
+    TestReferralsViewDB single;
+
+    //A chain so walks reach deep ancestors, with random branches off it so
+    //many changes share ancestors.
+    const auto root = NewReferral(RandomAddress());
+    referral::ReferralRefs refs{root};
+    for (int i = 0; i < 16; i++) {
+        refs.push_back(NewReferral(refs.back()->GetAddress()));
+    }
+    for (int i = 0; i < 200; i++) {
+        refs.push_back(NewReferral(refs[InsecureRandRange(refs.size())]->GetAddress()));
+    }
+    for (size_t i = 0; i < refs.size(); i++) {
+        for (auto db : {&batched, &single}) {
+            BOOST_REQUIRE(db->InsertReferral(i, *refs[i], i == 0, false));
+        }
+    }
+
+    const auto check_same = [&]() {
+        for (const auto& ref : refs) {
+            BOOST_CHECK(batched.ReadExactANV(ref->GetAddress()) ==
+                    single.ReadExactANV(ref->GetAddress()));
+        }
+    };
+
+    //Credits only, several per address and some to the end of the chain.
+    //Amounts are small enough for every ANV to keep its exact value.
+    std::map<referral::Address, CAmount> credited;
+    referral::ANVChanges changes;
+    for (int i = 0; i < 300; i++) {
+        const auto& ref = i % 10 == 0 ? refs[16] : refs[InsecureRandRange(refs.size())];
+        const CAmount amount = InsecureRandRange(1000) + 1;
+        changes.emplace_back(ref->addressType, ref->GetAddress(), amount);
+        credited[ref->GetAddress()] += amount;
+    }
+
+    BOOST_REQUIRE(batched.UpdateANV(changes));
+    for (const auto& c : changes) {
+        BOOST_REQUIRE(single.UpdateANV(std::get<0>(c), std::get<1>(c), std::get<2>(c)));
+    }
+    check_same();
+
+    //Debits mixed with credits, including changes to one address that
+    //cancel out. No address is debited more than it was credited.
+    changes.clear();
+    for (const auto& c : credited) {
+        const auto ref = single.GetReferral(c.first);
+        BOOST_REQUIRE(ref);
+        const CAmount debit = InsecureRandRange(c.second) + 1;
+        changes.emplace_back(ref->addressType, c.first, -debit);
+        if (InsecureRandBool()) {
+            changes.emplace_back(ref->addressType, c.first, debit);
+        }
+        const auto& other = refs[InsecureRandRange(refs.size())];
+        changes.emplace_back(other->addressType, other->GetAddress(), InsecureRandRange(1000) + 1);
+    }
+    for (size_t i = changes.size(); i > 1; i--) {
+        std::swap(changes[i - 1], changes[InsecureRandRange(i)]);
+    }
+
+    BOOST_REQUIRE(batched.UpdateANV(changes));
+    for (const auto& c : changes) {
+        BOOST_REQUIRE(single.UpdateANV(std::get<0>(c), std::get<1>(c), std::get<2>(c)));
+    }
+    check_same();
+
+    //An empty batch changes nothing.
+    BOOST_REQUIRE(batched.UpdateANV(referral::ANVChanges{}));
+    check_same();
+
+    //Past 64 bits the stored form of an ANV loses part of it, so each
+    //change must see the ANV as stored by the one before. Summed, these
+    //changes would give the root an ANV of exactly 2^63 instead.
+    const auto x = NewReferral(RandomAddress());
+    const auto y = NewReferral(x->GetAddress());
+    const auto z = NewReferral(y->GetAddress());
+    for (auto db : {&batched, &single}) {
+        BOOST_REQUIRE(db->InsertReferral(0, *x, true, false));
+        BOOST_REQUIRE(db->InsertReferral(1, *y, false, false));
+        BOOST_REQUIRE(db->InsertReferral(2, *z, false, false));
+    }
+
+    const CAmount quarter = CAmount{1} << 62;
+    changes = {
+        referral::ANVChange{z->addressType, z->GetAddress(), quarter - 1},
+        referral::ANVChange{x->addressType, x->GetAddress(), 3 * (quarter / 2)},
+        referral::ANVChange{z->addressType, z->GetAddress(), quarter + 1}};
+
+    BOOST_REQUIRE(batched.UpdateANV(changes));
+    for (const auto& c : changes) {
+        BOOST_REQUIRE(single.UpdateANV(std::get<0>(c), std::get<1>(c), std::get<2>(c)));
+    }
+    refs = {x, y, z};
+    check_same();
+    BOOST_CHECK(single.ReadExactANV(x->GetAddress()) !=
+            TestReferralsViewDB::ExactANV(boost::multiprecision::int128_t{quarter} * 2, 1));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -3,6 +3,7 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "primitives/block.h"
 #include "serialize.h"
 #include "streams.h"
 #include "hash.h"
@@ -366,4 +367,34 @@ BOOST_AUTO_TEST_CASE(class_methods)
     BOOST_CHECK(methodtest3 == methodtest4);
 }
 
+BOOST_AUTO_TEST_CASE(cuckoo_cycle_matches_set)
+{
+    const std::set<uint32_t> nonces{7, 3, 0xffffffff, 42, 1 << 20};
+    const CCycle cycle{nonces};
+    BOOST_CHECK(std::equal(cycle.begin(), cycle.end(), nonces.begin()));
+
+    CDataStream set_stream(SER_NETWORK, PROTOCOL_VERSION);
+    set_stream << nonces;
+    CDataStream cycle_stream(SER_NETWORK, PROTOCOL_VERSION);
+    cycle_stream << cycle;
+    BOOST_CHECK(set_stream.str() == cycle_stream.str());
+    BOOST_CHECK(SerializeHash(nonces) == SerializeHash(cycle));
+
+    // Unordered and duplicate nonces are read like a set would read them
+    const std::vector<uint32_t> raw{42, 7, 3, 42, 0xffffffff, 1 << 20, 7};
+    CDataStream raw_stream(SER_NETWORK, PROTOCOL_VERSION);
+    raw_stream << raw;
+    CCycle read;
+    raw_stream >> read;
+    BOOST_CHECK(read == cycle);
+
+    std::vector<uint32_t> too_long(CCycle::CAPACITY + 1);
+    for (size_t i = 0; i < too_long.size(); i++) {
+        too_long[i] = i;
+    }
+    CDataStream long_stream(SER_NETWORK, PROTOCOL_VERSION);
+    long_stream << too_long;
+    BOOST_CHECK_THROW(long_stream >> read, std::ios_base::failure);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
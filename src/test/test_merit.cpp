@@ -14,8 +14,11 @@
 #include "validation.h"
 #include "miner.h"
 #include "net_processing.h"
+#include "pog3/cgs.h"
 #include "pubkey.h"
 #include "random.h"
+#include "refdb.h"
+#include "referrals.h"
 #include "txdb.h"
 #include "txmempool.h"
 #include "ui_interface.h"
@@ -73,6 +76,9 @@ TestingSetup::TestingSetup(const std::string& chainName) : BasicTestingSetup(cha
         pblocktree = new CBlockTreeDB(1 << 20, true);
         pcoinsdbview = new CCoinsViewDB(1 << 23, true);
         pcoinsTip = new CCoinsViewCache(pcoinsdbview);
+        prefviewdb = new referral::ReferralsViewDB(0, true, true);
+        prefviewcache = new referral::ReferralsViewCache(prefviewdb);
+        pog3::SetupCgsThreadPool(2);
         if (!LoadGenesisBlock(chainparams)) {
             throw std::runtime_error("LoadGenesisBlock failed.");
         }
@@ -98,6 +104,10 @@ TestingSetup::~TestingSetup()
         GetMainSignals().FlushBackgroundCallbacks();
         GetMainSignals().UnregisterBackgroundSignalScheduler();
         UnloadBlockIndex();
+        delete prefviewcache;
+        delete prefviewdb;
+        prefviewcache = nullptr;
+        prefviewdb = nullptr;
         delete pcoinsTip;
         delete pcoinsdbview;
         delete pblocktree;
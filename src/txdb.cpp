@@ -7,6 +7,8 @@
 #include "txdb.h"
 
 #include "chainparams.h"
+#include "clientversion.h"
+#include "crypto/hmac_sha256.h"
 #include "hash.h"
 #include "random.h"
 #include "pow.h"
@@ -19,6 +21,8 @@
 
 #include <stdint.h>
 #include <algorithm>
+#include <map>
+#include <set>
 
 #include <boost/thread.hpp>
 
@@ -32,7 +36,9 @@ static const char DB_TIMESTAMPINDEX = 's';
 static const char DB_BLOCKHASHINDEX = 'z';
 static const char DB_SPENTINDEX = 'p';
 static const char DB_BLOCK_INDEX = 'b';
+static const char DB_BLOCK_INDEX_SEAL = 'v';
 static const char DB_REFERRALSINDEX = 'r';
+static const char DB_ADDRESSBALANCEINDEX = 'w';
 
 static const char DB_BEST_BLOCK = 'B';
 static const char DB_HEAD_BLOCKS = 'H';
@@ -40,6 +46,9 @@ static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
 
+//! Headers whose proof-of-work is verified together when loading the index
+static const size_t LOAD_INDEX_VERIFY_BATCH = 16384;
+
 namespace {
     const int VERIFY_SAMPLE_COUNT = 10;
 
@@ -160,6 +169,9 @@ size_t CCoinsViewDB::EstimateSize() const
 }
 
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe, bool compression, int maxOpenFiles) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe, false, compression, maxOpenFiles) {
+    // Keep an index built by an earlier run up to date from the first block
+    // that is replayed or rewound, before SetBalanceIndex is called.
+    ReadFlag("balanceindex", balance_index);
 }
 
 bool CBlockTreeDB::ReadBlockFileInfo(int nFile, CBlockFileInfo &info) {
@@ -269,10 +281,8 @@ bool CBlockTreeDB::UpdateSpentIndex(const std::vector<std::pair<CSpentIndexKey,
     for (const auto& addr : vect) {
         if (addr.second.IsNull()) {
             batch.Erase(std::make_pair(DB_SPENTINDEX, addr.first));
-            spent_cache.erase(addr.first);
         } else {
             batch.Write(std::make_pair(DB_SPENTINDEX, addr.first), addr.second);
-            spent_cache.insert(addr.first);
         }
     }
     return WriteBatch(batch);
@@ -280,17 +290,15 @@ bool CBlockTreeDB::UpdateSpentIndex(const std::vector<std::pair<CSpentIndexKey,
 
 bool CBlockTreeDB::UpdateAddressUnspentIndex(const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue > >&vect) {
     CDBBatch batch(*this);
-    RemoveUnspentSet to_remove;
     for (const auto& idx: vect) {
         if (idx.second.IsNull()) {
             batch.Erase(std::make_pair(DB_ADDRESSUNSPENTINDEX, idx.first));
-            to_remove.insert(idx.first);
+            unspent_cache.Erase(idx.first);
         } else {
             batch.Write(std::make_pair(DB_ADDRESSUNSPENTINDEX, idx.first), idx.second);
-            AddToUnspentCache(idx);
+            unspent_cache.Add(idx.first, idx.second);
         }
     }
-    EraseFromUnspentCache(to_remove);
     return WriteBatch(batch);
 }
 
@@ -313,11 +321,7 @@ bool CBlockTreeDB::ReadAddressUnspentIndex(
         if (pcursor->GetKey(key) && key.first == DB_ADDRESSUNSPENTINDEX && key.second.hashBytes == addressHash) {
             CAddressUnspentValue nValue;
             if (pcursor->GetValue(nValue)) {
-                //We check the spent cache because older versions had bugs properly
-                //removing uspent utxos from the utxo set. 
-                if(spent_cache.count({key.second.txhash, key.second.index}) == 0) {
-                    unspentOutputs.push_back(std::make_pair(key.second, nValue));
-                }
+                unspentOutputs.push_back(std::make_pair(key.second, nValue));
                 pcursor->Next();
             } else {
                 return error("failed to get address unspent value");
@@ -332,6 +336,9 @@ bool CBlockTreeDB::ReadAddressUnspentIndex(
 
 bool CBlockTreeDB::WriteAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount > >&vect) {
     CDBBatch batch(*this);
+    if (balance_index && !UpdateAddressBalances(batch, vect, false)) {
+        return false;
+    }
     for (const auto& addr : vect) {
         batch.Write(std::make_pair(DB_ADDRESSINDEX, addr.first), addr.second);
     }
@@ -340,6 +347,9 @@ bool CBlockTreeDB::WriteAddressIndex(const std::vector<std::pair<CAddressIndexKe
 
 bool CBlockTreeDB::EraseAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount > >&vect) {
     CDBBatch batch(*this);
+    if (balance_index && !UpdateAddressBalances(batch, vect, true)) {
+        return false;
+    }
     for (const auto& addr : vect ) {
         batch.Erase(std::make_pair(DB_ADDRESSINDEX, addr.first));
     }
@@ -368,7 +378,7 @@ bool CBlockTreeDB::ReadAddressIndex(
         boost::this_thread::interruption_point();
         std::pair<char,CAddressIndexKey> key;
         if (pcursor->GetKey(key) && key.first == DB_ADDRESSINDEX && key.second.hashBytes == addressHash) {
-            if (start > 0 && end > 0 && key.second.blockHeight > end) {
+            if (end > 0 && key.second.blockHeight > end) {
                 break;
             }
             CAmount nValue;
@@ -386,6 +396,198 @@ bool CBlockTreeDB::ReadAddressIndex(
     return true;
 }
 
+bool CBlockTreeDB::UpdateAddressBalances(
+        CDBBatch& batch,
+        const std::vector<std::pair<CAddressIndexKey, CAmount> >& vect,
+        bool erase) {
+
+    std::map<CAddressBalanceKey, CAddressBalanceValue> balances;
+    std::set<std::pair<CAddressBalanceKey, uint256>> txs;
+    const int sign = erase ? -1 : 1;
+
+    for (const auto& row : vect) {
+        if (Exists(std::make_pair(DB_ADDRESSINDEX, row.first)) != erase) {
+            continue;
+        }
+
+        const CAddressBalanceKey key{row.first.type, row.first.hashBytes, row.first.invite};
+        auto it = balances.find(key);
+        if (it == balances.end()) {
+            CAddressBalanceValue value;
+            if (!Read(std::make_pair(DB_ADDRESSBALANCEINDEX, key), value)) {
+                value.SetNull();
+            }
+            it = balances.emplace(key, value).first;
+        }
+
+        auto& value = it->second;
+        value.balance += sign * row.second;
+        if (row.second > 0) {
+            value.received += sign * row.second;
+        } else {
+            value.sent -= sign * row.second;
+        }
+
+        // A transaction is in a single block so it is counted once per batch
+        if (txs.emplace(key, row.first.txhash).second) {
+            value.txCount += sign;
+        }
+    }
+
+    for (const auto& balance : balances) {
+        if (balance.second.IsNull()) {
+            batch.Erase(std::make_pair(DB_ADDRESSBALANCEINDEX, balance.first));
+        } else {
+            batch.Write(std::make_pair(DB_ADDRESSBALANCEINDEX, balance.first), balance.second);
+        }
+    }
+    return true;
+}
+
+bool CBlockTreeDB::EraseAddressBalances() {
+    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+
+    const size_t batch_size = (size_t)gArgs.GetArg("-dbbatchsize", nDefaultDbBatchSize);
+    CDBBatch batch(*this);
+
+    pcursor->Seek(DB_ADDRESSBALANCEINDEX);
+
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        std::pair<char,CAddressBalanceKey> key;
+        if (!pcursor->GetKey(key) || key.first != DB_ADDRESSBALANCEINDEX) {
+            break;
+        }
+
+        batch.Erase(key);
+        if (batch.SizeEstimate() > batch_size) {
+            if (!WriteBatch(batch)) {
+                return error("failed to erase the balance index");
+            }
+            batch.Clear();
+        }
+        pcursor->Next();
+    }
+
+    batch.Write(std::make_pair(DB_FLAG, std::string{"balanceindex"}), '0');
+    return WriteBatch(batch, true);
+}
+
+bool CBlockTreeDB::BuildAddressBalances() {
+    if (!EraseAddressBalances()) {
+        return false;
+    }
+
+    LogPrintf("Building the balance index from the address index...\n");
+
+    leveldb::ReadOptions options;
+    options.fill_cache = false;
+    boost::scoped_ptr<CDBIterator> pcursor(NewIterator(options));
+
+    const size_t batch_size = (size_t)gArgs.GetArg("-dbbatchsize", nDefaultDbBatchSize);
+    CDBBatch batch(*this);
+    size_t addresses = 0;
+
+    // Rows are sorted by address, then height and position in the block, so
+    // the rows of an address and of each of its transactions are adjacent.
+    CAddressBalanceKey balance_key;
+    CAddressBalanceValue balance;
+    uint256 last_tx;
+
+    auto flush = [&]() {
+        if (balance.IsNull()) {
+            return;
+        }
+        batch.Write(std::make_pair(DB_ADDRESSBALANCEINDEX, balance_key), balance);
+        addresses++;
+    };
+
+    pcursor->Seek(DB_ADDRESSINDEX);
+
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        std::pair<char,CAddressIndexKey> key;
+        if (!pcursor->GetKey(key) || key.first != DB_ADDRESSINDEX) {
+            break;
+        }
+
+        CAmount amount;
+        if (!pcursor->GetValue(amount)) {
+            return error("failed to get address index value");
+        }
+
+        const CAddressBalanceKey row_key{key.second.type, key.second.hashBytes, key.second.invite};
+        if (row_key < balance_key || balance_key < row_key) {
+            flush();
+            balance_key = row_key;
+            balance.SetNull();
+            last_tx.SetNull();
+        }
+
+        balance.balance += amount;
+        if (amount > 0) {
+            balance.received += amount;
+        } else {
+            balance.sent -= amount;
+        }
+        if (balance.txCount == 0 || key.second.txhash != last_tx) {
+            balance.txCount++;
+            last_tx = key.second.txhash;
+        }
+
+        if (batch.SizeEstimate() > batch_size) {
+            if (!WriteBatch(batch)) {
+                return error("failed to build the balance index");
+            }
+            batch.Clear();
+        }
+        pcursor->Next();
+    }
+    flush();
+
+    batch.Write(std::make_pair(DB_FLAG, std::string{"balanceindex"}), '1');
+    if (!WriteBatch(batch, true)) {
+        return error("failed to build the balance index");
+    }
+
+    LogPrintf("Built the balance index of %u addresses\n", addresses);
+    return true;
+}
+
+bool CBlockTreeDB::SetBalanceIndex(bool enabled) {
+    bool built = false;
+    ReadFlag("balanceindex", built);
+
+    if (enabled && !built && !BuildAddressBalances()) {
+        return false;
+    }
+    if (!enabled && built) {
+        LogPrintf("Removing the balance index\n");
+        if (!EraseAddressBalances()) {
+            return false;
+        }
+    }
+
+    balance_index = enabled;
+    return true;
+}
+
+bool CBlockTreeDB::ReadAddressBalance(
+        uint160 addressHash,
+        unsigned int type,
+        bool invite,
+        CAddressBalanceValue& value) {
+
+    if (!balance_index) {
+        return false;
+    }
+
+    if (!Read(std::make_pair(DB_ADDRESSBALANCEINDEX, CAddressBalanceKey{type, addressHash, invite}), value)) {
+        value.SetNull();
+    }
+    return true;
+}
+
 bool CBlockTreeDB::WriteTimestampIndex(const CTimestampIndexKey &timestampIndex) {
     CDBBatch batch(*this);
     batch.Write(std::make_pair(DB_TIMESTAMPINDEX, timestampIndex), 0);
@@ -447,14 +649,100 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
+namespace {
+
+uint256 BlockIndexSeal(const uint256& key, const CBlockIndex& index)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << index.GetBlockHash() << index.GetBlockHeader();
+
+    uint256 seal;
+    CHMAC_SHA256(key.begin(), key.size())
+        .Write(reinterpret_cast<const unsigned char*>(ss.data()), ss.size())
+        .Finalize(seal.begin());
+    return seal;
+}
+
+}
+
 bool CBlockTreeDB::LoadBlockIndexGuts(
         const Consensus::Params& consensusParams,
-        std::function<CBlockIndex*(const uint256&)> insertBlockIndex)
+        std::function<CBlockIndex*(const uint256&)> insertBlockIndex,
+        const uint256* seal_key,
+        std::vector<CBlockIndex*>* trusted,
+        bool keep_cycles)
 {
     std::unique_ptr<CDBIterator> pcursor(NewIterator());
 
     pcursor->Seek(std::make_pair(DB_BLOCK_INDEX, uint256()));
 
+    // Seals are keyed by block hash like the index so both are read in
+    // step with a second cursor.
+    std::unique_ptr<CDBIterator> pseals(NewIterator());
+    pseals->Seek(std::make_pair(DB_BLOCK_INDEX_SEAL, uint256()));
+    auto find_seal = [&pseals](const uint256& hash, uint256& seal) {
+        std::pair<char, uint256> key;
+        while (pseals->Valid() && pseals->GetKey(key) && key.first == DB_BLOCK_INDEX_SEAL) {
+            if (hash < key.second) {
+                return false;
+            }
+            if (key.second == hash) {
+                return pseals->GetValue(seal);
+            }
+            pseals->Next();
+        }
+        return false;
+    };
+
+    size_t trusted_count = 0;
+    size_t broken_seals = 0;
+
+    // The proof-of-work of the loaded headers is verified in batches split
+    // over the verify thread pool.
+    std::vector<CBlockIndex*> pending;
+    std::vector<CCycle> pending_cycles;
+    cuckoo::PowChecks checks;
+    auto verify_pending = [&]() {
+        checks.clear();
+        for (size_t i = 0; i < pending.size(); i++) {
+            checks.push_back(cuckoo::PowCheck{
+                    pending[i]->GetBlockHash(),
+                    pending[i]->nBits,
+                    pending[i]->nEdgeBits,
+                    &pending_cycles[i]});
+        }
+
+        const auto failed = cuckoo::VerifyProofsOfWork(
+                checks, consensusParams, cuckoo::GetVerifyThreadPool());
+
+        if (failed < pending.size()) {
+            return error("LoadBlockIndexGuts: CheckProofOfWork failed: %s", pending[failed]->ToString());
+        }
+
+        if (seal_key) {
+            CDBBatch batch(*this);
+            for (const auto* pindex : pending) {
+                if (pindex->IsValid(BLOCK_VALID_TREE)) {
+                    batch.Write(
+                            std::make_pair(DB_BLOCK_INDEX_SEAL, pindex->GetBlockHash()),
+                            BlockIndexSeal(*seal_key, *pindex));
+                }
+            }
+            if (!WriteBatch(batch)) {
+                return error("LoadBlockIndexGuts: failed to write block index seals");
+            }
+        }
+
+        if (!keep_cycles) {
+            for (auto* pindex : pending) {
+                pindex->PruneCycle();
+            }
+        }
+        pending.clear();
+        pending_cycles.clear();
+        return true;
+    };
+
     // Load mapBlockIndex
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
@@ -477,15 +765,29 @@ bool CBlockTreeDB::LoadBlockIndexGuts(
                 pindexNew->nEdgeBits     = diskindex.nEdgeBits;
                 pindexNew->nStatus        = diskindex.nStatus;
                 pindexNew->nTx            = diskindex.nTx;
-                pindexNew->sCycle       = diskindex.sCycle;
-
-                if (!cuckoo::VerifyProofOfWork(
-                        pindexNew->GetBlockHash(),
-                        pindexNew->nBits,
-                        pindexNew->nEdgeBits,
-                        pindexNew->sCycle,
-                        consensusParams)) {
-                    return error("%s: CheckProofOfWork failed: %s", __func__, pindexNew->ToString());
+                pindexNew->cycle          = diskindex.cycle;
+
+                uint256 seal;
+                if (seal_key && pindexNew->IsValid(BLOCK_VALID_TREE) &&
+                        find_seal(pindexNew->GetBlockHash(), seal)) {
+                    if (seal == BlockIndexSeal(*seal_key, *pindexNew)) {
+                        if (trusted) {
+                            trusted->push_back(pindexNew);
+                        }
+                        if (!keep_cycles) {
+                            pindexNew->PruneCycle();
+                        }
+                        trusted_count++;
+                        pcursor->Next();
+                        continue;
+                    }
+                    broken_seals++;
+                }
+
+                pending.push_back(pindexNew);
+                pending_cycles.push_back(pindexNew->GetCycle());
+                if (pending.size() >= LOAD_INDEX_VERIFY_BATCH && !verify_pending()) {
+                    return false;
                 }
 
                 pcursor->Next();
@@ -497,9 +799,103 @@ bool CBlockTreeDB::LoadBlockIndexGuts(
         }
     }
 
+    if (!verify_pending()) {
+        return false;
+    }
+
+    if (seal_key) {
+        LogPrintf("%s: trusted the proof-of-work of %u sealed headers\n", __func__, trusted_count);
+    }
+    if (broken_seals > 0) {
+        LogPrintf("%s: WARNING: %u block index seals did not match. The block index was modified "
+                "on disk or the seal key changed. Those headers were verified again.\n",
+                __func__, broken_seals);
+    }
+
+    return true;
+}
+
+bool CBlockTreeDB::ReadBlockCycle(const uint256& hash, CCycle& cycle)
+{
+    {
+        LOCK(cs_cycle_cache);
+        const auto it = cycle_cache_index.find(hash);
+        if (it != cycle_cache_index.end()) {
+            cycle_cache.splice(cycle_cache.begin(), cycle_cache, it->second);
+            cycle = it->second->second;
+            return true;
+        }
+    }
+
+    CDiskBlockIndex diskindex;
+    if (!Read(std::make_pair(DB_BLOCK_INDEX, hash), diskindex)) {
+        return false;
+    }
+    cycle = diskindex.GetCycle();
+
+    LOCK(cs_cycle_cache);
+    if (cycle_cache_size == 0 || cycle_cache_index.count(hash)) {
+        return true;
+    }
+    if (cycle_cache.size() >= cycle_cache_size) {
+        cycle_cache_index.erase(cycle_cache.back().first);
+        cycle_cache.pop_back();
+    }
+    cycle_cache.emplace_front(hash, cycle);
+    cycle_cache_index.emplace(hash, cycle_cache.begin());
+
+    return true;
+}
+
+bool CBlockTreeDB::ReadBlockCycles(const std::vector<CBlockIndex*>& indexes, std::vector<CCycle>& cycles)
+{
+    leveldb::ReadOptions options;
+    options.fill_cache = false;
+    std::unique_ptr<CDBIterator> pcursor(NewIterator(options));
+    bool positioned = false;
+
+    cycles.clear();
+    cycles.reserve(indexes.size());
+    for (const auto* pindex : indexes) {
+        CCycle cycle;
+        if (pindex->cycle.Get(cycle)) {
+            cycles.push_back(cycle);
+            continue;
+        }
+
+        const uint256 hash = pindex->GetBlockHash();
+        std::pair<char, uint256> key;
+        // Entries read in key order are usually next to the previous one
+        if (positioned && pcursor->Valid()) {
+            pcursor->Next();
+        }
+        if (!positioned || !pcursor->Valid() || !pcursor->GetKey(key) ||
+                key.first != DB_BLOCK_INDEX || key.second != hash) {
+            pcursor->Seek(std::make_pair(DB_BLOCK_INDEX, hash));
+            positioned = true;
+        }
+
+        CDiskBlockIndex diskindex;
+        if (!pcursor->Valid() || !pcursor->GetKey(key) ||
+                key.first != DB_BLOCK_INDEX || key.second != hash ||
+                !pcursor->GetValue(diskindex)) {
+            return error("%s: failed to read the cycle of block %s", __func__, hash.ToString());
+        }
+        cycles.push_back(diskindex.GetCycle());
+    }
     return true;
 }
 
+void CBlockTreeDB::SetCycleCacheSize(size_t size)
+{
+    LOCK(cs_cycle_cache);
+    cycle_cache_size = size;
+    while (cycle_cache.size() > cycle_cache_size) {
+        cycle_cache_index.erase(cycle_cache.back().first);
+        cycle_cache.pop_back();
+    }
+}
+
 namespace {
 
 //! Legacy class to deserialize pre-pertxout database entries without reindex.
@@ -642,64 +1038,96 @@ bool CBlockTreeDB::WriteReferralIndex(const std::vector<std::pair<uint256, CDisk
     return WriteBatch(batch);
 }
 
-bool CBlockTreeDB::CacheAllUnspent()
+bool CBlockTreeDB::PurgeSpentUnspent()
 {
+    bool purged = false;
+    if (ReadFlag("purgedspentunspent", purged) && purged) {
+        return true;
+    }
+
+    LogPrintf("Removing spent outputs from the address unspent index...\n");
+
     leveldb::ReadOptions options;
     options.fill_cache = false;
     boost::scoped_ptr<CDBIterator> pcursor(NewIterator(options));
 
-    pcursor->Seek(DB_SPENTINDEX);
+    const size_t batch_size = (size_t)gArgs.GetArg("-dbbatchsize", nDefaultDbBatchSize);
+    CDBBatch batch(*this);
+    size_t removed = 0;
+
+    pcursor->Seek(DB_ADDRESSUNSPENTINDEX);
 
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
-        std::pair<char,CSpentIndexKey> key;
-        if (pcursor->GetKey(key) && key.first == DB_SPENTINDEX)  {
-            CSpentIndexValue value;
-            if (pcursor->GetValue(value) && !value.IsNull()) {
-                spent_cache.insert(key.second);
-            } else {
-                return error("failed to get spent value");
+        std::pair<char,CAddressUnspentKey> key;
+        if (!pcursor->GetKey(key) || key.first != DB_ADDRESSUNSPENTINDEX) {
+            break;
+        }
+
+        if (Exists(std::make_pair(DB_SPENTINDEX, CSpentIndexKey{key.second.txhash, key.second.index}))) {
+            LogPrint(BCLog::COINDB, "Removing unspent %s:%d because it is in the spent index\n",
+                    key.second.txhash.GetHex(), key.second.index);
+            batch.Erase(key);
+            removed++;
+        }
+
+        if (batch.SizeEstimate() > batch_size) {
+            if (!WriteBatch(batch)) {
+                return error("failed to remove spent outputs from the address unspent index");
             }
+            batch.Clear();
         }
         pcursor->Next();
     }
 
+    batch.Write(std::make_pair(DB_FLAG, std::string{"purgedspentunspent"}), '1');
+    if (!WriteBatch(batch, true)) {
+        return error("failed to remove spent outputs from the address unspent index");
+    }
+
+    LogPrintf("Removed %u spent outputs from the address unspent index\n", removed);
+    return true;
+}
+
+bool CBlockTreeDB::CacheAllUnspent(const uint256& best_block)
+{
+    if (!PurgeSpentUnspent()) {
+        return false;
+    }
+
+    const int64_t start = GetTimeMillis();
+    if (!best_block.IsNull() &&
+            ReadUnspentSnapshot(GetDataDir() / UNSPENT_SNAPSHOT_FILENAME, best_block, unspent_cache)) {
+        LogPrintf("Loaded %u address unspent outputs from snapshot in %dms\n",
+                unspent_cache.Size(), GetTimeMillis() - start);
+        return true;
+    }
+
+    leveldb::ReadOptions options;
+    options.fill_cache = false;
+    boost::scoped_ptr<CDBIterator> pcursor(NewIterator(options));
+
     pcursor->Seek(DB_ADDRESSUNSPENTINDEX);
 
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
         std::pair<char,CAddressUnspentKey> key;
-        if (pcursor->GetKey(key) && key.first == DB_ADDRESSUNSPENTINDEX)  {
-            CSpentIndexKey spent_key{key.second.txhash, key.second.index};
-            if(spent_cache.count(spent_key) > 0) {
-                LogPrintf("Skipping unspent %s:%d because it is in the spent index\n",
-                        key.second.txhash.GetHex(), key.second.index);
-
-                pcursor->Next();
-                continue;
-            }
+        if (!pcursor->GetKey(key) || key.first != DB_ADDRESSUNSPENTINDEX) {
+            break;
+        }
 
-            CAddressUnspentValue value;
-            if (pcursor->GetValue(value)) {
-                unspent_cache.push_back(std::make_pair(key.second, value));
-            } else {
-                return error("failed to get address unspent value");
-            }
+        CAddressUnspentValue value;
+        if (pcursor->GetValue(value)) {
+            unspent_cache.Add(key.second, value);
+        } else {
+            return error("failed to get address unspent value");
         }
         pcursor->Next();
     }
-    return true;
-}
 
-void CBlockTreeDB::EraseFromUnspentCache(const RemoveUnspentSet& to_remove)
-{
-    unspent_cache.erase(std::remove_if(unspent_cache.begin(), unspent_cache.end(),
-                [&to_remove](const UnspentPair& a) {
-                   return to_remove.count(a.first);  
-                }), unspent_cache.end());
+    LogPrintf("Cached %u address unspent outputs using %.1fMiB in %dms\n",
+            unspent_cache.Size(), unspent_cache.DynamicMemoryUsage() * (1.0 / (1 << 20)),
+            GetTimeMillis() - start);
+    return true;
 }
 
-void CBlockTreeDB::AddToUnspentCache(const UnspentPair& p)
-{
-    unspent_cache.push_back(p);
-}
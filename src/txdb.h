@@ -11,9 +11,13 @@
 #include "dbwrapper.h"
 #include "chain.h"
 #include "addressindex.h"
+#include "addressunspentcache.h"
 #include "spentindex.h"
+#include "sync.h"
 #include "timestampindex.h"
 
+#include <future>
+#include <list>
 #include <map>
 #include <string>
 #include <utility>
@@ -33,8 +37,6 @@ static constexpr int MAX_BLOCK_COINSDB_USAGE = 200 * DB_PEAK_USAGE_FACTOR;
 static constexpr int MIN_BLOCK_COINSDB_USAGE = 50 * DB_PEAK_USAGE_FACTOR;
 //! -dbcache default (MiB)
 static const int64_t nDefaultDbCache = 1024;
-//! -dbbatchsize default (bytes)
-static const int64_t nDefaultDbBatchSize = 16 << 20;
 //! max. -dbcache (MiB)
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 16384 : 1024;
 //! min. -dbcache (MiB)
@@ -49,6 +51,10 @@ static const int64_t nMaxBlockDBAndTxIndexCache = 1024;
 static const int64_t nMaxCoinsDBCache = 300;
 //! Max memory allocated to referral DB specific cache (MiB)
 static const int64_t nMaxReferralDBCache = 200;
+//! -cyclecache default (cycles)
+static const unsigned int DEFAULT_CYCLE_CACHE_SIZE = 4096;
+//! Snapshot of the address unspent cache in the data directory
+static const char* const UNSPENT_SNAPSHOT_FILENAME = "unspentcache.dat";
 
 extern const char DB_ADDRESSUNSPENTINDEX;
 
@@ -119,11 +125,6 @@ private:
     friend class CCoinsViewDB;
 };
 
-using UnspentPair = std::pair<CAddressUnspentKey, CAddressUnspentValue>;
-using UnspentCache = std::vector<UnspentPair>;
-using RemoveUnspentSet = std::set<CAddressUnspentKey>;
-using SpentCache = std::set<CSpentIndexKey>;
-
 /** Access to the block database (blocks/index/) */
 class CBlockTreeDB : public CDBWrapper
 {
@@ -133,14 +134,46 @@ private:
     CBlockTreeDB(const CBlockTreeDB&);
     void operator=(const CBlockTreeDB&);
 
-    void EraseFromUnspentCache(const RemoveUnspentSet& p);
-    void AddToUnspentCache(const UnspentPair& p);
+    CAddressUnspentCache unspent_cache;
+
+    /**
+     * Older versions failed to remove some spent outputs from the address
+     * unspent index. Removes every output the spent index has as spent, once.
+     */
+    bool PurgeSpentUnspent();
+
+    //! Whether the address index writes keep the balance index up to date
+    bool balance_index = false;
 
-    UnspentCache unspent_cache;
-    SpentCache spent_cache;
+    /**
+     * Adds the rows to the totals of their addresses in the balance index,
+     * or subtracts them if erase is set. Rows already in the address index,
+     * or already gone from it if erasing, are skipped so connecting a block
+     * twice, as -reindex-chainstate does, does not count it twice.
+     */
+    bool UpdateAddressBalances(
+            CDBBatch& batch,
+            const std::vector<std::pair<CAddressIndexKey, CAmount> >& vect,
+            bool erase);
+
+    /** Rebuilds the balance index from the address index */
+    bool BuildAddressBalances();
+    bool EraseAddressBalances();
+
+    //! Cycles read by ReadBlockCycle, most recently used first
+    using CycleCacheEntry = std::pair<uint256, CCycle>;
+    CCriticalSection cs_cycle_cache;
+    size_t cycle_cache_size = DEFAULT_CYCLE_CACHE_SIZE;
+    std::list<CycleCacheEntry> cycle_cache;
+    std::map<uint256, std::list<CycleCacheEntry>::iterator> cycle_cache_index;
 
 public:
-    bool CacheAllUnspent();
+    /**
+     * Loads the address unspent cache from its snapshot if it was written at
+     * best_block, otherwise from the address unspent index.
+     */
+    bool CacheAllUnspent(const uint256& best_block);
+    const CAddressUnspentCache& GetUnspentCache() const { return unspent_cache; }
 
     bool WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo);
     bool ReadBlockFileInfo(int nFile, CBlockFileInfo &fileinfo);
@@ -165,9 +198,47 @@ public:
         bool ReadAllAddressUnspent(
                 bool invite,
                 F process) {
-            assert(!unspent_cache.empty());
-            for(const auto& unspent : unspent_cache) { 
-                process(unspent.first, unspent.second);
+            const auto snapshot = unspent_cache.GetSnapshot();
+            for (const auto& shard : snapshot) {
+                for (const auto& unspent : *shard) {
+                    process(unspent.first, unspent.second);
+                }
+            }
+            return true;
+        }
+
+    /**
+     * Splits the shards of the unspent outputs into contiguous partitions and
+     * calls process(partition, key, value) for each one concurrently on the
+     * pool. Partitions are numbered in order so concatenating the results of
+     * each partition gives the same order as the sequential scan above.
+     */
+    template<class Pool, class F>
+        bool ReadAllAddressUnspent(
+                Pool& pool,
+                size_t partitions,
+                F process) {
+            assert(partitions > 0);
+
+            const auto snapshot = unspent_cache.GetSnapshot();
+            const auto size = snapshot.size();
+
+            std::vector<std::future<void>> jobs;
+            jobs.reserve(partitions);
+            for (size_t p = 0; p < partitions; p++) {
+                const auto begin = size * p / partitions;
+                const auto end = size * (p + 1) / partitions;
+                jobs.push_back(pool.push([&snapshot, p, begin, end, &process](int id) {
+                    for (size_t s = begin; s < end; s++) {
+                        for (const auto& unspent : *snapshot[s]) {
+                            process(p, unspent.first, unspent.second);
+                        }
+                    }
+                }));
+            }
+
+            for (auto& j : jobs) {
+                j.wait();
             }
             return true;
         }
@@ -181,15 +252,59 @@ public:
             std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex,
             int start = 0,
             int end = 0);
+
+    /**
+     * Enables or disables the balance index. Enabling it builds it from the
+     * address index unless it was enabled when the node last ran. Disabling
+     * it removes it.
+     */
+    bool SetBalanceIndex(bool enabled);
+
+    /** Returns false if the balance index is disabled */
+    bool ReadAddressBalance(
+            uint160 addressHash,
+            unsigned int type,
+            bool invite,
+            CAddressBalanceValue& value);
+
     bool WriteTimestampIndex(const CTimestampIndexKey &timestampIndex);
     bool ReadTimestampIndex(const unsigned int &high, const unsigned int &low, const bool fActiveOnly, std::vector<std::pair<uint256, unsigned int> > &vect);
     bool WriteTimestampBlockIndex(const CTimestampBlockIndexKey &blockhashIndex, const CTimestampBlockIndexValue &logicalts);
     bool ReadTimestampBlockIndex(const uint256 &hash, unsigned int &logicalTS);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
+
+    /**
+     * Loads the block index and verifies the proof-of-work of its headers.
+     * Given a seal key, valid headers sealed with it by an earlier load are
+     * trusted instead and added to trusted. The headers verified now are
+     * sealed. A seal is an HMAC of the header so the index cannot be
+     * modified on disk without the key.
+     *
+     * Unless keep_cycles is set the cycles of the loaded entries are pruned
+     * from memory once they are checked.
+     */
     bool LoadBlockIndexGuts(
             const Consensus::Params& consensusParams,
-            std::function<CBlockIndex*(const uint256&)> insertBlockIndex);
+            std::function<CBlockIndex*(const uint256&)> insertBlockIndex,
+            const uint256* seal_key = nullptr,
+            std::vector<CBlockIndex*>* trusted = nullptr,
+            bool keep_cycles = true);
+
+    /**
+     * Reads the cuckoo cycle of a block index entry. The most recently read
+     * cycles are cached so serving headers of buried blocks stays cheap.
+     */
+    bool ReadBlockCycle(const uint256& hash, CCycle& cycle);
+    void SetCycleCacheSize(size_t size);
+
+    /**
+     * Reads the cycles of many entries at once, such as every trusted
+     * header. Cycles pruned from memory are read with a single cursor
+     * that bypasses the cycle cache so a scan does not evict the cycles
+     * of recent headers. Entries in key order are read sequentially.
+     */
+    bool ReadBlockCycles(const std::vector<CBlockIndex*>& indexes, std::vector<CCycle>& cycles);
 
     // Referrals
     bool ReadReferralIndex(const uint256 &txid, CDiskTxPos &pos);
@@ -15,6 +15,7 @@
 #include "consensus/ref_verify.h"
 #include "consensus/tx_verify.h"
 #include "consensus/validation.h"
+#include "ctpl/ctpl.h"
 #include "cuckoocache.h"
 #include "fs.h"
 #include "hash.h"
@@ -58,6 +59,7 @@
 
 #include <algorithm>
 #include <atomic>
+#include <future>
 #include <sstream>
 #include <numeric>
 
@@ -66,6 +68,11 @@
 #include <boost/thread.hpp>
 #include <cctype>
 
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+
 #if defined(NDEBUG)
 # error "Merit cannot be compiled without assertions."
 #endif
@@ -93,6 +100,7 @@ bool fPruneMode = false;
 bool fIsBareMultisigStd = DEFAULT_PERMIT_BAREMULTISIG;
 bool fRequireStandard = true;
 bool fCheckBlockIndex = false;
+bool fCheckCGS = false;
 bool fCheckpointsEnabled = DEFAULT_CHECKPOINTS_ENABLED;
 size_t nCoinCacheUsage = 5000 * 300;
 uint64_t nPruneTarget = 0;
@@ -180,6 +188,9 @@ namespace
     /** Dirty block file entries. */
     std::set<int> setDirtyFileInfo;
 
+    /** CGS snapshot of the tip, reset whenever the tip changes. */
+    CGSSnapshotPtr g_cgs_snapshot;
+
     FILE* OpenDiskFile(const CDiskBlockPos &pos, const char *prefix, bool fReadOnly)
     {
         if (pos.IsNull())
@@ -1581,6 +1592,139 @@ bool GetAddressUnspent(
     return true;
 }
 
+bool GetAddressBalance(
+        uint160 addressHash,
+        unsigned int type,
+        bool invite,
+        CAddressBalanceValue& balance)
+{
+    return pblocktree->ReadAddressBalance(addressHash, type, invite, balance);
+}
+
+namespace
+{
+ctpl::thread_pool g_address_index_pool;
+
+// Heights scanned by one job at least when an address is split into ranges.
+// Each range costs a seek so splitting short ranges does not pay off.
+const int MIN_ADDRESS_INDEX_RANGE = 1000;
+
+struct AddressIndexJob
+{
+    const AddressQuery* query;
+    int start;
+    int end;
+};
+
+/**
+ * Runs read(job, results) for each job on the address index pool and
+ * appends the results in job order. Runs the jobs in place if there is
+ * only one or the pool has no threads.
+ */
+template <typename Job, typename Result, typename Read>
+bool ReadAddressJobs(const std::vector<Job>& jobs, std::vector<Result>& results, Read read)
+{
+    if (jobs.size() < 2 || g_address_index_pool.size() == 0) {
+        for (const auto& job : jobs) {
+            if (!read(job, results)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::vector<std::vector<Result>> job_results(jobs.size());
+    std::vector<std::future<bool>> futures;
+    futures.reserve(jobs.size());
+    for (size_t j = 0; j < jobs.size(); j++) {
+        futures.push_back(g_address_index_pool.push([&jobs, &job_results, &read, j](int) {
+            return read(jobs[j], job_results[j]);
+        }));
+    }
+
+    // Every job refers to job_results so all must finish before any
+    // exception is rethrown.
+    for (auto& f : futures) {
+        f.wait();
+    }
+
+    bool ok = true;
+    size_t total = results.size();
+    for (auto& f : futures) {
+        ok &= f.get();
+    }
+    if (!ok) {
+        return false;
+    }
+
+    for (const auto& r : job_results) {
+        total += r.size();
+    }
+    results.reserve(total);
+    for (auto& r : job_results) {
+        std::move(r.begin(), r.end(), std::back_inserter(results));
+    }
+    return true;
+}
+}
+
+void SetupAddressIndexThreadPool(size_t threads)
+{
+    g_address_index_pool.resize(threads);
+}
+
+bool GetAddressIndex(
+        const AddressQueries& queries,
+        KeyActivity& addressIndex,
+        int start,
+        int end)
+{
+    if (queries.empty()) {
+        return true;
+    }
+
+    // With fewer addresses than threads the heights of each address are
+    // split into ranges so every thread has something to scan. The last
+    // range is open if end is so blocks connected meanwhile are included.
+    const int threads = g_address_index_pool.size();
+    int ranges = 1;
+    int last = end;
+    if (static_cast<int>(queries.size()) < threads) {
+        if (last <= 0) {
+            LOCK(cs_main);
+            last = chainActive.Height();
+        }
+        const int heights = last - start + 1;
+        ranges = std::max(1, std::min(threads / static_cast<int>(queries.size()),
+                    heights / MIN_ADDRESS_INDEX_RANGE));
+    }
+
+    std::vector<AddressIndexJob> jobs;
+    jobs.reserve(queries.size() * ranges);
+    for (const auto& query : queries) {
+        for (int r = 0; r < ranges; r++) {
+            const int64_t heights = last - start + 1;
+            const int range_start = start + heights * r / ranges;
+            const int range_end = r + 1 < ranges ? start + heights * (r + 1) / ranges - 1 : end;
+            jobs.push_back(AddressIndexJob{&query, range_start, range_end});
+        }
+    }
+
+    return ReadAddressJobs(jobs, addressIndex, [](const AddressIndexJob& job, KeyActivity& result) {
+        const auto& q = *job.query;
+        return GetAddressIndex(q.addressHash, q.type, q.invite, result, job.start, job.end);
+    });
+}
+
+bool GetAddressUnspent(
+        const AddressQueries& queries,
+        AddressUnspentIndex& unspentOutputs)
+{
+    return ReadAddressJobs(queries, unspentOutputs, [](const AddressQuery& q, AddressUnspentIndex& result) {
+        return GetAddressUnspent(q.addressHash, q.type, q.invite, result);
+    });
+}
+
 /** Return transaction in txOut, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetTransaction(
         const uint256 &hash,
@@ -1981,6 +2125,16 @@ std::pair<pog::AmbassadorLottery, pog2::AddressSelectorPtr> Pog2RewardAmbassador
 
     max_ambassador_lottery = std::max(max_ambassador_lottery, entrants.size());
 
+    return Pog2RewardAmbassadors(height, previous_block_hash, total, params, entrants);
+}
+
+std::pair<pog::AmbassadorLottery, pog2::AddressSelectorPtr> Pog2RewardAmbassadors(
+        int height,
+        const uint256& previous_block_hash,
+        CAmount total,
+        const Consensus::Params& params,
+        const pog2::Entrants& entrants)
+{
     // Wallet selector will create a distribution from all the keys
     auto selector = std::make_shared<pog2::AddressSelector>(height, entrants, params);
 
@@ -2056,6 +2210,67 @@ std::pair<pog::AmbassadorLottery, pog2::AddressSelectorPtr> Pog2RewardAmbassador
     return std::make_pair(rewards, selector);
 }
 
+bool SameEntrants(const pog3::Entrants& a, const pog3::Entrants& b)
+{
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(),
+            [](const pog3::Entrant& x, const pog3::Entrant& y) {
+                return x.address_type == y.address_type &&
+                    x.address == y.address &&
+                    x.balance == y.balance &&
+                    x.aged_balance == y.aged_balance &&
+                    x.cgs == y.cgs &&
+                    x.beacon_height == y.beacon_height &&
+                    x.children == y.children &&
+                    x.network_size == y.network_size;
+            });
+}
+
+void GetPog3Entrants(
+        pog3::CGSContext& context,
+        const uint256& block_hash,
+        int height,
+        const Consensus::Params& params,
+        pog3::Entrants& entrants)
+{
+    AssertLockHeld(cs_main);
+    assert(prefviewcache);
+    context.cgs_pool = pog3::GetCgsThreadPool();
+
+    // The state can only be built for the chain the databases are at. Other
+    // blocks, like a lottery simulated with an arbitrary seed, are computed
+    // in full without touching the state.
+    if (!chainActive.Tip() || chainActive.Tip()->GetBlockHash() != block_hash) {
+        pog3::GetAllRewardableEntrants(context, *prefviewcache, params, height, entrants);
+        return;
+    }
+
+    auto& state = pog3::GetCgsState();
+    if (!state.IsSynced(block_hash) && !state.Rebuild(*prefviewcache, params, block_hash)) {
+        LogPrintf("%s: unable to build CGS state, falling back to full computation\n", __func__);
+        pog3::GetAllRewardableEntrants(context, *prefviewcache, params, height, entrants);
+        return;
+    }
+
+    pog3::GetAllRewardableEntrants(context, state, *prefviewcache, params, height, entrants);
+
+    if (!fCheckCGS) {
+        return;
+    }
+
+    pog3::Entrants full_entrants;
+    pog3::CGSContext full_context;
+    full_context.cgs_pool = context.cgs_pool;
+    pog3::GetAllRewardableEntrants(full_context, *prefviewcache, params, height, full_entrants);
+
+    if (!SameEntrants(entrants, full_entrants)) {
+        LogPrintf("%s: ERROR: incremental CGS state at %s does not match full computation (%d vs %d entrants)\n",
+                __func__, block_hash.GetHex(), entrants.size(), full_entrants.size());
+        state.Invalidate();
+        context = std::move(full_context);
+        entrants = std::move(full_entrants);
+    }
+}
+
 std::pair<pog::AmbassadorLottery, pog3::AddressSelectorPtr> Pog3RewardAmbassadors(
         int height,
         const uint256& previous_block_hash,
@@ -2077,12 +2292,20 @@ std::pair<pog::AmbassadorLottery, pog3::AddressSelectorPtr> Pog3RewardAmbassador
     entrants.reserve(reserve_size);
 
     pog3::CGSContext context;
-    context.cgs_pool = pog3::GetCgsThreadPool();
-
-    pog3::GetAllRewardableEntrants(context, *prefviewcache, params, height, entrants);
+    GetPog3Entrants(context, previous_block_hash, height, params, entrants);
 
     max_ambassador_lottery = std::max(max_ambassador_lottery, entrants.size());
 
+    return Pog3RewardAmbassadors(height, previous_block_hash, total, params, entrants);
+}
+
+std::pair<pog::AmbassadorLottery, pog3::AddressSelectorPtr> Pog3RewardAmbassadors(
+        int height,
+        const uint256& previous_block_hash,
+        CAmount total,
+        const Consensus::Params& params,
+        const pog3::Entrants& entrants)
+{
     // Wallet selector will create a distribution from all the keys
     auto selector = std::make_shared<pog3::AddressSelector>(height, entrants, params);
 
@@ -3189,16 +3412,7 @@ bool GetDebitsAndCredits(DebitsAndCredits& debits_and_credits, const CTransactio
 bool UpdateANV(const DebitsAndCredits& debits_and_credits)
 {
     //apply the debit and credits to the addresses in the block transactions.
-    for (const auto& t : debits_and_credits) {
-        const auto addressType = std::get<0>(t);
-        const auto& address = std::get<1>(t);
-        const auto amount = std::get<2>(t);
-        if (!prefviewdb->UpdateANV(addressType, address, amount)) {
-            return false;
-        }
-    }
-
-    return true;
+    return prefviewdb->UpdateANV(debits_and_credits);
 }
 
 bool UpdateANV(const CBlock& block, CCoinsViewCache& view) {
@@ -3675,6 +3889,12 @@ static DisconnectResult DisconnectBlock(
     // move best block pointer to prevout block
     view.SetBestBlock(pindex->pprev->GetBlockHash());
 
+    pog3::GetCgsState().DisconnectBlock(
+            pindex->GetBlockHash(),
+            pindex->pprev->GetBlockHash(),
+            block.m_vRef,
+            addressUnspentIndex);
+
     return fClean ? DISCONNECT_OK : DISCONNECT_UNCLEAN;
 }
 
@@ -4761,6 +4981,13 @@ static bool ConnectBlock(
     // add this block to the view's block chain
     view.SetBestBlock(pindex->GetBlockHash());
 
+    pog3::GetCgsState().ConnectBlock(
+            hashPrevBlock,
+            pindex->GetBlockHash(),
+            pindex->nHeight,
+            ordered_referrals,
+            addressUnspentIndex);
+
     int64_t nTime8 = GetTimeMicros();
     nTimeIndex += nTime8 - nTime7;
     LogPrint(BCLog::BENCH, "    - Index writing: %.2fms [%.2fs (%.2fms/blk)]\n",
@@ -4778,6 +5005,30 @@ static bool ConnectBlock(
     return true;
 }
 
+/** Blocks buried deeper than this only keep their cycle on disk. 0 keeps all. */
+static int nCycleDepth = 0;
+/** Height of the active chain up to which cycles were pruned */
+static int nCyclesPrunedHeight = -1;
+
+/** Drops the cycles of the newly buried blocks of the active chain from memory */
+static void PruneBlockIndexCycles()
+{
+    AssertLockHeld(cs_main);
+    if (nCycleDepth <= 0) {
+        return;
+    }
+
+    const int height = chainActive.Height() - nCycleDepth;
+    for (int h = nCyclesPrunedHeight + 1; h <= height; h++) {
+        CBlockIndex* pindex = chainActive[h];
+        // Only entries already written to the block tree DB can be pruned
+        if (!setDirtyBlockIndex.count(pindex)) {
+            pindex->PruneCycle();
+        }
+    }
+    nCyclesPrunedHeight = std::max(nCyclesPrunedHeight, height);
+}
+
 /**
  * Update the on-disk chain state.
  * The caches and indexes are flushed depending on the mode we're called with
@@ -4866,6 +5117,7 @@ bool static FlushStateToDisk(const CChainParams& chainparams, CValidationState &
                 if (!pblocktree->WriteBatchSync(vFiles, nLastBlockFile, vBlocks)) {
                     return AbortNode(state, "Failed to write to block index database");
                 }
+                PruneBlockIndexCycles();
             }
             // Finally remove any pruned files
             if (fFlushForPrune)
@@ -4881,6 +5133,10 @@ bool static FlushStateToDisk(const CChainParams& chainparams, CValidationState &
             // overwrite one. Still, use a conservative safety factor of 2.
             if (!CheckDiskSpace(48 * 2 * 2 * pcoinsTip->GetCacheSize()))
                 return state.Error("out of disk space");
+            // The lottery heap is written before the chainstate so the coins
+            // best block never moves past a heap that is not on disk yet.
+            if (!prefviewdb->FlushLottery())
+                return AbortNode(state, "Failed to write to referral database");
             // Flush the chainstate (which may refer to block index entries).
             if (!pcoinsTip->Flush())
                 return AbortNode(state, "Failed to write to coin database");
@@ -4925,6 +5181,13 @@ static void DoWarning(const std::string& strWarning)
 void static UpdateTip(CBlockIndex *pindexNew, const CChainParams& chainParams) {
     chainActive.SetTip(pindexNew);
 
+    // Blocks connected above the fork point after a disconnect keep their
+    // cycles in memory until they are buried deep enough to be pruned again.
+    nCyclesPrunedHeight = std::min(nCyclesPrunedHeight, chainActive.Height());
+
+    // The CGS snapshot is computed again for the new tip when next asked for.
+    std::atomic_store(&g_cgs_snapshot, CGSSnapshotPtr{});
+
     // New best block
     mempool.AddTransactionsUpdated(1);
 
@@ -6279,11 +6542,44 @@ static bool AcceptBlockHeader(
 // Exposed wrapper for AcceptBlockHeader
 bool ProcessNewBlockHeaders(const std::vector<CBlockHeader>& headers, CValidationState& state, const CChainParams& chainparams, const CBlockIndex** ppindex)
 {
+    // Headers we already have are not checked again when they are accepted,
+    // so only verify the new ones. Otherwise a peer could make us solve the
+    // same proofs of work over and over by resending headers we know.
+    std::vector<uint256> hashes;
+    hashes.reserve(headers.size());
+    for (const CBlockHeader& header : headers) {
+        hashes.push_back(header.GetHash());
+    }
+
+    std::vector<size_t> unknown;
+    {
+        LOCK(cs_main);
+        for (size_t i = 0; i < headers.size(); i++) {
+            if (mapBlockIndex.count(hashes[i]) == 0) {
+                unknown.push_back(i);
+            }
+        }
+    }
+
+    // Verify the proof-of-work of the new headers in parallel without holding
+    // cs_main. Headers from the first failure on are checked again when they
+    // are accepted so that the failure is reported the same way.
+    cuckoo::PowChecks checks;
+    checks.reserve(unknown.size());
+    for (const size_t i : unknown) {
+        const CBlockHeader& header = headers[i];
+        checks.push_back(cuckoo::PowCheck{hashes[i], header.nBits, header.nEdgeBits, &header.sCycle});
+    }
+    const size_t pow_verified = cuckoo::VerifyProofsOfWork(
+            checks, chainparams.GetConsensus(), cuckoo::GetVerifyThreadPool());
+    const size_t first_unverified =
+        pow_verified < unknown.size() ? unknown[pow_verified] : headers.size();
+
     {
         LOCK(cs_main);
-        for (const CBlockHeader& header : headers) {
+        for (size_t i = 0; i < headers.size(); i++) {
             CBlockIndex *pindex = nullptr; // Use a temp pindex instead of ppindex to avoid a const_cast
-            if (!AcceptBlockHeader(header, state, chainparams, &pindex)) {
+            if (!AcceptBlockHeader(headers[i], state, chainparams, &pindex, i >= first_unverified)) {
                 return false;
             }
             if (ppindex) {
@@ -6657,9 +6953,74 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
     return pindexNew;
 }
 
+bool ReadBlockIndexCycle(const uint256& hash, CCycle& cycle)
+{
+    return pblocktree && pblocktree->ReadBlockCycle(hash, cycle);
+}
+
+/** Headers whose proof-of-work was trusted when loading the block index */
+static std::vector<CBlockIndex*> vTrustedBlockIndex;
+
+/** Reads the key of the block index seals, creating it on first use */
+static bool GetBlockIndexSealKey(uint256& key)
+{
+    fs::path path(gArgs.GetArg("-blockindexkey", DEFAULT_BLOCK_INDEX_KEY_FILE));
+    if (!path.is_complete()) path = GetDataDir() / path;
+
+    CAutoFile filein(fsbridge::fopen(path, "rb"), SER_DISK, CLIENT_VERSION);
+    if (!filein.IsNull()) {
+        try {
+            filein >> key;
+            return true;
+        } catch (const std::exception& e) {
+            return error("%s: failed to read %s: %s", __func__, path.string(), e.what());
+        }
+    }
+
+    GetStrongRandBytes(key.begin(), key.size());
+
+#ifndef WIN32
+    // Only the owner may read the key whatever the umask or -sysperms are
+    FILE* file = nullptr;
+    const int fd = open(path.string().c_str(), O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    if (fd >= 0) {
+        file = fdopen(fd, "wb");
+        if (!file) {
+            close(fd);
+        }
+    }
+#else
+    FILE* file = fsbridge::fopen(path, "wb");
+#endif
+
+    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+    if (fileout.IsNull()) {
+        return error("%s: failed to create %s", __func__, path.string());
+    }
+    fileout << key;
+    FileCommit(fileout.Get());
+
+    return true;
+}
+
 bool static LoadBlockIndexDB(const CChainParams& chainparams)
 {
-    if (!pblocktree->LoadBlockIndexGuts(chainparams.GetConsensus(), InsertBlockIndex))
+    uint256 seal_key;
+    const bool trust = gArgs.GetBoolArg("-trustblockindex", DEFAULT_TRUST_BLOCK_INDEX);
+    if (trust && !GetBlockIndexSealKey(seal_key))
+        return false;
+
+    // With cycle pruning the loaded entries keep their cycles on disk only
+    pblocktree->SetCycleCacheSize(gArgs.GetArg("-cyclecache", DEFAULT_CYCLE_CACHE_SIZE));
+    nCycleDepth = gArgs.GetArg("-cycledepth", DEFAULT_CYCLE_DEPTH);
+
+    vTrustedBlockIndex.clear();
+    if (!pblocktree->LoadBlockIndexGuts(
+                chainparams.GetConsensus(),
+                InsertBlockIndex,
+                trust ? &seal_key : nullptr,
+                &vTrustedBlockIndex,
+                nCycleDepth <= 0))
         return false;
 
     boost::this_thread::interruption_point();
@@ -6702,6 +7063,13 @@ bool static LoadBlockIndexDB(const CChainParams& chainparams)
             pindexBestHeader = pindex;
     }
 
+    // Only the cycles of blocks added from now on are pruned as they are
+    // buried
+    nCyclesPrunedHeight = -1;
+    if (nCycleDepth > 0 && !vSortedByHeight.empty()) {
+        nCyclesPrunedHeight = vSortedByHeight.back().first;
+    }
+
     // Load block file info
     pblocktree->ReadLastBlockFile(nLastBlockFile);
     vinfoBlockFile.resize(nLastBlockFile + 1);
@@ -6750,6 +7118,80 @@ bool static LoadBlockIndexDB(const CChainParams& chainparams)
     return true;
 }
 
+bool ReverifyBlockIndex(const std::vector<CBlockIndex*>& trusted, const CBlockIndex*& invalid)
+{
+    invalid = nullptr;
+
+    // The proof-of-work fields of a block index never change so they are
+    // read without cs_main. Cycles are copied since they may be pruned.
+    // Those not in memory are read with one cursor past the cycle cache.
+    const size_t batch_size = 4096;
+    const auto& params = Params().GetConsensus();
+    cuckoo::PowChecks checks;
+    std::vector<CCycle> cycles;
+    for (size_t b = 0; b < trusted.size(); b += batch_size) {
+        boost::this_thread::interruption_point();
+
+        const size_t end = std::min(trusted.size(), b + batch_size);
+        checks.clear();
+        const std::vector<CBlockIndex*> batch{trusted.begin() + b, trusted.begin() + end};
+        if (!pblocktree->ReadBlockCycles(batch, cycles)) {
+            return error("%s: failed to read the cycles of trusted headers", __func__);
+        }
+        for (size_t i = b; i < end; i++) {
+            const CBlockIndex* pindex = trusted[i];
+            checks.push_back(cuckoo::PowCheck{
+                    pindex->GetBlockHash(),
+                    pindex->nBits,
+                    pindex->nEdgeBits,
+                    &cycles[i - b]});
+        }
+
+        const size_t failed = cuckoo::VerifyProofsOfWork(checks, params, cuckoo::GetVerifyThreadPool());
+        if (failed < checks.size()) {
+            invalid = trusted[b + failed];
+            return error("%s: trusted header %s has an invalid proof-of-work",
+                    __func__, invalid->GetBlockHash().ToString());
+        }
+    }
+
+    return true;
+}
+
+void ThreadReverifyBlockIndex()
+{
+    RenameThread("merit-reverifyidx");
+
+    std::vector<CBlockIndex*> trusted;
+    {
+        LOCK(cs_main);
+        trusted.swap(vTrustedBlockIndex);
+    }
+
+    if (trusted.empty()) {
+        return;
+    }
+
+    LogPrintf("%s: verifying the proof-of-work of %u trusted headers\n", __func__, trusted.size());
+    const int64_t nStart = GetTimeMillis();
+
+    const CBlockIndex* invalid = nullptr;
+    if (!ReverifyBlockIndex(trusted, invalid)) {
+        if (invalid) {
+            AbortNode(
+                    strprintf("Trusted header %s has an invalid proof-of-work",
+                        invalid->GetBlockHash().ToString()),
+                    _("The block index is corrupted. You need to rebuild the database using -reindex."));
+        } else {
+            AbortNode("Failed to read the cycles of trusted headers",
+                    _("Error reading from database, shutting down."));
+        }
+        return;
+    }
+
+    LogPrintf("%s: verified %u trusted headers in %dms\n", __func__, trusted.size(), GetTimeMillis() - nStart);
+}
+
 bool LoadChainTip(const CChainParams& chainparams, bool sample)
 {
     if (chainActive.Tip() && chainActive.Tip()->GetBlockHash() == pcoinsTip->GetBestBlock()) return true;
@@ -7083,6 +7525,7 @@ bool RewindBlockIndex(const CChainParams& params)
 void UnloadBlockIndex()
 {
     LOCK(cs_main);
+    vTrustedBlockIndex.clear();
     setBlockIndexCandidates.clear();
     chainActive.SetTip(nullptr);
     pindexBestInvalid = nullptr;
@@ -7604,6 +8047,34 @@ bool DumpMempool(void)
     return true;
 }
 
+bool DumpUnspentCache()
+{
+    int64_t start = GetTimeMicros();
+
+    uint256 best_block;
+    CAddressUnspentCache::Snapshot snapshot;
+    {
+        LOCK(cs_main);
+        if (!pblocktree || !chainActive.Tip()) {
+            return false;
+        }
+        best_block = chainActive.Tip()->GetBlockHash();
+        snapshot = pblocktree->GetUnspentCache().GetSnapshot();
+    }
+
+    int64_t mid = GetTimeMicros();
+
+    if (!WriteUnspentSnapshot(GetDataDir() / UNSPENT_SNAPSHOT_FILENAME, best_block, snapshot)) {
+        LogPrintf("Failed to dump address unspent cache. Continuing anyway.\n");
+        return false;
+    }
+
+    int64_t last = GetTimeMicros();
+    LogPrintf("Dumped address unspent cache at %s: %gs to copy, %gs to dump\n",
+            best_block.GetHex(), (mid-start)*MICRO, (last-mid)*MICRO);
+    return true;
+}
+
 bool LoadReferralMempool()
 {
     // use the same variable as for mempool expiry
@@ -7813,39 +8284,89 @@ std::pair<Ranks, size_t> TopANVRanks(
     return {ranks, entrants.size()};
 }
 
-std::pair<Pog3Ranks, size_t> CGSRanks(
-        const std::vector<CAmount>& cgs,
-        int height,
-        const Consensus::Params& params,
-        CAmount& lottery_cgs)
+namespace
 {
-    assert(height >= 0);
-    assert(prefviewcache);
-
-    static size_t max_ambassador_lottery = 0;
-    pog3::Entrants entrants;
-
-    // unlikely that the candidates grew over 50% since last time.
-    auto reserve_size = max_ambassador_lottery * 1.5;
-    entrants.reserve(reserve_size);
+CGSSnapshotPtr BuildCGSSnapshot(const CBlockIndex* tip, const Consensus::Params& params)
+{
+    AssertLockHeld(cs_main);
+    assert(tip);
 
-    pog3::CGSContext context;
-    context.cgs_pool = pog3::GetCgsThreadPool();
+    auto snapshot = std::make_shared<CGSSnapshot>();
+    snapshot->block_hash = tip->GetBlockHash();
+    snapshot->height = tip->nHeight;
 
-    pog3::GetAllRewardableEntrants(context, *prefviewcache, params, height, entrants);
+    auto& context = snapshot->context;
+    GetPog3Entrants(context, snapshot->block_hash, snapshot->height, params, snapshot->entrants);
 
-    max_ambassador_lottery = std::max(max_ambassador_lottery, entrants.size());
+    //Balances are aged already so the coins are not needed anymore.
+    context.coins.clear();
+    context.coins.shrink_to_fit();
 
-    lottery_cgs = std::accumulate(entrants.begin(), entrants.end(), CAmount{0},
+    snapshot->lottery_cgs = std::accumulate(
+            snapshot->entrants.begin(), snapshot->entrants.end(), CAmount{0},
             [](CAmount acc, const pog3::Entrant& e) {
                 return acc + e.cgs;
             });
 
-    std::sort(entrants.begin(), entrants.end(),
+    for (const auto& e : snapshot->entrants) {
+        snapshot->cgs[e.address] = e.cgs;
+    }
+
+    snapshot->sorted = snapshot->entrants;
+    std::sort(snapshot->sorted.begin(), snapshot->sorted.end(),
             [](const pog3::Entrant& a, const pog3::Entrant& b) {
                 return a.cgs < b.cgs;
             });
 
+    return snapshot;
+}
+} // namespace
+
+CGSSnapshotPtr GetCGSSnapshot(const Consensus::Params& params)
+{
+    auto snapshot = std::atomic_load(&g_cgs_snapshot);
+    if (snapshot) {
+        return snapshot;
+    }
+
+    LOCK(cs_main);
+
+    //Another caller may have computed it while we waited for the lock.
+    snapshot = std::atomic_load(&g_cgs_snapshot);
+    if (snapshot) {
+        return snapshot;
+    }
+
+    if (!chainActive.Tip()) {
+        return {};
+    }
+
+    snapshot = BuildCGSSnapshot(chainActive.Tip(), params);
+    std::atomic_store(&g_cgs_snapshot, snapshot);
+    return snapshot;
+}
+
+CAmount GetSnapshotCGS(const CGSSnapshot& snapshot, const referral::Address& address)
+{
+    const auto cgs = snapshot.cgs.find(address);
+    if (cgs != snapshot.cgs.end()) {
+        return cgs->second;
+    }
+
+    const auto entrant = snapshot.context.FindEntrant(address);
+    if (!entrant) {
+        return 0;
+    }
+
+    return pog3::ComputeCGS(snapshot.context, *entrant).cgs;
+}
+
+std::pair<Pog3Ranks, size_t> CGSRanks(
+        const CGSSnapshot& snapshot,
+        const std::vector<CAmount>& cgs)
+{
+    const auto& entrants = snapshot.sorted;
+
     Pog3Ranks ranks;
     ranks.resize(cgs.size());
 
@@ -7855,7 +8376,14 @@ std::pair<Pog3Ranks, size_t> CGSRanks(
                         [](const pog3::Entrant& a, CAmount cgs) {
                             return a.cgs < cgs;
                         });
-                return std::make_pair(*pos, std::distance(entrants.begin(), pos));
+
+                if (pos == entrants.end()) {
+                    return pos == entrants.begin() ?
+                        std::make_pair(pog3::Entrant{}, size_t{0}) :
+                        std::make_pair(*std::prev(pos), entrants.size());
+                }
+
+                return std::make_pair(*pos, static_cast<size_t>(std::distance(entrants.begin(), pos)));
             });
 
     size_t total = entrants.size();
@@ -7863,44 +8391,18 @@ std::pair<Pog3Ranks, size_t> CGSRanks(
 }
 
 std::pair<Pog3Ranks, size_t> TopCGSRanks(
-        size_t total,
-        int height,
-        const Consensus::Params& params,
-        CAmount& lottery_cgs)
+        const CGSSnapshot& snapshot,
+        size_t total)
 {
-    assert(height >= 0);
-    assert(prefviewcache);
-
-    static size_t max_ambassador_lottery = 0;
-    pog3::Entrants entrants;
-
-    // unlikely that the candidates grew over 50% since last time.
-    auto reserve_size = max_ambassador_lottery * 1.5;
-    entrants.reserve(reserve_size);
-
-    pog3::CGSContext context;
-    context.cgs_pool = pog3::GetCgsThreadPool();
-
-    pog3::GetAllRewardableEntrants(context, *prefviewcache, params, height, entrants);
-
-    lottery_cgs = std::accumulate(entrants.begin(), entrants.end(), CAmount{0},
-            [](CAmount acc, const pog3::Entrant& e) {
-                return acc + e.cgs;
-            });
-
-    max_ambassador_lottery = std::max(max_ambassador_lottery, entrants.size());
+    const auto& entrants = snapshot.sorted;
     total = std::min(total, entrants.size());
 
-    std::partial_sort(entrants.begin(), entrants.begin() + total, entrants.end(),
-            [](const pog3::Entrant& a, const pog3::Entrant& b) {
-                return a.cgs > b.cgs;
-            });
-
     Pog3Ranks ranks;
     ranks.resize(total);
 
+    //entrants are in ascending order so the top ranks are at the end.
     int pos = 1;
-    std::transform(entrants.begin(), entrants.begin() + total, ranks.begin(),
+    std::transform(entrants.rbegin(), entrants.rbegin() + total, ranks.begin(),
             [&pos,&entrants](const pog3::Entrant& e) {
                 return std::make_pair(e, entrants.size() - pos++);
             });
@@ -35,6 +35,7 @@
 #include <atomic>
 #include <exception>
 #include <map>
+#include <memory>
 #include <set>
 #include <stdint.h>
 #include <string>
@@ -102,6 +103,8 @@ static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** -addressindexthreads default (number of address index reader threads, 0 = auto) */
+static const int DEFAULT_ADDRESS_INDEX_THREADS = 0;
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 32;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
@@ -123,6 +126,8 @@ static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
 static const unsigned int DATABASE_WRITE_INTERVAL = 60 * 60;
 /** Time to wait (in seconds) between flushing chainstate to disk. */
 static const unsigned int DATABASE_FLUSH_INTERVAL = 24 * 60 * 60;
+/** Time to wait (in seconds) between snapshots of the address unspent cache. */
+static const unsigned int UNSPENT_CACHE_DUMP_INTERVAL = 6 * 60 * 60;
 /** Maximum length of reject messages. */
 static const unsigned int MAX_REJECT_MESSAGE_LENGTH = 111;
 /** Average delay between local address broadcasts in seconds. */
@@ -156,16 +161,28 @@ static const int64_t MAX_FEE_ESTIMATION_TIP_AGE = 3 * 60 * 60;
 /** Default for -permitbaremultisig */
 static const bool DEFAULT_PERMIT_BAREMULTISIG = true;
 static const bool DEFAULT_CHECKPOINTS_ENABLED = true;
+static const bool DEFAULT_CHECK_CGS = false;
 static const bool DEFAULT_TXINDEX = true;
 static const bool DEFAULT_ADDRESSINDEX = true;
 static const bool DEFAULT_TIMESTAMPINDEX = true;
 static const bool DEFAULT_SPENTINDEX = true;
 static const bool DEFAULT_REFERRALINDEX = true;
+static const bool DEFAULT_BALANCEINDEX = false;
+/** Default for -trustblockindex */
+static const bool DEFAULT_TRUST_BLOCK_INDEX = false;
+/** Default for -blockindexkey, relative to the data directory */
+static const char* const DEFAULT_BLOCK_INDEX_KEY_FILE = "blockindex.key";
+/** Default for -reverifyblockindex */
+static const bool DEFAULT_REVERIFY_BLOCK_INDEX = true;
+/** Default for -cycledepth */
+static const int DEFAULT_CYCLE_DEPTH = 0;
 static const unsigned int DEFAULT_DB_MAX_OPEN_FILES = 1000;
 static const bool DEFAULT_DB_COMPRESSION = true;
 static const unsigned int DEFAULT_BANSCORE_THRESHOLD = 100;
 /** Default for -persistmempool */
 static const bool DEFAULT_PERSIST_MEMPOOL = true;
+/** Default for -persistunspentcache */
+static const bool DEFAULT_PERSIST_UNSPENT_CACHE = true;
 /** Default for -mempoolreplacement */
 static const bool DEFAULT_ENABLE_REPLACEMENT = true;
 /** Default for using fee filter */
@@ -207,6 +224,8 @@ extern int nScriptCheckThreads;
 extern bool fIsBareMultisigStd;
 extern bool fRequireStandard;
 extern bool fCheckBlockIndex;
+/** Compare the incremental CGS state against a full recomputation for every lottery */
+extern bool fCheckCGS;
 extern bool fCheckpointsEnabled;
 extern size_t nCoinCacheUsage;
 /** A fee rate smaller than this is considered zero fee (for relaying, mining and transaction creation) */
@@ -318,6 +337,13 @@ bool LoadChainTip(const CChainParams& chainparams, bool sample);
 void UnloadBlockIndex();
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/**
+ * Verify the proof-of-work of headers trusted when loading the block index.
+ * Fails if a cycle cannot be read or, setting invalid, if a header is invalid.
+ */
+bool ReverifyBlockIndex(const std::vector<CBlockIndex*>& trusted, const CBlockIndex*& invalid);
+/** Verify the proof-of-work of the headers trusted when loading the block index */
+void ThreadReverifyBlockIndex();
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
 bool IsInitialBlockDownload();
 /** Retrieve a transaction (from memory pool, or from disk, if possible) */
@@ -371,6 +397,14 @@ std::pair<pog::AmbassadorLottery, pog2::AddressSelectorPtr> Pog2RewardAmbassador
         const Consensus::Params& params,
         bool force_pog2 = false);
 
+/** Same as above using entrants that were already computed */
+std::pair<pog::AmbassadorLottery, pog2::AddressSelectorPtr> Pog2RewardAmbassadors(
+        int height,
+        const uint256& previous_block_hash,
+        CAmount total,
+        const Consensus::Params& params,
+        const pog2::Entrants& entrants);
+
 std::pair<pog::AmbassadorLottery, pog3::AddressSelectorPtr> Pog3RewardAmbassadors(
         int height,
         const uint256& previous_block_hash,
@@ -378,6 +412,14 @@ std::pair<pog::AmbassadorLottery, pog3::AddressSelectorPtr> Pog3RewardAmbassador
         const Consensus::Params& params,
         bool force_pog3 = false);
 
+/** Same as above using entrants that were already computed */
+std::pair<pog::AmbassadorLottery, pog3::AddressSelectorPtr> Pog3RewardAmbassadors(
+        int height,
+        const uint256& previous_block_hash,
+        CAmount total,
+        const Consensus::Params& params,
+        const pog3::Entrants& entrants);
+
 bool RewardInvites(
         pog2::AddressSelectorPtr,
         pog3::AddressSelectorPtr,
@@ -571,6 +613,42 @@ bool GetAllUnspent(
         bool invite,
         std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs);
 
+/** Reads the totals of an address from the balance index. Returns false if it is disabled. */
+bool GetAddressBalance(
+        uint160 addressHash,
+        unsigned int type,
+        bool invite,
+        CAddressBalanceValue& balance);
+
+/** The outputs of one address and kind in the address index */
+struct AddressQuery
+{
+    uint160 addressHash;
+    unsigned int type;
+    bool invite;
+};
+using AddressQueries = std::vector<AddressQuery>;
+
+/**
+ * Reads the address index of a batch of addresses on the address index
+ * pool. Each address, and each range of heights of an address when there
+ * are fewer addresses than threads, is scanned by its own job. The results
+ * are appended in the same order as scanning the queries one by one.
+ */
+bool GetAddressIndex(
+        const AddressQueries& queries,
+        std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex,
+        int start = 0,
+        int end = 0);
+
+/** Reads the unspent outputs of a batch of addresses on the address index pool */
+bool GetAddressUnspent(
+        const AddressQueries& queries,
+        std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs);
+
+/** Sets the number of threads reading the address index for batches */
+void SetupAddressIndexThreadPool(size_t threads);
+
 /** Initializes the script-execution cache */
 void InitScriptExecutionCache();
 
@@ -739,6 +817,9 @@ bool LoadReferralMempool();
 /** Dump referral mempool to disk. */
 void DumpReferralMempool();
 
+/** Dump the address unspent cache at the chain tip to disk. */
+bool DumpUnspentCache();
+
 /** 
  * Returns the rank out of a total in the lottery given the anv specified.
  * In other words, the rank is the amount of entrants that have a smaller rank
@@ -763,17 +844,67 @@ std::pair<Ranks, size_t> TopANVRanks(
         int height,
         const Consensus::Params& params);
 
-std::pair<Pog3Ranks, size_t> CGSRanks(
-        const std::vector<CAmount>& cgs,
+/**
+ * Computes the pog3 entrants for the chain ending at block_hash using the
+ * incrementally maintained CGS state. The state is rebuilt if it does not
+ * match block_hash and compared to a full recomputation with -checkcgs.
+ * Blocks other than the tip are computed in full. Requires cs_main.
+ */
+void GetPog3Entrants(
+        pog3::CGSContext& context,
+        const uint256& block_hash,
         int height,
         const Consensus::Params& params,
-        CAmount& lottery_cgs);
+        pog3::Entrants& entrants);
+
+/**
+ * The pog3 entrants of a tip computed once and shared read only by the rank,
+ * leaderboard and lottery simulation RPCs so they don't recompute the CGS of
+ * the whole network under cs_main for every request.
+ */
+struct CGSSnapshot
+{
+    uint256 block_hash;
+    int height;
+    CAmount lottery_cgs;
+
+    //Entrants in the order the lottery sees them.
+    pog3::Entrants entrants;
+
+    //Entrants sorted by ascending cgs.
+    pog3::Entrants sorted;
+
+    //cgs of each entrant by address.
+    std::map<referral::Address, CAmount> cgs;
+
+    //The fully computed context of every address in the tree. The cgs of
+    //addresses that are not entrants is computed from it without cs_main.
+    pog3::CGSContext context;
+};
+
+using CGSSnapshotPtr = std::shared_ptr<const CGSSnapshot>;
+
+/**
+ * Returns the snapshot of the current tip. It is computed by the first
+ * caller after the tip changes, other callers don't take cs_main.
+ * Returns null if there is no tip.
+ */
+CGSSnapshotPtr GetCGSSnapshot(const Consensus::Params& params);
+
+/**
+ * The cgs of an address as of the tip of the snapshot. Addresses beaconed
+ * after that tip, which callers can see while a block is being connected,
+ * have a cgs of 0.
+ */
+CAmount GetSnapshotCGS(const CGSSnapshot& snapshot, const referral::Address& address);
+
+std::pair<Pog3Ranks, size_t> CGSRanks(
+        const CGSSnapshot& snapshot,
+        const std::vector<CAmount>& cgs);
 
 std::pair<Pog3Ranks, size_t> TopCGSRanks(
-        size_t total,
-        int height,
-        const Consensus::Params& params,
-        CAmount& lottery_cgs);
+        const CGSSnapshot& snapshot,
+        size_t total);
 
 template<class F>
     bool GetAllUnspent(
@@ -787,5 +918,22 @@ template<class F>
         return true;
     }
 
+/**
+ * Same as above except the unspent outputs are split into partitions which
+ * are processed concurrently. See CBlockTreeDB::ReadAllAddressUnspent.
+ */
+template<class Pool, class F>
+    bool GetAllUnspent(
+            Pool& pool,
+            size_t partitions,
+            F process)
+    {
+        if (!pblocktree->ReadAllAddressUnspent(pool, partitions, process)) {
+            return error("unable to get all unspent");
+        }
+
+        return true;
+    }
+
 
 #endif // MERIT_VALIDATION_H
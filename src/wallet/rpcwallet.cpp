@@ -4470,9 +4470,7 @@ UniValue getcommunityinfo(const JSONRPCRequest& request)
     }
 
 
-    auto children = prefviewdb->GetChildren(address);
-
-    obj.push_back(Pair("referralcount", (int)children.size()));
+    obj.push_back(Pair("referralcount", (int)prefviewdb->GetChildCount(address)));
 
     return obj;
 }